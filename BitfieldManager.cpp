@@ -5,16 +5,43 @@ BitfieldManager::BitfieldManager() {}
 BitfieldManager::BitfieldManager(size_t numPieces, bool has){
     size = numPieces;
     bits.insert(bits.end(), numPieces, has);
+    piecesHeld = has ? numPieces : 0;
+}
+
+BitfieldManager::BitfieldManager(const BitfieldManager& other)
+    : bits(other.bits), size(other.size), piecesHeld(other.count()) {}
+
+BitfieldManager& BitfieldManager::operator=(const BitfieldManager& other) {
+    bits = other.bits;
+    size = other.size;
+    piecesHeld = other.count();
+    return *this;
 }
 
 // set a bit
-void BitfieldManager::setPiece(size_t index) {
+bool BitfieldManager::setPiece(size_t index) {
+    if (bits[index]) return false;
     bits[index] = true;
+    piecesHeld++;
+    return true;
 }
 
 // clear a bit
-void BitfieldManager::clearPiece(size_t index) {
+bool BitfieldManager::clearPiece(size_t index) {
+    if (!bits[index]) return false;
     bits[index] = false;
+    piecesHeld--;
+    return true;
+}
+
+void BitfieldManager::setAllPieces() {
+    bits.assign(size, true);
+    piecesHeld = size;
+}
+
+void BitfieldManager::clearAllPieces() {
+    bits.assign(size, false);
+    piecesHeld = 0;
 }
 
 // return a bit
@@ -24,11 +51,7 @@ bool BitfieldManager::hasPiece(size_t index) const {
 
 // check if all bits are 1: has the full file
 bool BitfieldManager::isComplete() const {
-    for (int i =0; i < size; i++) {
-        if (!bits[i])
-            return false;
-    }
-    return true;
+    return count() == size;
 }
 
 
@@ -42,29 +65,3 @@ std::vector<uint8_t> BitfieldManager::toBytes() const {
     }
     return bytes;
 }
-
-// convert an array of bytes to bitfield
-BitfieldManager BitfieldManager::toBits(const std::vector<uint8_t>& bytes, size_t numPieces) {
-    BitfieldManager bitfield(numPieces, false);
-    for (size_t i = 0; i < numPieces; i++) {
-        size_t byteIndex = i / 8;
-        size_t bitIndex = 7 - (i % 8);
-        bitfield.bits[i] = (bytes[byteIndex] >> bitIndex) & 1;
-
-	if (byteIndex < bytes.size()) {
-            bitfield.bits[i] = (bytes[byteIndex] >> bitIndex) & 1;
-        } else {
-            bitfield.bits[i] = false; // extra bits are just 0
-        }
-    }
-    return bitfield;
-}
-
-bool BitfieldManager::compareBitfields(const BitfieldManager& theirs) {
-    for(int i = 0; i < size; i++){
-        if(theirs.hasPiece(i) && !hasPiece(i)){
-            return true;
-        }
-    }
-    return false;
-}
@@ -1,16 +1,22 @@
 #include <vector>
 #include <cstdint>
 #include <string>
+#include <atomic>
 #pragma once
 
 class BitfieldManager {
 private:
     std::vector<bool> bits; // 1 = has, 0 = doesn't have
-    size_t size;
+    size_t size = 0;
+    // number of set bits, kept up to date by every setter, the bits change under peersMutex
+    // but progress and completion checks read the count without it
+    std::atomic<size_t> piecesHeld{0};
 
 public:
     BitfieldManager();
     explicit BitfieldManager(size_t numPieces, bool has);
+    BitfieldManager(const BitfieldManager& other);
+    BitfieldManager& operator=(const BitfieldManager& other);
 
     std::vector<bool> getBits(){
         return bits;
@@ -19,11 +25,13 @@ public:
         return size;
     }
 
-    void setPiece(size_t index);
-    void clearPiece(size_t index);
+    // both return true only if the bit actually changed
+    bool setPiece(size_t index);
+    bool clearPiece(size_t index);
     bool hasPiece(size_t index) const;
-
-    bool compareBitfields(const BitfieldManager& theirs);
+    size_t count() const {
+        return piecesHeld.load(std::memory_order_relaxed);
+    }
 
     void setAllPieces();
     void clearAllPieces();
@@ -31,5 +39,4 @@ public:
 
 
     std::vector<uint8_t> toBytes() const;
-    static BitfieldManager toBits(const std::vector<uint8_t>& data, size_t numPieces);
 };
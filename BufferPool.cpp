@@ -0,0 +1,178 @@
+#include "BufferPool.h"
+#include <algorithm>
+#include <new>
+
+struct PooledBuffer::Block {
+    std::atomic<uint32_t> refs;
+    size_t size;
+    size_t capacity;
+    BufferPool::SizeClass* owner;   // null for heap blocks
+    BufferPool::State* state;
+
+    uint8_t* bytes() {
+        return reinterpret_cast<uint8_t*>(this + 1);
+    }
+};
+
+struct BufferPool::SizeClass {
+    size_t capacity;
+    size_t blockBytes;
+    size_t blocksPerSlab;
+    std::mutex mutex;
+    std::vector<PooledBuffer::Block*> free;
+    std::vector<std::unique_ptr<uint8_t[]>> slabs;
+};
+
+// outlives the pool while any of its blocks are still out
+struct BufferPool::State {
+    std::vector<std::unique_ptr<SizeClass>> classes;
+    std::atomic<size_t> refs{1};    // the pool itself plus every pooled block in use
+};
+
+namespace {
+
+constexpr size_t kSlabBytes = 1 << 20;
+
+size_t roundUp(size_t n, size_t align) {
+    return (n + align - 1) / align * align;
+}
+
+}
+
+PooledBuffer::PooledBuffer(const PooledBuffer& other) : block_(other.block_) {
+    if (block_) block_->refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+PooledBuffer::PooledBuffer(PooledBuffer&& other) noexcept : block_(other.block_) {
+    other.block_ = nullptr;
+}
+
+PooledBuffer& PooledBuffer::operator=(const PooledBuffer& other) {
+    if (this != &other) {
+        if (other.block_) other.block_->refs.fetch_add(1, std::memory_order_relaxed);
+        release();
+        block_ = other.block_;
+    }
+    return *this;
+}
+
+PooledBuffer& PooledBuffer::operator=(PooledBuffer&& other) noexcept {
+    if (this != &other) {
+        release();
+        block_ = other.block_;
+        other.block_ = nullptr;
+    }
+    return *this;
+}
+
+PooledBuffer::~PooledBuffer() {
+    release();
+}
+
+uint8_t* PooledBuffer::data() {
+    return block_ ? block_->bytes() : nullptr;
+}
+
+const uint8_t* PooledBuffer::data() const {
+    return block_ ? block_->bytes() : nullptr;
+}
+
+size_t PooledBuffer::size() const {
+    return block_ ? block_->size : 0;
+}
+
+size_t PooledBuffer::capacity() const {
+    return block_ ? block_->capacity : 0;
+}
+
+void PooledBuffer::resize(size_t n) {
+    if (block_) block_->size = std::min(n, block_->capacity);
+}
+
+void PooledBuffer::release() {
+    if (!block_) return;
+    if (block_->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        BufferPool::recycle(block_);
+    }
+    block_ = nullptr;
+}
+
+BufferPool::BufferPool(std::vector<size_t> classSizes) : state_(new State()) {
+    std::sort(classSizes.begin(), classSizes.end());
+    classSizes.erase(std::unique(classSizes.begin(), classSizes.end()), classSizes.end());
+    for (size_t capacity : classSizes) {
+        if (capacity == 0) continue;
+        auto cls = std::make_unique<SizeClass>();
+        cls->capacity = capacity;
+        cls->blockBytes = roundUp(sizeof(PooledBuffer::Block) + capacity, alignof(std::max_align_t));
+        cls->blocksPerSlab = std::max<size_t>(1, kSlabBytes / cls->blockBytes);
+        state_->classes.push_back(std::move(cls));
+    }
+}
+
+BufferPool::~BufferPool() {
+    if (state_->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) delete state_;
+}
+
+PooledBuffer BufferPool::acquire(size_t size) {
+    for (auto& cls : state_->classes) {
+        if (size > cls->capacity) continue;
+
+        PooledBuffer::Block* block;
+        {
+            std::lock_guard<std::mutex> lock(cls->mutex);
+            if (cls->free.empty()) {
+                // carve a new slab into blocks of this class
+                std::unique_ptr<uint8_t[]> slab(new uint8_t[cls->blockBytes * cls->blocksPerSlab]);
+                for (size_t i = 0; i < cls->blocksPerSlab; i++) {
+                    auto* fresh = new (slab.get() + i * cls->blockBytes) PooledBuffer::Block();
+                    fresh->capacity = cls->capacity;
+                    fresh->owner = cls.get();
+                    fresh->state = state_;
+                    cls->free.push_back(fresh);
+                }
+                cls->slabs.push_back(std::move(slab));
+            }
+            block = cls->free.back();
+            cls->free.pop_back();
+        }
+        block->refs.store(1, std::memory_order_relaxed);
+        block->size = size;
+        state_->refs.fetch_add(1, std::memory_order_relaxed);
+        return PooledBuffer(block);
+    }
+
+    // bigger than any class, fall back to a one-off heap block
+    void* raw = ::operator new(sizeof(PooledBuffer::Block) + size);
+    auto* block = new (raw) PooledBuffer::Block();
+    block->refs.store(1, std::memory_order_relaxed);
+    block->size = size;
+    block->capacity = size;
+    block->owner = nullptr;
+    block->state = nullptr;
+    return PooledBuffer(block);
+}
+
+size_t BufferPool::slabBytes() const {
+    size_t total = 0;
+    for (auto& cls : state_->classes) {
+        std::lock_guard<std::mutex> lock(cls->mutex);
+        total += cls->slabs.size() * cls->blocksPerSlab * cls->blockBytes;
+    }
+    return total;
+}
+
+void BufferPool::recycle(PooledBuffer::Block* block) {
+    if (!block->owner) {
+        block->~Block();
+        ::operator delete(block);
+        return;
+    }
+
+    State* state = block->state;
+    {
+        std::lock_guard<std::mutex> lock(block->owner->mutex);
+        block->owner->free.push_back(block);
+    }
+    if (state->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) delete state;
+}
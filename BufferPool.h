@@ -0,0 +1,93 @@
+#pragma once
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// non-owning view of bytes, valid while whatever owns them is alive
+struct ByteView {
+    const uint8_t* data = nullptr;
+    size_t size = 0;
+
+    ByteView() = default;
+    ByteView(const uint8_t* d, size_t n) : data(d), size(n) {}
+
+    const uint8_t& operator[](size_t i) const {
+        return data[i];
+    }
+    bool empty() const {
+        return size == 0;
+    }
+    const uint8_t* begin() const {
+        return data;
+    }
+    const uint8_t* end() const {
+        return data + size;
+    }
+    ByteView subview(size_t offset) const {
+        return offset >= size ? ByteView(data + size, 0) : ByteView(data + offset, size - offset);
+    }
+};
+
+class BufferPool;
+
+// handle to a pooled buffer, copies share the same bytes through a reference count
+// the buffer goes back to its pool's free list when the last handle is dropped
+class PooledBuffer {
+public:
+    PooledBuffer() = default;
+    PooledBuffer(const PooledBuffer& other);
+    PooledBuffer(PooledBuffer&& other) noexcept;
+    PooledBuffer& operator=(const PooledBuffer& other);
+    PooledBuffer& operator=(PooledBuffer&& other) noexcept;
+    ~PooledBuffer();
+
+    uint8_t* data();
+    const uint8_t* data() const;
+    size_t size() const;
+    size_t capacity() const;
+    // only shrinks or grows within capacity
+    void resize(size_t n);
+
+    ByteView view() const {
+        return ByteView(data(), size());
+    }
+    explicit operator bool() const {
+        return block_ != nullptr;
+    }
+
+private:
+    friend class BufferPool;
+    struct Block;
+    explicit PooledBuffer(Block* block) : block_(block) {}
+    void release();
+
+    Block* block_ = nullptr;
+};
+
+// slab allocator for message buffers, one free list per size class
+// requests larger than every class are served from the heap and freed on release
+class BufferPool {
+public:
+    explicit BufferPool(std::vector<size_t> classSizes);
+    ~BufferPool();
+
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    PooledBuffer acquire(size_t size);
+
+    // bytes held in slabs, whether in use or free
+    size_t slabBytes() const;
+
+private:
+    friend class PooledBuffer;
+    struct SizeClass;
+    struct State;
+
+    static void recycle(PooledBuffer::Block* block);
+
+    State* state_;
+};
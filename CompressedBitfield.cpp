@@ -0,0 +1,177 @@
+#include "CompressedBitfield.h"
+#include <algorithm>
+
+CompressedBitfield::CompressedBitfield(size_t numPieces, bool has) : size_(numPieces), held_(has ? numPieces : 0) {
+    chunks_.resize((numPieces + kChunkBits - 1) / kChunkBits);
+    for (size_t c = 0; c < chunks_.size(); c++) {
+        Chunk& chunk = chunks_[c];
+        chunk.span = static_cast<uint32_t>(std::min(kChunkBits, numPieces - c * kChunkBits));
+        // an empty missing list is a full chunk
+        if (has) {
+            chunk.kind = Kind::Inverted;
+            chunk.held = chunk.span;
+        }
+    }
+}
+
+CompressedBitfield CompressedBitfield::fromBytes(const uint8_t* data, size_t len, size_t numPieces) {
+    CompressedBitfield bitfield(numPieces, false);
+    for (size_t c = 0; c < bitfield.chunks_.size(); c++) {
+        Chunk& chunk = bitfield.chunks_[c];
+        // build every chunk as a bitmap, then shrink it to the form its count calls for
+        chunk.words.assign((chunk.span + 63) / 64, 0);
+        const size_t base = c * kChunkBits;
+        for (uint32_t offset = 0; offset < chunk.span; offset++) {
+            const size_t i = base + offset;
+            if (i / 8 >= len) break;
+            // big-endian within each byte
+            if ((data[i / 8] >> (7 - i % 8)) & 1) {
+                chunk.words[offset / 64] |= uint64_t(1) << (offset % 64);
+                chunk.held++;
+            }
+        }
+        chunk.kind = Kind::Bitmap;
+        chunk.normalize();
+        bitfield.held_ += chunk.held;
+    }
+    return bitfield;
+}
+
+bool CompressedBitfield::setPiece(size_t index) {
+    if (!chunks_[index / kChunkBits].set(static_cast<uint32_t>(index % kChunkBits))) return false;
+    held_++;
+    return true;
+}
+
+bool CompressedBitfield::clearPiece(size_t index) {
+    if (!chunks_[index / kChunkBits].clear(static_cast<uint32_t>(index % kChunkBits))) return false;
+    held_--;
+    return true;
+}
+
+bool CompressedBitfield::hasPiece(size_t index) const {
+    return chunks_[index / kChunkBits].has(static_cast<uint32_t>(index % kChunkBits));
+}
+
+size_t CompressedBitfield::countNotIn(const BitfieldManager& ours) const {
+    size_t missing = 0;
+    forEachNotIn(ours, [&missing](size_t) { missing++; });
+    return missing;
+}
+
+size_t CompressedBitfield::memoryUsage() const {
+    size_t bytes = chunks_.capacity() * sizeof(Chunk);
+    for (const Chunk& chunk : chunks_) {
+        bytes += chunk.list.capacity() * sizeof(uint16_t) + chunk.words.capacity() * sizeof(uint64_t);
+    }
+    return bytes;
+}
+
+bool CompressedBitfield::Chunk::has(uint32_t offset) const {
+    switch (kind) {
+        case Kind::Array:
+            return std::binary_search(list.begin(), list.end(), static_cast<uint16_t>(offset));
+        case Kind::Bitmap:
+            return (words[offset / 64] >> (offset % 64)) & 1;
+        case Kind::Inverted:
+            return !std::binary_search(list.begin(), list.end(), static_cast<uint16_t>(offset));
+    }
+    return false;
+}
+
+bool CompressedBitfield::Chunk::set(uint32_t offset) {
+    const uint16_t key = static_cast<uint16_t>(offset);
+    switch (kind) {
+        case Kind::Array: {
+            auto it = std::lower_bound(list.begin(), list.end(), key);
+            if (it != list.end() && *it == key) return false;
+            list.insert(it, key);
+            break;
+        }
+        case Kind::Bitmap: {
+            uint64_t& word = words[offset / 64];
+            const uint64_t bit = uint64_t(1) << (offset % 64);
+            if (word & bit) return false;
+            word |= bit;
+            break;
+        }
+        case Kind::Inverted: {
+            auto it = std::lower_bound(list.begin(), list.end(), key);
+            if (it == list.end() || *it != key) return false;
+            list.erase(it);
+            break;
+        }
+    }
+    held++;
+    normalize();
+    return true;
+}
+
+bool CompressedBitfield::Chunk::clear(uint32_t offset) {
+    const uint16_t key = static_cast<uint16_t>(offset);
+    switch (kind) {
+        case Kind::Array: {
+            auto it = std::lower_bound(list.begin(), list.end(), key);
+            if (it == list.end() || *it != key) return false;
+            list.erase(it);
+            break;
+        }
+        case Kind::Bitmap: {
+            uint64_t& word = words[offset / 64];
+            const uint64_t bit = uint64_t(1) << (offset % 64);
+            if (!(word & bit)) return false;
+            word &= ~bit;
+            break;
+        }
+        case Kind::Inverted: {
+            auto it = std::lower_bound(list.begin(), list.end(), key);
+            if (it != list.end() && *it == key) return false;
+            list.insert(it, key);
+            break;
+        }
+    }
+    held--;
+    normalize();
+    return true;
+}
+
+void CompressedBitfield::Chunk::normalize() {
+    // bytes each form would take, a list costs two per entry
+    const uint32_t missing = span - held;
+    const size_t bitmapBytes = (span + 63) / 64 * 8;
+    Kind want = Kind::Bitmap;
+    if (2 * size_t(held) <= bitmapBytes && held <= missing)
+        want = Kind::Array;
+    else if (2 * size_t(missing) <= bitmapBytes)
+        want = Kind::Inverted;
+    if (want == kind) return;
+
+    if (kind != Kind::Bitmap) toBitmap();
+    if (want == Kind::Bitmap) return;
+
+    // collect the offsets whose bit matches what the list holds
+    const bool wantSet = want == Kind::Array;
+    list.clear();
+    list.reserve(wantSet ? held : missing);
+    for (uint32_t offset = 0; offset < span; offset++) {
+        const bool set = (words[offset / 64] >> (offset % 64)) & 1;
+        if (set == wantSet) list.push_back(static_cast<uint16_t>(offset));
+    }
+    std::vector<uint64_t>().swap(words);
+    kind = want;
+}
+
+void CompressedBitfield::Chunk::toBitmap() {
+    // an inverted chunk starts with every bit set and clears what is missing
+    const bool inverted = kind == Kind::Inverted;
+    words.assign((span + 63) / 64, inverted ? ~uint64_t(0) : 0);
+    if (inverted && span % 64) words.back() = (uint64_t(1) << (span % 64)) - 1;
+    for (uint16_t offset : list) {
+        if (inverted)
+            words[offset / 64] &= ~(uint64_t(1) << (offset % 64));
+        else
+            words[offset / 64] |= uint64_t(1) << (offset % 64);
+    }
+    std::vector<uint16_t>().swap(list);
+    kind = Kind::Bitmap;
+}
@@ -0,0 +1,108 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include "BitfieldManager.h"
+
+// what another peer has, stored so its size follows how much it tells us rather than the file size
+// pieces are split into chunks of 65536, and each chunk keeps whichever of three forms is smallest:
+//   array     sorted offsets of the pieces held, for a chunk that is mostly missing
+//   inverted  sorted offsets of the pieces missing, for a chunk that is mostly held
+//   bitmap    one bit per piece, once neither list would be smaller
+// an empty or complete chunk is an empty list, so a new peer or a seeder costs a few bytes per chunk
+class CompressedBitfield {
+public:
+    static constexpr size_t kChunkBits = 65536;
+
+    CompressedBitfield() = default;
+    explicit CompressedBitfield(size_t numPieces, bool has = false);
+    // from the wire format of a BITFIELD message, bits past numPieces are ignored
+    static CompressedBitfield fromBytes(const uint8_t* data, size_t len, size_t numPieces);
+
+    // true only if the bit actually changed
+    bool setPiece(size_t index);
+    bool clearPiece(size_t index);
+    bool hasPiece(size_t index) const;
+
+    size_t getSize() const {
+        return size_;
+    }
+    size_t count() const {
+        return held_;
+    }
+    bool isComplete() const {
+        return held_ == size_;
+    }
+
+    // calls f(index) for every piece held, in order
+    template <typename F>
+    void forEach(F f) const;
+    // calls f(index) for every piece held that ours lacks, in order
+    template <typename F>
+    void forEachNotIn(const BitfieldManager& ours, F f) const {
+        forEach([&](size_t index) {
+            if (!ours.hasPiece(index)) f(index);
+        });
+    }
+    // how many forEachNotIn would visit
+    size_t countNotIn(const BitfieldManager& ours) const;
+
+    // heap bytes held, for reporting
+    size_t memoryUsage() const;
+
+private:
+    enum class Kind : uint8_t { Array, Bitmap, Inverted };
+
+    struct Chunk {
+        Kind kind = Kind::Array;
+        uint32_t span = 0;      // pieces in this chunk, only the last is short
+        uint32_t held = 0;
+        std::vector<uint16_t> list;     // held for Array, missing for Inverted
+        std::vector<uint64_t> words;    // Bitmap only
+
+        bool has(uint32_t offset) const;
+        bool set(uint32_t offset);
+        bool clear(uint32_t offset);
+        // moves to the smallest form for its count
+        void normalize();
+        void toBitmap();
+    };
+
+    std::vector<Chunk> chunks_;
+    size_t size_ = 0;
+    size_t held_ = 0;
+};
+
+template <typename F>
+void CompressedBitfield::forEach(F f) const {
+    for (size_t c = 0; c < chunks_.size(); c++) {
+        const Chunk& chunk = chunks_[c];
+        const size_t base = c * kChunkBits;
+        switch (chunk.kind) {
+            case Kind::Array:
+                for (uint16_t offset : chunk.list) f(base + offset);
+                break;
+            case Kind::Bitmap:
+                for (size_t w = 0; w < chunk.words.size(); w++) {
+                    uint64_t word = chunk.words[w];
+                    while (word) {
+                        int bit = __builtin_ctzll(word);
+                        f(base + w * 64 + bit);
+                        word &= word - 1;
+                    }
+                }
+                break;
+            case Kind::Inverted: {
+                size_t next = 0;
+                for (uint32_t offset = 0; offset < chunk.span; offset++) {
+                    if (next < chunk.list.size() && chunk.list[next] == offset) {
+                        next++;
+                        continue;
+                    }
+                    f(base + offset);
+                }
+                break;
+            }
+        }
+    }
+}
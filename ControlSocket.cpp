@@ -0,0 +1,107 @@
+#include "ControlSocket.h"
+#include "messageSender.h"
+#include "Trace.h"
+#include <cstring>
+#ifdef _WIN32
+#include <afunix.h>
+#else
+#include <sys/un.h>
+#endif
+
+namespace {
+
+// how often a blocked accept or recv looks up to notice a stop
+constexpr long kPollMicros = 250000;
+
+// waits for the socket to become readable, false on a timeout
+bool waitReadable(SOCKET sock) {
+    fd_set readable;
+    FD_ZERO(&readable);
+    FD_SET(sock, &readable);
+    timeval timeout{0, kPollMicros};
+    return select(static_cast<int>(sock) + 1, &readable, nullptr, nullptr, &timeout) > 0;
+}
+
+}
+
+ControlSocket::ControlSocket(std::filesystem::path path, Handler handler)
+    : path_(std::move(path)), handler_(std::move(handler)) {}
+
+ControlSocket::~ControlSocket() {
+    stop();
+}
+
+bool ControlSocket::start() {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    const std::string name = path_.string();
+    if (name.size() >= sizeof(address.sun_path)) {
+        P2P_ERROR("Control socket path " << name << " is too long");
+        return false;
+    }
+    std::memcpy(address.sun_path, name.c_str(), name.size() + 1);
+
+    listener_ = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener_ == INVALID_SOCKET) {
+        P2P_ERROR("Could not create the control socket");
+        return false;
+    }
+    // left behind by a peer that did not shut down
+    std::error_code ignored;
+    std::filesystem::remove(path_, ignored);
+    if (bind(listener_, (SOCKADDR*)&address, sizeof(address)) == SOCKET_ERROR || listen(listener_, 4) == SOCKET_ERROR) {
+        P2P_ERROR("Could not listen on control socket " << name);
+        closesocket(listener_);
+        listener_ = INVALID_SOCKET;
+        return false;
+    }
+
+    P2P_INFO("Control socket listening on " << name);
+    thread_ = std::thread(&ControlSocket::serve, this);
+    return true;
+}
+
+void ControlSocket::stop() {
+    stopRequested_ = true;
+    if (thread_.joinable()) thread_.join();
+    if (listener_ != INVALID_SOCKET) {
+        closesocket(listener_);
+        listener_ = INVALID_SOCKET;
+        std::error_code ignored;
+        std::filesystem::remove(path_, ignored);
+    }
+}
+
+void ControlSocket::serve() {
+    while (!stopRequested_.load()) {
+        if (!waitReadable(listener_)) continue;
+        SOCKET client = accept(listener_, nullptr, nullptr);
+        if (client == INVALID_SOCKET) continue;
+        serveClient(client);
+        closesocket(client);
+    }
+}
+
+void ControlSocket::serveClient(SOCKET client) {
+    std::string pending;
+    char buffer[512];
+    while (!stopRequested_.load()) {
+        if (!waitReadable(client)) continue;
+        int r = recv(client, buffer, sizeof(buffer), 0);
+        if (r <= 0) return;
+        pending.append(buffer, r);
+
+        size_t end;
+        while ((end = pending.find('\n')) != std::string::npos) {
+            std::string line = pending.substr(0, end);
+            pending.erase(0, end + 1);
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            if (line.empty()) continue;
+
+            std::string reply = handler_(line);
+            if (!reply.empty() && reply.back() != '\n') reply += '\n';
+            reply += ".\n";
+            if (!sendFrame(client, reply.data(), reply.size(), nullptr, 0)) return;
+        }
+    }
+}
@@ -0,0 +1,38 @@
+#pragma once
+#include <string>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <filesystem>
+#include <winsock2.h>
+
+// a local Unix-domain socket that takes one command per line and answers each with
+// whatever the handler returns, followed by a line holding a single "."
+// one client at a time, for an operator or a script poking at a running peer:
+//     socat - UNIX-CONNECT:control_1001.sock
+class ControlSocket {
+public:
+    using Handler = std::function<std::string(const std::string& line)>;
+
+    ControlSocket(std::filesystem::path path, Handler handler);
+    ~ControlSocket();
+
+    ControlSocket(const ControlSocket&) = delete;
+    ControlSocket& operator=(const ControlSocket&) = delete;
+
+    // false if the socket could not be bound, the peer runs on without it
+    bool start();
+    // closes the socket and removes its file, safe to call more than once
+    void stop();
+
+private:
+    void serve();
+    // reads commands until the client hangs up or we stop
+    void serveClient(SOCKET client);
+
+    std::filesystem::path path_;
+    Handler handler_;
+    SOCKET listener_ = INVALID_SOCKET;
+    std::thread thread_;
+    std::atomic<bool> stopRequested_{false};
+};
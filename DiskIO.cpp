@@ -0,0 +1,837 @@
+#include "DiskIO.h"
+#include "Profile.h"
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <thread>
+#include <unordered_map>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <sys/uio.h>
+#endif
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>) && !defined(P2P_DISABLE_IO_URING)
+#define P2P_HAVE_IO_URING 1
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+namespace {
+
+// an open file, shared by every operation queued against it so a close never races an op
+struct OpenFile {
+    std::filesystem::path path;
+    bool writable = false;
+    int fd = -1;
+    int directFd = -1;
+    int slot = -1;          // registered file slot, -1 when not registered
+    int directSlot = -1;
+    std::mutex pathMutex;
+    std::function<void(OpenFile&)> release;
+
+    ~OpenFile() {
+        if (release) release(*this);
+#ifndef _WIN32
+        if (fd >= 0) ::close(fd);
+        if (directFd >= 0) ::close(directFd);
+#endif
+    }
+};
+
+using FilePtr = std::shared_ptr<OpenFile>;
+
+// id -> open file
+class FileTable {
+public:
+    int add(FilePtr file) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        int id = nextId_++;
+        files_[id] = std::move(file);
+        return id;
+    }
+    FilePtr get(int id) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = files_.find(id);
+        return it == files_.end() ? nullptr : it->second;
+    }
+    void remove(int id) {
+        FilePtr dropped;
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = files_.find(id);
+        if (it == files_.end()) return;
+        dropped = std::move(it->second);
+        files_.erase(it);
+    }
+    void clear() {
+        std::unordered_map<int, FilePtr> dropped;
+        std::lock_guard<std::mutex> lock(mutex_);
+        dropped.swap(files_);
+    }
+
+private:
+    std::mutex mutex_;
+    std::unordered_map<int, FilePtr> files_;
+    int nextId_ = 0;
+};
+
+bool renameOpenFile(OpenFile& file, const std::filesystem::path& to, std::error_code& ec) {
+    std::lock_guard<std::mutex> lock(file.pathMutex);
+    std::filesystem::rename(file.path, to, ec);
+    if (ec) return false;
+    file.path = to;
+    return true;
+}
+
+void adviseFile(OpenFile& file, AccessPattern pattern) {
+#ifdef POSIX_FADV_RANDOM
+    const int advice = pattern == AccessPattern::Random ? POSIX_FADV_RANDOM : POSIX_FADV_SEQUENTIAL;
+    if (file.fd >= 0) posix_fadvise(file.fd, 0, 0, advice);
+    if (file.directFd >= 0) posix_fadvise(file.directFd, 0, 0, advice);
+#else
+    (void)file;
+    (void)pattern;
+#endif
+}
+
+#ifndef _WIN32
+int openNative(const std::filesystem::path& path, bool writable, bool direct) {
+    int flags = (writable ? O_RDWR : O_RDONLY) | O_CLOEXEC;
+    if (direct) {
+#ifdef O_DIRECT
+        flags |= O_DIRECT;
+#else
+        return -1;
+#endif
+    }
+    return ::open(path.c_str(), flags);
+}
+#endif
+
+// positional read/write used by the thread pool
+bool readAt(OpenFile& file, uint8_t* dst, uint32_t len, uint64_t offset) {
+#ifndef _WIN32
+    size_t done = 0;
+    while (done < len) {
+        ssize_t r = ::pread(file.fd, dst + done, len - done, static_cast<off_t>(offset + done));
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return false;
+        done += static_cast<size_t>(r);
+    }
+    return true;
+#else
+    // no pread here, and keeping a handle open would block finalize's rename
+    std::lock_guard<std::mutex> lock(file.pathMutex);
+    std::ifstream in(file.path, std::ios::binary);
+    if (!in) return false;
+    in.seekg(static_cast<std::streamoff>(offset));
+    in.read(reinterpret_cast<char*>(dst), len);
+    return static_cast<bool>(in);
+#endif
+}
+
+bool writeAt(OpenFile& file, const std::vector<IoSlice>& slices, uint64_t offset) {
+    if (!file.writable) return false;
+#ifndef _WIN32
+    std::vector<iovec> vecs;
+    vecs.reserve(slices.size());
+    for (const auto& slice : slices) {
+        vecs.push_back(iovec{const_cast<uint8_t*>(slice.data), slice.len});
+    }
+    size_t first = 0;
+    while (first < vecs.size()) {
+        ssize_t r = ::pwritev(file.fd, vecs.data() + first, static_cast<int>(vecs.size() - first),
+                              static_cast<off_t>(offset));
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return false;
+        offset += static_cast<uint64_t>(r);
+        // skip whatever the short write got through
+        size_t done = static_cast<size_t>(r);
+        while (first < vecs.size() && done >= vecs[first].iov_len) {
+            done -= vecs[first].iov_len;
+            first++;
+        }
+        if (first < vecs.size()) {
+            vecs[first].iov_base = static_cast<uint8_t*>(vecs[first].iov_base) + done;
+            vecs[first].iov_len -= done;
+        }
+    }
+    return true;
+#else
+    std::lock_guard<std::mutex> lock(file.pathMutex);
+    std::fstream io(file.path, std::ios::in | std::ios::out | std::ios::binary);
+    if (!io) return false;
+    io.seekp(static_cast<std::streamoff>(offset));
+    for (const auto& slice : slices) {
+        io.write(reinterpret_cast<const char*>(slice.data), slice.len);
+    }
+    return static_cast<bool>(io);
+#endif
+}
+
+bool syncFile(OpenFile& file) {
+#if defined(_WIN32)
+    std::lock_guard<std::mutex> lock(file.pathMutex);
+    int fd = _wopen(file.path.c_str(), _O_RDWR | _O_BINARY);
+    if (fd < 0) return false;
+    bool ok = _commit(fd) == 0;
+    _close(fd);
+    return ok;
+#elif defined(__APPLE__)
+    return ::fsync(file.fd) == 0;
+#else
+    return ::fdatasync(file.fd) == 0;
+#endif
+}
+
+// fallback backend: blocking positional I/O on a small pool of worker threads
+class ThreadPoolDiskIO : public DiskIO {
+public:
+    explicit ThreadPoolDiskIO(const DiskIOOptions& options) {
+        unsigned n = std::max(1u, options.workerThreads);
+        for (unsigned i = 0; i < n; i++) {
+            workers_.emplace_back(&ThreadPoolDiskIO::workerLoop, this);
+        }
+    }
+
+    ~ThreadPoolDiskIO() override {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        cv_.notify_all();
+        for (auto& worker : workers_) worker.join();
+        files_.clear();
+    }
+
+    int openFile(const std::filesystem::path& path, bool writable) override {
+        auto file = std::make_shared<OpenFile>();
+        file->path = path;
+        file->writable = writable;
+#ifndef _WIN32
+        file->fd = openNative(path, writable, false);
+        if (file->fd < 0) return -1;
+#else
+        if (!std::filesystem::exists(path)) return -1;
+#endif
+        return files_.add(std::move(file));
+    }
+
+    void closeFile(int fileId) override {
+        files_.remove(fileId);
+    }
+
+    bool renameFile(int fileId, const std::filesystem::path& to, std::error_code& ec) override {
+        FilePtr file = files_.get(fileId);
+        if (!file) {
+            ec = std::make_error_code(std::errc::bad_file_descriptor);
+            return false;
+        }
+        return renameOpenFile(*file, to, ec);
+    }
+
+    void advise(int fileId, AccessPattern pattern) override {
+        if (FilePtr file = files_.get(fileId)) adviseFile(*file, pattern);
+    }
+
+    void read(int fileId, uint64_t offset, uint32_t len, ReadCallback cb) override {
+        enqueue(Job{Job::Read, files_.get(fileId), offset, len, {}, std::move(cb), nullptr});
+    }
+
+    void write(int fileId, uint64_t offset, const uint8_t* data, uint32_t len, WriteCallback cb) override {
+        enqueue(Job{Job::Write, files_.get(fileId), offset, len, {IoSlice{data, len}}, nullptr, std::move(cb)});
+    }
+
+    void writev(int fileId, uint64_t offset, std::vector<IoSlice> slices, WriteCallback cb) override {
+        enqueue(Job{Job::Write, files_.get(fileId), offset, 0, std::move(slices), nullptr, std::move(cb)});
+    }
+
+    void sync(int fileId, WriteCallback cb) override {
+        enqueue(Job{Job::Sync, files_.get(fileId), 0, 0, {}, nullptr, std::move(cb)});
+    }
+
+    void drain() override {
+        std::unique_lock<std::mutex> lock(mutex_);
+        idle_.wait(lock, [this]() { return jobs_.empty() && busy_ == 0; });
+    }
+
+    const char* name() const override {
+        return "threads";
+    }
+
+private:
+    struct Job {
+        enum Kind { Read, Write, Sync } kind;
+        FilePtr file;
+        uint64_t offset;
+        uint32_t len;
+        std::vector<IoSlice> slices;
+        ReadCallback onRead;
+        WriteCallback onWrite;
+    };
+
+    void enqueue(Job job) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            jobs_.push_back(std::move(job));
+        }
+        cv_.notify_one();
+    }
+
+    void workerLoop() {
+        profile::nameThread("disk worker");
+        std::vector<uint8_t> buffer;
+        while (true) {
+            Job job;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                cv_.wait(lock, [this]() { return stopping_ || !jobs_.empty(); });
+                if (jobs_.empty()) return;
+                job = std::move(jobs_.front());
+                jobs_.pop_front();
+                busy_++;
+            }
+
+            if (job.kind == Job::Read) {
+                buffer.resize(job.len);
+                bool ok;
+                {
+                    P2P_SPAN("disk read");
+                    ok = job.file && readAt(*job.file, buffer.data(), job.len, job.offset);
+                }
+                job.onRead(ok, buffer.data(), ok ? job.len : 0);
+            }
+            else if (job.kind == Job::Write) {
+                bool ok;
+                {
+                    P2P_SPAN("disk write");
+                    ok = job.file && writeAt(*job.file, job.slices, job.offset);
+                }
+                job.onWrite(ok);
+            }
+            else {
+                bool ok;
+                {
+                    P2P_SPAN("disk sync");
+                    ok = job.file && syncFile(*job.file);
+                }
+                job.onWrite(ok);
+            }
+            job = Job{};
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            busy_--;
+            if (jobs_.empty() && busy_ == 0) idle_.notify_all();
+        }
+    }
+
+    FileTable files_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::condition_variable idle_;
+    std::deque<Job> jobs_;
+    unsigned busy_ = 0;
+    bool stopping_ = false;
+    std::vector<std::thread> workers_;
+};
+
+#ifdef P2P_HAVE_IO_URING
+
+// io_uring backend driven through the raw syscalls, so it needs no liburing
+// one thread batches pending ops into the submission ring, another reaps completions
+class UringDiskIO : public DiskIO {
+public:
+    static std::shared_ptr<DiskIO> tryCreate(const DiskIOOptions& options) {
+        std::shared_ptr<UringDiskIO> io(new UringDiskIO());
+        if (!io->setup(options)) return nullptr;
+        io->submitter_ = std::thread(&UringDiskIO::submitLoop, io.get());
+        io->reaper_ = std::thread(&UringDiskIO::reapLoop, io.get());
+        return io;
+    }
+
+    ~UringDiskIO() override {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        cv_.notify_all();
+        if (submitter_.joinable()) submitter_.join();
+        if (reaper_.joinable()) reaper_.join();
+        files_.clear();
+
+        if (sqes_) munmap(sqes_, sqesSize_);
+        if (cqRing_ && cqRing_ != sqRing_) munmap(cqRing_, cqRingSize_);
+        if (sqRing_) munmap(sqRing_, sqRingSize_);
+        if (ringFd_ >= 0) ::close(ringFd_);
+        std::free(bufferArena_);
+    }
+
+    int openFile(const std::filesystem::path& path, bool writable) override {
+        auto file = std::make_shared<OpenFile>();
+        file->path = path;
+        file->writable = writable;
+        file->fd = openNative(path, writable, false);
+        if (file->fd < 0) return -1;
+        // O_DIRECT is refused by some filesystems (tmpfs), in which case we stay buffered
+        if (direct_) file->directFd = openNative(path, writable, true);
+
+        if (filesRegistered_) {
+            file->slot = registerSlot(file->fd);
+            file->directSlot = registerSlot(file->directFd);
+        }
+        file->release = [this](OpenFile& f) {
+            unregisterSlot(f.slot);
+            unregisterSlot(f.directSlot);
+        };
+        return files_.add(std::move(file));
+    }
+
+    void closeFile(int fileId) override {
+        files_.remove(fileId);
+    }
+
+    bool renameFile(int fileId, const std::filesystem::path& to, std::error_code& ec) override {
+        // the fd follows the inode, so nothing needs reopening
+        FilePtr file = files_.get(fileId);
+        if (!file) {
+            ec = std::make_error_code(std::errc::bad_file_descriptor);
+            return false;
+        }
+        return renameOpenFile(*file, to, ec);
+    }
+
+    void advise(int fileId, AccessPattern pattern) override {
+        if (FilePtr file = files_.get(fileId)) adviseFile(*file, pattern);
+    }
+
+    void read(int fileId, uint64_t offset, uint32_t len, ReadCallback cb) override {
+        auto* op = new Op{Op::Read, files_.get(fileId), offset, len, nullptr};
+        op->onRead = std::move(cb);
+        enqueue(op);
+    }
+
+    void write(int fileId, uint64_t offset, const uint8_t* data, uint32_t len, WriteCallback cb) override {
+        auto* op = new Op{Op::Write, files_.get(fileId), offset, len, data};
+        op->onWrite = std::move(cb);
+        enqueue(op);
+    }
+
+    void writev(int fileId, uint64_t offset, std::vector<IoSlice> slices, WriteCallback cb) override {
+        auto* op = new Op{Op::Writev, files_.get(fileId), offset, 0, nullptr};
+        for (const auto& slice : slices) {
+            op->iov.push_back(iovec{const_cast<uint8_t*>(slice.data), slice.len});
+            op->len += slice.len;
+        }
+        op->onWrite = std::move(cb);
+        enqueue(op);
+    }
+
+    void sync(int fileId, WriteCallback cb) override {
+        auto* op = new Op{Op::Sync, files_.get(fileId), 0, 0, nullptr};
+        op->onWrite = std::move(cb);
+        enqueue(op);
+    }
+
+    void drain() override {
+        std::unique_lock<std::mutex> lock(mutex_);
+        idle_.wait(lock, [this]() { return pending_.empty() && inflight_ == 0; });
+    }
+
+    const char* name() const override {
+        return "io_uring";
+    }
+
+private:
+    static constexpr uint32_t kAlign = 4096;
+    static constexpr unsigned kMaxFiles = 64;
+
+    struct Op {
+        enum Kind { Read, Write, Writev, Sync, Wake } kind = Read;
+        FilePtr file{};
+        uint64_t offset = 0;
+        uint32_t len = 0;
+        const uint8_t* src = nullptr;
+        int buffer = -1;
+        std::vector<uint8_t> heap{};  // only for reads larger than a registered buffer
+        std::vector<iovec> iov{};     // writev slices
+        ReadCallback onRead{};
+        WriteCallback onWrite{};
+    };
+
+    UringDiskIO() = default;
+
+    static uint32_t roundUp(uint32_t n) {
+        return (n + kAlign - 1) / kAlign * kAlign;
+    }
+
+    uint8_t* bufferAt(int index) const {
+        return bufferArena_ + size_t(index) * bufferSize_;
+    }
+
+    int uringRegister(unsigned opcode, const void* arg, unsigned count) {
+        return static_cast<int>(syscall(__NR_io_uring_register, ringFd_, opcode, arg, count));
+    }
+
+    int enter(unsigned toSubmit, unsigned minComplete, unsigned flags) {
+        return static_cast<int>(syscall(__NR_io_uring_enter, ringFd_, toSubmit, minComplete, flags, nullptr, 0));
+    }
+
+    bool setup(const DiskIOOptions& options) {
+        io_uring_params params{};
+        ringFd_ = static_cast<int>(syscall(__NR_io_uring_setup, std::max(8u, options.queueDepth), &params));
+        if (ringFd_ < 0) return false;
+
+        sqRingSize_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqRingSize_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool singleMap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (singleMap) sqRingSize_ = cqRingSize_ = std::max(sqRingSize_, cqRingSize_);
+
+        sqRing_ = mmap(nullptr, sqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd_, IORING_OFF_SQ_RING);
+        if (sqRing_ == MAP_FAILED) { sqRing_ = nullptr; return false; }
+        if (singleMap) {
+            cqRing_ = sqRing_;
+        }
+        else {
+            cqRing_ = mmap(nullptr, cqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd_, IORING_OFF_CQ_RING);
+            if (cqRing_ == MAP_FAILED) { cqRing_ = nullptr; return false; }
+        }
+        sqesSize_ = params.sq_entries * sizeof(io_uring_sqe);
+        void* sqes = mmap(nullptr, sqesSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd_, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED) return false;
+        sqes_ = static_cast<io_uring_sqe*>(sqes);
+
+        auto* sq = static_cast<uint8_t*>(sqRing_);
+        sqHead_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        sqTail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sqMask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sqArray_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        sqEntries_ = params.sq_entries;
+
+        auto* cq = static_cast<uint8_t*>(cqRing_);
+        cqHead_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cqTail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cqMask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+        // aligned read buffers, registered so the kernel pins them once instead of per op
+        bufferSize_ = roundUp(std::max(options.bufferSize, kAlign));
+        unsigned count = std::max(1u, options.registeredBuffers);
+        void* arena = nullptr;
+        if (posix_memalign(&arena, kAlign, size_t(count) * bufferSize_) != 0) return false;
+        bufferArena_ = static_cast<uint8_t*>(arena);
+        std::vector<iovec> vecs(count);
+        for (unsigned i = 0; i < count; i++) {
+            vecs[i].iov_base = bufferAt(static_cast<int>(i));
+            vecs[i].iov_len = bufferSize_;
+            freeBuffers_.push_back(static_cast<int>(i));
+        }
+        buffersRegistered_ = uringRegister(IORING_REGISTER_BUFFERS, vecs.data(), count) == 0;
+
+        // sparse file table, filled in as files are opened
+        std::vector<int> fds(kMaxFiles, -1);
+        filesRegistered_ = uringRegister(IORING_REGISTER_FILES, fds.data(), kMaxFiles) == 0;
+        if (filesRegistered_) {
+            for (unsigned i = 0; i < kMaxFiles; i++) freeSlots_.push_back(static_cast<int>(kMaxFiles - 1 - i));
+        }
+
+        direct_ = options.directIO;
+        return true;
+    }
+
+    int registerSlot(int fd) {
+        if (fd < 0) return -1;
+        std::lock_guard<std::mutex> lock(slotMutex_);
+        if (freeSlots_.empty()) return -1;
+        int slot = freeSlots_.back();
+        io_uring_files_update update{};
+        update.offset = static_cast<uint32_t>(slot);
+        update.fds = reinterpret_cast<uint64_t>(&fd);
+        if (uringRegister(IORING_REGISTER_FILES_UPDATE, &update, 1) < 0) return -1;
+        freeSlots_.pop_back();
+        return slot;
+    }
+
+    void unregisterSlot(int slot) {
+        if (slot < 0) return;
+        std::lock_guard<std::mutex> lock(slotMutex_);
+        int none = -1;
+        io_uring_files_update update{};
+        update.offset = static_cast<uint32_t>(slot);
+        update.fds = reinterpret_cast<uint64_t>(&none);
+        uringRegister(IORING_REGISTER_FILES_UPDATE, &update, 1);
+        freeSlots_.push_back(slot);
+    }
+
+    // writes only need a buffer when they can go through O_DIRECT
+    bool directWrite(const Op& op) const {
+        return direct_ && op.file && op.file->directFd >= 0 && op.offset % kAlign == 0 &&
+               op.len % kAlign == 0 && op.len <= bufferSize_;
+    }
+
+    bool needsBuffer(const Op& op) const {
+        if (op.kind == Op::Read) return op.len <= bufferSize_;
+        if (op.kind == Op::Write) return directWrite(op);
+        return false;
+    }
+
+    void enqueue(Op* op) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            pending_.push_back(op);
+        }
+        cv_.notify_one();
+    }
+
+    bool canTake() const {
+        if (pending_.empty() || inflight_ >= sqEntries_) return false;
+        return !needsBuffer(*pending_.front()) || !freeBuffers_.empty();
+    }
+
+    void submitLoop() {
+        profile::nameThread("io_uring submit");
+        std::vector<Op*> batch;
+        while (true) {
+            batch.clear();
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                cv_.wait(lock, [this]() { return (stopping_ && pending_.empty()) || canTake(); });
+                if (stopping_ && pending_.empty()) break;
+                // everything queued since the last wakeup goes out in one io_uring_enter
+                while (canTake()) {
+                    Op* op = pending_.front();
+                    pending_.pop_front();
+                    if (needsBuffer(*op)) {
+                        op->buffer = freeBuffers_.back();
+                        freeBuffers_.pop_back();
+                    }
+                    batch.push_back(op);
+                    inflight_++;
+                }
+            }
+            for (Op* op : batch) prepare(op);
+            submit(static_cast<unsigned>(batch.size()));
+        }
+
+        // wake the reaper so it can see we are done
+        auto* wake = new Op{Op::Wake, nullptr, 0, 0, nullptr};
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            inflight_++;
+        }
+        prepare(wake);
+        submit(1);
+    }
+
+    void prepare(Op* op) {
+        unsigned tail = *sqTail_;
+        unsigned index = tail & sqMask_;
+        io_uring_sqe* sqe = &sqes_[index];
+        std::memset(sqe, 0, sizeof(*sqe));
+        sqe->user_data = reinterpret_cast<uint64_t>(op);
+
+        if (op->kind == Op::Wake || !op->file) {
+            // a missing file still completes through the ring, as a failed NOP
+            sqe->opcode = IORING_OP_NOP;
+        }
+        else if (op->kind == Op::Writev || op->kind == Op::Sync) {
+            OpenFile& file = *op->file;
+            if (op->kind == Op::Writev) {
+                sqe->opcode = IORING_OP_WRITEV;
+                sqe->addr = reinterpret_cast<uint64_t>(op->iov.data());
+                sqe->len = static_cast<uint32_t>(op->iov.size());
+                sqe->off = op->offset;
+            }
+            else {
+                // drain the queue first so the sync covers every write submitted before it
+                sqe->opcode = IORING_OP_FSYNC;
+                sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+                sqe->flags |= IOSQE_IO_DRAIN;
+            }
+            if (file.slot >= 0) {
+                sqe->fd = file.slot;
+                sqe->flags |= IOSQE_FIXED_FILE;
+            }
+            else {
+                sqe->fd = file.fd;
+            }
+        }
+        else {
+            OpenFile& file = *op->file;
+            bool direct = false;
+            uint8_t* addr = nullptr;
+            uint32_t len = op->len;
+
+            if (op->kind == Op::Read) {
+                if (op->buffer >= 0) {
+                    addr = bufferAt(op->buffer);
+                    direct = direct_ && file.directFd >= 0 && op->offset % kAlign == 0;
+                    if (direct) len = roundUp(len);
+                }
+                else {
+                    op->heap.resize(len);
+                    addr = op->heap.data();
+                }
+            }
+            else {
+                direct = op->buffer >= 0;
+                if (direct) {
+                    addr = bufferAt(op->buffer);
+                    std::memcpy(addr, op->src, len);
+                }
+                else {
+                    addr = const_cast<uint8_t*>(op->src);
+                }
+            }
+
+            bool fixedBuffer = op->buffer >= 0 && buffersRegistered_;
+            if (op->kind == Op::Read) sqe->opcode = fixedBuffer ? IORING_OP_READ_FIXED : IORING_OP_READ;
+            else sqe->opcode = fixedBuffer ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+            if (fixedBuffer) sqe->buf_index = static_cast<uint16_t>(op->buffer);
+
+            int slot = direct ? file.directSlot : file.slot;
+            if (slot >= 0) {
+                sqe->fd = slot;
+                sqe->flags |= IOSQE_FIXED_FILE;
+            }
+            else {
+                sqe->fd = direct ? file.directFd : file.fd;
+            }
+            sqe->addr = reinterpret_cast<uint64_t>(addr);
+            sqe->len = len;
+            sqe->off = op->offset;
+        }
+
+        sqArray_[index] = index;
+        __atomic_store_n(sqTail_, tail + 1, __ATOMIC_RELEASE);
+    }
+
+    void submit(unsigned count) {
+        while (count > 0) {
+            int r = enter(count, 0, 0);
+            if (r < 0) {
+                if (errno == EINTR || errno == EAGAIN || errno == EBUSY) continue;
+                std::cerr << "io_uring_enter failed: " << std::strerror(errno) << std::endl;
+                return;
+            }
+            count -= static_cast<unsigned>(r);
+        }
+    }
+
+    void reapLoop() {
+        profile::nameThread("io_uring reap");
+        while (true) {
+            unsigned head = *cqHead_;
+            unsigned tail = __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE);
+            if (head == tail) {
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    if (wakeSeen_ && inflight_ == 0) return;
+                }
+                if (enter(0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+                    std::cerr << "io_uring wait failed: " << std::strerror(errno) << std::endl;
+                    return;
+                }
+                continue;
+            }
+            while (head != tail) {
+                const io_uring_cqe& cqe = cqes_[head & cqMask_];
+                Op* op = reinterpret_cast<Op*>(cqe.user_data);
+                int res = cqe.res;
+                head++;
+                __atomic_store_n(cqHead_, head, __ATOMIC_RELEASE);
+                complete(op, res);
+            }
+        }
+    }
+
+    void complete(Op* op, int res) {
+        int buffer = op->buffer;
+        if (op->kind == Op::Wake) {
+            delete op;
+            std::lock_guard<std::mutex> lock(mutex_);
+            wakeSeen_ = true;
+            inflight_--;
+            return;
+        }
+
+        bool ok = op->file && res >= 0 && static_cast<uint32_t>(res) >= op->len;
+        if (op->kind == Op::Read) {
+            const uint8_t* data = buffer >= 0 ? bufferAt(buffer) : op->heap.data();
+            op->onRead(ok, data, ok ? op->len : 0);
+        }
+        else {
+            op->onWrite(ok);
+        }
+        delete op;
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            inflight_--;
+            if (buffer >= 0) freeBuffers_.push_back(buffer);
+            if (pending_.empty() && inflight_ == 0) idle_.notify_all();
+        }
+        cv_.notify_one();
+    }
+
+    int ringFd_ = -1;
+    void* sqRing_ = nullptr;
+    void* cqRing_ = nullptr;
+    size_t sqRingSize_ = 0;
+    size_t cqRingSize_ = 0;
+    size_t sqesSize_ = 0;
+    unsigned* sqHead_ = nullptr;
+    unsigned* sqTail_ = nullptr;
+    unsigned* sqArray_ = nullptr;
+    unsigned sqMask_ = 0;
+    unsigned sqEntries_ = 0;
+    io_uring_sqe* sqes_ = nullptr;
+    unsigned* cqHead_ = nullptr;
+    unsigned* cqTail_ = nullptr;
+    unsigned cqMask_ = 0;
+    io_uring_cqe* cqes_ = nullptr;
+
+    uint8_t* bufferArena_ = nullptr;
+    uint32_t bufferSize_ = 0;
+    bool buffersRegistered_ = false;
+    bool filesRegistered_ = false;
+    bool direct_ = false;
+    std::mutex slotMutex_;
+    std::vector<int> freeSlots_;
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::condition_variable idle_;
+    std::deque<Op*> pending_;
+    std::vector<int> freeBuffers_;
+    unsigned inflight_ = 0;
+    bool stopping_ = false;
+    bool wakeSeen_ = false;
+    std::thread submitter_;
+    std::thread reaper_;
+    FileTable files_;
+};
+
+#endif
+
+}
+
+std::shared_ptr<DiskIO> DiskIO::create(const DiskIOOptions& options) {
+#ifdef P2P_HAVE_IO_URING
+    if (options.backend != "threads") {
+        if (auto uring = UringDiskIO::tryCreate(options)) return uring;
+        if (options.backend == "uring") {
+            std::cerr << "io_uring is not available, falling back to the thread pool" << std::endl;
+        }
+    }
+#endif
+    return std::make_shared<ThreadPoolDiskIO>(options);
+}
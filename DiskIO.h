@@ -0,0 +1,63 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <filesystem>
+#include <cstdint>
+
+// options for the asynchronous disk backend
+struct DiskIOOptions {
+    std::string backend = "auto";   // auto, uring or threads
+    bool directIO = false;          // open files with O_DIRECT where supported
+    unsigned queueDepth = 64;       // io_uring submission queue entries
+    unsigned workerThreads = 2;     // thread pool size for the fallback backend
+    uint32_t bufferSize = 0;        // size of each registered read buffer (piece size)
+    unsigned registeredBuffers = 32;
+};
+
+// access pattern hint passed on to the kernel page cache
+enum class AccessPattern {
+    Random,
+    Sequential,
+};
+
+// one contiguous piece of a gather write
+struct IoSlice {
+    const uint8_t* data;
+    uint32_t len;
+};
+
+// asynchronous positional reads and writes against files opened through it
+// completions are delivered on a backend thread, never on the caller's thread
+class DiskIO {
+public:
+    // data is only valid for the duration of the callback
+    using ReadCallback = std::function<void(bool ok, const uint8_t* data, size_t len)>;
+    using WriteCallback = std::function<void(bool ok)>;
+
+    // picks io_uring when it is compiled in and the kernel allows it, else a thread pool
+    static std::shared_ptr<DiskIO> create(const DiskIOOptions& options);
+
+    virtual ~DiskIO() = default;
+
+    // returns a file id, or -1 if the file could not be opened
+    virtual int openFile(const std::filesystem::path& path, bool writable) = 0;
+    virtual void closeFile(int fileId) = 0;
+    // rename the file behind an id without invalidating the id
+    virtual bool renameFile(int fileId, const std::filesystem::path& to, std::error_code& ec) = 0;
+    virtual void advise(int fileId, AccessPattern pattern) = 0;
+
+    // the caller keeps data alive until the write callback runs
+    virtual void read(int fileId, uint64_t offset, uint32_t len, ReadCallback cb) = 0;
+    virtual void write(int fileId, uint64_t offset, const uint8_t* data, uint32_t len, WriteCallback cb) = 0;
+    // one sequential write of several buffers starting at offset
+    virtual void writev(int fileId, uint64_t offset, std::vector<IoSlice> slices, WriteCallback cb) = 0;
+    // fdatasync, ordered after every write that completed before it was submitted
+    virtual void sync(int fileId, WriteCallback cb) = 0;
+
+    // block until every submitted operation has completed, never call from a completion
+    virtual void drain() = 0;
+
+    virtual const char* name() const = 0;
+};
@@ -0,0 +1,216 @@
+#include "ErasureCode.h"
+#include <algorithm>
+#include <cstring>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define P2P_GF_X86 1
+#endif
+
+uint32_t ErasureLayout::sourceCount(uint32_t stripe) const {
+    const uint32_t first = stripe * stripeSource;
+    return first >= sourcePieces ? 0 : std::min(stripeSource, sourcePieces - first);
+}
+
+std::vector<uint32_t> ErasureLayout::members(uint32_t stripe) const {
+    std::vector<uint32_t> pieces;
+    const uint32_t count = sourceCount(stripe);
+    pieces.reserve(count + stripeParity);
+    for (uint32_t i = 0; i < count; i++) pieces.push_back(stripe * stripeSource + i);
+    for (uint32_t j = 0; j < stripeParity; j++) pieces.push_back(sourcePieces + stripe * stripeParity + j);
+    return pieces;
+}
+
+namespace {
+
+// GF(2^8) with the polynomial x^8 + x^4 + x^3 + x^2 + 1, generator 2
+struct Gf256 {
+    uint8_t exp[512];
+    uint8_t log[256];
+    uint8_t mul[256][256];
+
+    Gf256() {
+        unsigned x = 1;
+        for (int i = 0; i < 255; i++) {
+            exp[i] = exp[i + 255] = static_cast<uint8_t>(x);
+            log[x] = static_cast<uint8_t>(i);
+            x <<= 1;
+            if (x & 0x100) x ^= 0x11d;
+        }
+        exp[510] = exp[511] = exp[0];
+        log[0] = 0;
+        for (int a = 0; a < 256; a++) {
+            for (int b = 0; b < 256; b++) {
+                mul[a][b] = (a && b) ? exp[log[a] + log[b]] : 0;
+            }
+        }
+    }
+
+    uint8_t inverse(uint8_t a) const {
+        return exp[255 - log[a]];
+    }
+};
+
+const Gf256& gf() {
+    static const Gf256 field;
+    return field;
+}
+
+// dst ^= c * src
+using MulAddKernel = void (*)(uint8_t* dst, const uint8_t* src, uint8_t c, size_t len);
+
+void mulAddScalar(uint8_t* dst, const uint8_t* src, uint8_t c, size_t len) {
+    const uint8_t* row = gf().mul[c];
+    for (size_t i = 0; i < len; i++) dst[i] ^= row[src[i]];
+}
+
+#ifdef P2P_GF_X86
+// c * x for every low nibble and every high nibble, a product is the xor of the two lookups
+void nibbleTables(uint8_t c, uint8_t* low, uint8_t* high) {
+    for (int x = 0; x < 16; x++) {
+        low[x] = gf().mul[c][x];
+        high[x] = gf().mul[c][x << 4];
+    }
+}
+
+__attribute__((target("ssse3")))
+void mulAddSsse3(uint8_t* dst, const uint8_t* src, uint8_t c, size_t len) {
+    alignas(16) uint8_t low[16], high[16];
+    nibbleTables(c, low, high);
+    const __m128i lowTable = _mm_load_si128(reinterpret_cast<const __m128i*>(low));
+    const __m128i highTable = _mm_load_si128(reinterpret_cast<const __m128i*>(high));
+    const __m128i mask = _mm_set1_epi8(0x0f);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        const __m128i in = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        const __m128i lo = _mm_shuffle_epi8(lowTable, _mm_and_si128(in, mask));
+        const __m128i hi = _mm_shuffle_epi8(highTable, _mm_and_si128(_mm_srli_epi64(in, 4), mask));
+        __m128i* out = reinterpret_cast<__m128i*>(dst + i);
+        _mm_storeu_si128(out, _mm_xor_si128(_mm_loadu_si128(out), _mm_xor_si128(lo, hi)));
+    }
+    mulAddScalar(dst + i, src + i, c, len - i);
+}
+
+__attribute__((target("avx2")))
+void mulAddAvx2(uint8_t* dst, const uint8_t* src, uint8_t c, size_t len) {
+    alignas(16) uint8_t low[16], high[16];
+    nibbleTables(c, low, high);
+    // the shuffle looks up within each 128-bit lane, so both lanes get the table
+    const __m256i lowTable = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i*>(low)));
+    const __m256i highTable = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i*>(high)));
+    const __m256i mask = _mm256_set1_epi8(0x0f);
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        const __m256i in = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+        const __m256i lo = _mm256_shuffle_epi8(lowTable, _mm256_and_si256(in, mask));
+        const __m256i hi = _mm256_shuffle_epi8(highTable, _mm256_and_si256(_mm256_srli_epi64(in, 4), mask));
+        __m256i* out = reinterpret_cast<__m256i*>(dst + i);
+        _mm256_storeu_si256(out, _mm256_xor_si256(_mm256_loadu_si256(out), _mm256_xor_si256(lo, hi)));
+    }
+    mulAddScalar(dst + i, src + i, c, len - i);
+}
+#endif
+
+struct Kernel {
+    MulAddKernel mulAdd = mulAddScalar;
+    const char* name = "scalar";
+
+    Kernel() {
+#ifdef P2P_GF_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            mulAdd = mulAddAvx2;
+            name = "avx2";
+        }
+        else if (__builtin_cpu_supports("ssse3")) {
+            mulAdd = mulAddSsse3;
+            name = "ssse3";
+        }
+#endif
+    }
+};
+
+const Kernel& kernel() {
+    static const Kernel chosen;
+    return chosen;
+}
+
+void mulAdd(uint8_t* dst, const uint8_t* src, uint8_t c, size_t len) {
+    if (c == 0) return;
+    if (c == 1) {
+        for (size_t i = 0; i < len; i++) dst[i] ^= src[i];
+        return;
+    }
+    kernel().mulAdd(dst, src, c, len);
+}
+
+}
+
+ReedSolomon::ReedSolomon(unsigned k, unsigned m) : k_(k), m_(m), parity_(size_t(k) * m) {
+    // row j, column i is 1 / (x_j + y_i) with x_j = k + j and y_i = i, all distinct below 256
+    for (unsigned j = 0; j < m; j++) {
+        for (unsigned i = 0; i < k; i++) {
+            parity_[j * k + i] = gf().inverse(static_cast<uint8_t>((k + j) ^ i));
+        }
+    }
+}
+
+void ReedSolomon::encode(const std::vector<const uint8_t*>& source, const std::vector<uint8_t*>& parity, size_t len) const {
+    for (unsigned j = 0; j < m_; j++) {
+        std::memset(parity[j], 0, len);
+        for (unsigned i = 0; i < k_; i++) mulAdd(parity[j], source[i], parity_[j * k_ + i], len);
+    }
+}
+
+bool ReedSolomon::decode(const std::vector<unsigned>& rows, const std::vector<const uint8_t*>& blocks,
+                         const std::vector<unsigned>& wanted, const std::vector<uint8_t*>& out, size_t len) const {
+    if (rows.size() != k_ || blocks.size() != k_) return false;
+    const size_t k = k_;
+
+    // the rows we hold of the stacked generator, inverted next to an identity
+    std::vector<uint8_t> a(k * k, 0);
+    std::vector<uint8_t> inv(k * k, 0);
+    for (size_t r = 0; r < k; r++) {
+        if (rows[r] >= k_ + m_) return false;
+        if (rows[r] < k_)
+            a[r * k + rows[r]] = 1;
+        else
+            std::memcpy(&a[r * k], &parity_[(rows[r] - k_) * k], k);
+        inv[r * k + r] = 1;
+    }
+    const Gf256& field = gf();
+    for (size_t col = 0; col < k; col++) {
+        size_t pivot = col;
+        while (pivot < k && a[pivot * k + col] == 0) pivot++;
+        // a repeated row leaves the matrix singular
+        if (pivot == k) return false;
+        if (pivot != col) {
+            std::swap_ranges(&a[pivot * k], &a[pivot * k] + k, &a[col * k]);
+            std::swap_ranges(&inv[pivot * k], &inv[pivot * k] + k, &inv[col * k]);
+        }
+        const uint8_t scale = field.inverse(a[col * k + col]);
+        for (size_t c = 0; c < k; c++) {
+            a[col * k + c] = field.mul[scale][a[col * k + c]];
+            inv[col * k + c] = field.mul[scale][inv[col * k + c]];
+        }
+        for (size_t r = 0; r < k; r++) {
+            const uint8_t factor = a[r * k + col];
+            if (r == col || factor == 0) continue;
+            for (size_t c = 0; c < k; c++) {
+                a[r * k + c] ^= field.mul[factor][a[col * k + c]];
+                inv[r * k + c] ^= field.mul[factor][inv[col * k + c]];
+            }
+        }
+    }
+
+    // source row i is row i of the inverse applied to the blocks held
+    for (size_t w = 0; w < wanted.size(); w++) {
+        if (wanted[w] >= k_) return false;
+        std::memset(out[w], 0, len);
+        for (size_t j = 0; j < k; j++) mulAdd(out[w], blocks[j], inv[wanted[w] * k + j], len);
+    }
+    return true;
+}
+
+const char* ReedSolomon::kernelName() {
+    return kernel().name;
+}
@@ -0,0 +1,59 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+// where coded pieces sit: the file's pieces are cut into stripes of stripeSource pieces, and each
+// stripe gets stripeParity parity pieces, numbered after every source piece, stripe by stripe
+// any stripeSource pieces of a stripe (fewer in a short last stripe) rebuild the rest of it
+struct ErasureLayout {
+    uint32_t sourcePieces = 0;
+    uint32_t stripeSource = 0;
+    uint32_t stripeParity = 0;      // 0 turns coding off
+
+    bool enabled() const {
+        return stripeParity > 0 && stripeSource > 0;
+    }
+    uint32_t stripes() const {
+        return enabled() ? (sourcePieces + stripeSource - 1) / stripeSource : 0;
+    }
+    uint32_t totalPieces() const {
+        return sourcePieces + stripes() * stripeParity;
+    }
+    bool isParity(uint32_t index) const {
+        return index >= sourcePieces;
+    }
+    uint32_t stripeOf(uint32_t index) const {
+        return isParity(index) ? (index - sourcePieces) / stripeParity : index / stripeSource;
+    }
+    // the last stripe may be short
+    uint32_t sourceCount(uint32_t stripe) const;
+    // every piece of the stripe, its source pieces first and then its parity
+    std::vector<uint32_t> members(uint32_t stripe) const;
+};
+
+// systematic Reed-Solomon over GF(2^8) with a Cauchy parity matrix, so every k by k
+// submatrix of the stacked identity and parity rows is invertible:
+// k source blocks and m parity blocks, any k of the k + m rebuild the others, k + m <= 256
+// the inner loop multiplies a block by a constant with AVX2 or SSSE3 nibble table lookups
+// when the CPU has them, and a full product table otherwise
+class ReedSolomon {
+public:
+    ReedSolomon(unsigned k, unsigned m);
+
+    // parity[j] = the sum over i of c(j, i) * source[i], every block len bytes
+    void encode(const std::vector<const uint8_t*>& source, const std::vector<uint8_t*>& parity, size_t len) const;
+
+    // rows 0..k-1 are source blocks and k..k+m-1 parity blocks, rows names the k distinct rows held in blocks
+    // rebuilds each source row in wanted into the matching out, false unless rows are k distinct valid ones
+    bool decode(const std::vector<unsigned>& rows, const std::vector<const uint8_t*>& blocks,
+                const std::vector<unsigned>& wanted, const std::vector<uint8_t*>& out, size_t len) const;
+
+    // the multiply kernel this CPU runs, for the log
+    static const char* kernelName();
+
+private:
+    unsigned k_;
+    unsigned m_;
+    std::vector<uint8_t> parity_;   // m rows of k coefficients
+};
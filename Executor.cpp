@@ -0,0 +1,132 @@
+#include "Executor.h"
+#include "Profile.h"
+
+namespace {
+
+// the worker running on this thread, so tasks submitted from a task stay local
+thread_local const Executor* currentExecutor = nullptr;
+thread_local unsigned currentWorker = 0;
+
+}
+
+Executor::Executor(unsigned threads) {
+    if (threads == 0) threads = std::thread::hardware_concurrency();
+    if (threads == 0) threads = 2;
+
+    for (unsigned i = 0; i < threads; i++) workers_.push_back(std::make_unique<Worker>());
+    // every deque exists before any worker can try to steal from it
+    for (unsigned i = 0; i < threads; i++) workers_[i]->thread = std::thread(&Executor::workerLoop, this, i);
+}
+
+Executor::~Executor() {
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex_);
+        stopping_ = true;
+    }
+    wake_.notify_all();
+    for (auto& worker : workers_) worker->thread.join();
+}
+
+void Executor::submit(Task task, TaskPriority priority, int affinity) {
+    unsigned target;
+    if (affinity >= 0)
+        target = static_cast<unsigned>(affinity) % size();
+    else if (currentExecutor == this)
+        target = currentWorker;
+    else
+        target = nextWorker_.fetch_add(1, std::memory_order_relaxed) % size();
+
+    {
+        // counted before it is visible so the count never drops below zero, and under the
+        // lock so a worker that just found nothing and is about to sleep sees it
+        std::lock_guard<std::mutex> lock(sleepMutex_);
+        queued_.fetch_add(1, std::memory_order_release);
+    }
+    {
+        Worker& worker = *workers_[target];
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        worker.tasks[static_cast<int>(priority)].push_back(std::move(task));
+    }
+    wake_.notify_one();
+}
+
+// newest first, it is the most likely to still be in this core's cache
+bool Executor::popLocal(unsigned self, Task& task) {
+    Worker& worker = *workers_[self];
+    std::lock_guard<std::mutex> lock(worker.mutex);
+    for (auto& tasks : worker.tasks) {
+        if (tasks.empty()) continue;
+        task = std::move(tasks.back());
+        tasks.pop_back();
+        return true;
+    }
+    return false;
+}
+
+// oldest first from the others, the highest priority anyone has wins
+bool Executor::steal(unsigned self, Task& task) {
+    const unsigned n = size();
+    for (int priority = 0; priority < kPriorities; priority++) {
+        for (unsigned i = 1; i < n; i++) {
+            Worker& victim = *workers_[(self + i) % n];
+            std::unique_lock<std::mutex> lock(victim.mutex, std::try_to_lock);
+            if (!lock.owns_lock()) continue;
+            auto& tasks = victim.tasks[priority];
+            if (tasks.empty()) continue;
+            task = std::move(tasks.front());
+            tasks.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+void Executor::workerLoop(unsigned self) {
+    currentExecutor = this;
+    currentWorker = self;
+    profile::nameThread("executor " + std::to_string(self));
+
+    while (true) {
+        Task task;
+        if (popLocal(self, task) || steal(self, task)) {
+            queued_.fetch_sub(1, std::memory_order_acq_rel);
+            task();
+            continue;
+        }
+
+        // a failed try_lock in steal, or a task not pushed yet, can be missed,
+        // so only sleep once the count says none are left
+        std::unique_lock<std::mutex> lock(sleepMutex_);
+        if (queued_.load(std::memory_order_acquire) > 0) continue;
+        if (stopping_) return;
+        wake_.wait(lock, [this]() { return stopping_ || queued_.load(std::memory_order_acquire) > 0; });
+        if (stopping_ && queued_.load(std::memory_order_acquire) == 0) return;
+    }
+}
+
+TaskGroup::TaskGroup(std::shared_ptr<Executor> executor) : executor_(std::move(executor)) {}
+
+TaskGroup::~TaskGroup() {
+    wait();
+}
+
+void TaskGroup::submit(Executor::Task task, TaskPriority priority, int affinity) {
+    if (!executor_) {
+        task();
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        running_++;
+    }
+    executor_->submit([this, task = std::move(task)]() {
+        task();
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (--running_ == 0) idle_.notify_all();
+    }, priority, affinity);
+}
+
+void TaskGroup::wait() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    idle_.wait(lock, [this]() { return running_ == 0; });
+}
@@ -0,0 +1,83 @@
+#pragma once
+#include <deque>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <condition_variable>
+#include <utility>
+
+enum class TaskPriority {
+    High,       // on the path of a message someone is waiting for
+    Normal,
+    Low,        // background work, runs when nothing else is queued
+};
+
+// fixed pool of workers for CPU work, one per core by default
+// every worker has its own deque per priority: it takes its newest task first and,
+// once it runs dry, steals the oldest task from another worker
+class Executor {
+public:
+    using Task = std::function<void()>;
+
+    // 0 threads means one per hardware thread
+    explicit Executor(unsigned threads = 0);
+    ~Executor();
+
+    Executor(const Executor&) = delete;
+    Executor& operator=(const Executor&) = delete;
+
+    // affinity picks the worker whose deque the task starts on, so tasks that touch the
+    // same data can share a cache, -1 keeps it on the submitting worker or spreads it out
+    void submit(Task task, TaskPriority priority = TaskPriority::Normal, int affinity = -1);
+
+    // runs work on the pool and then, on the same worker, hands its result to then
+    template <typename Work, typename Then>
+    void submit(Work work, Then then, TaskPriority priority = TaskPriority::Normal, int affinity = -1) {
+        submit([work = std::move(work), then = std::move(then)]() mutable { then(work()); }, priority, affinity);
+    }
+
+    unsigned size() const {
+        return static_cast<unsigned>(workers_.size());
+    }
+
+private:
+    static constexpr int kPriorities = 3;
+
+    struct Worker {
+        std::mutex mutex;
+        std::deque<Task> tasks[kPriorities];
+        std::thread thread;
+    };
+
+    void workerLoop(unsigned self);
+    bool popLocal(unsigned self, Task& task);
+    bool steal(unsigned self, Task& task);
+
+    std::vector<std::unique_ptr<Worker>> workers_;
+    std::atomic<unsigned> nextWorker_{0};
+    std::atomic<size_t> queued_{0};
+    std::mutex sleepMutex_;
+    std::condition_variable wake_;
+    bool stopping_ = false;
+};
+
+// counts tasks submitted on behalf of one owner so it can wait for them before tearing down
+class TaskGroup {
+public:
+    explicit TaskGroup(std::shared_ptr<Executor> executor);
+    ~TaskGroup();
+
+    // without an executor the task runs inline
+    void submit(Executor::Task task, TaskPriority priority = TaskPriority::Normal, int affinity = -1);
+    // blocks until every task submitted so far has finished
+    void wait();
+
+private:
+    std::shared_ptr<Executor> executor_;
+    std::mutex mutex_;
+    std::condition_variable idle_;
+    size_t running_ = 0;
+};
@@ -1,31 +1,65 @@
 #include "FileHandling.h"
+#include "Profile.h"
 #include <fstream>
 #include <iostream>  // For std::cerr
 #include <thread>    // For std::this_thread::sleep_for
 #include <chrono>    // For std::chrono::milliseconds
+#include <algorithm>
+#include <atomic>
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 using std::filesystem::exists;
 using std::filesystem::create_directories;
 using std::filesystem::rename;
 
-FileHandling::FileHandling() = default;
+namespace {
+
+// one callback for several writes, ok only if every one of them was
+DiskIO::WriteCallback joinWrites(int parts, DiskIO::WriteCallback cb) {
+    struct Join {
+        std::atomic<int> left;
+        std::atomic<bool> ok{true};
+        DiskIO::WriteCallback cb;
+    };
+    auto join = std::make_shared<Join>();
+    join->left = parts;
+    join->cb = std::move(cb);
+    return [join](bool ok) {
+        if (!ok) join->ok = false;
+        if (--join->left == 0) join->cb(join->ok.load());
+    };
+}
+
+}
 
 FileHandling::FileHandling(std::filesystem::path workDir, int peerId, std::string fileName,
                             uint64_t fileSize, uint32_t pieceSize, bool startsWithCompleteFile)
-    : workDir_(std::move(workDir)),
-        fileName_(std::move(fileName)),
-        fileSize_(fileSize),
-        pieceSize_(pieceSize),
-        seeder_(startsWithCompleteFile) {
+    : PieceStore(fileSize, pieceSize, startsWithCompleteFile),
+        workDir_(std::move(workDir)),
+        fileName_(std::move(fileName)) {
     peerDir_   = workDir_ / ("peer_" + std::to_string(peerId));
     finalPath_ = peerDir_ / fileName_;
     partPath_  = peerDir_ / (fileName_ + ".part");
+    parityPath_ = peerDir_ / (fileName_ + ".parity");
 }
 
 bool FileHandling::init() {
     try { 
         create_directories(peerDir_); } catch (...) { return false; 
     }
+    // seeders write the parity and leechers receive it, it is only ever written at piece offsets
+    if (erasure_.enabled()) {
+        const uint64_t paritySize = uint64_t(erasure_.stripes()) * erasure_.stripeParity * pieceSize_;
+        std::ofstream create(parityPath_, std::ios::binary | std::ios::app);
+        if (!create) return false;
+        create.close();
+        std::error_code ec;
+        std::filesystem::resize_file(parityPath_, paritySize, ec);
+        if (ec) return false;
+    }
     if (seeder_) return hasCompleteFile();
 
     if (hasCompleteFile()) return true;
@@ -34,10 +68,33 @@ bool FileHandling::init() {
     if (!f){
         std::ofstream c(partPath_, std::ios::binary | std::ios::trunc);
         if (!c) return false;
-        if (fileSize_ > 0) {
-        c.seekp(static_cast<std::streamoff>(fileSize_ - 1));
-        char z = 0; c.write(&z, 1);
-        }
+        c.close();
+        return preallocate();
+    }
+    return true;
+}
+
+// reserve every block of the .part file up front, a sparse file fragments as random pieces land in it
+bool FileHandling::preallocate() const {
+    if (fileSize_ == 0) return true;
+#ifdef __linux__
+    int fd = ::open(partPath_.c_str(), O_RDWR | O_CLOEXEC);
+    if (fd >= 0) {
+        int r = ::fallocate(fd, 0, 0, static_cast<off_t>(fileSize_));
+        ::close(fd);
+        if (r == 0) return true;
+    }
+#endif
+    // no fallocate (or the filesystem refused it), so write real zeros
+    std::fstream io(partPath_, std::ios::in | std::ios::out | std::ios::binary);
+    if (!io) return false;
+    std::vector<char> zeros(1 << 20, 0);
+    uint64_t left = fileSize_;
+    while (left > 0) {
+        const size_t n = static_cast<size_t>(std::min<uint64_t>(left, zeros.size()));
+        io.write(zeros.data(), static_cast<std::streamsize>(n));
+        if (!io) return false;
+        left -= n;
     }
     return true;
 }
@@ -50,32 +107,21 @@ std::filesystem::path FileHandling::peerDir() const{
     return peerDir_;
 }
 
-uint32_t FileHandling::pieceLength(uint32_t index) const{
-    const uint64_t start = offset(index);
-    if (start >= fileSize_) return 0;
-    const uint64_t end = std::min(start + uint64_t(pieceSize_), fileSize_);
-    return static_cast<uint32_t>(end - start);
-}
-
-bool FileHandling::writePiece(uint32_t index, const uint8_t* buf, size_t len) {
-    if (hasCompleteFile()) return false;
-
-    const uint32_t need = pieceLength(index);
-    if (need == 0 || len != need) return false;
-
-    std::fstream io(partPath_, std::ios::in | std::ios::out | std::ios::binary);
+bool FileHandling::storePiece(uint32_t index, const uint8_t* buf, size_t len) {
+    // a partial download is put in place once its selected pieces are in, and may take more after
+    std::fstream io(pathOf(index), std::ios::in | std::ios::out | std::ios::binary);
     if (!io) return false;
     io.seekp(static_cast<std::streamoff>(offset(index)));
-    io.write(reinterpret_cast<const char*>(buf), need);
+    io.write(reinterpret_cast<const char*>(buf), static_cast<std::streamsize>(len));
     return static_cast<bool>(io);
 }
 
 std::optional<std::vector<uint8_t>> FileHandling::readPiece(uint32_t index) const {
+    P2P_SPAN("readPiece");
     const uint32_t len = pieceLength(index);
     if (len == 0) return std::nullopt;
 
-    const auto& src = hasCompleteFile() ? finalPath_ : partPath_;
-    std::ifstream in(src, std::ios::binary);
+    std::ifstream in(pathOf(index), std::ios::binary);
     if (!in) return std::nullopt;
 
     std::vector<uint8_t> out(len);
@@ -85,6 +131,99 @@ std::optional<std::vector<uint8_t>> FileHandling::readPiece(uint32_t index) cons
     return out;
     }
 
+void FileHandling::attachDiskIO(std::shared_ptr<DiskIO> io) {
+    if (io_ && fileId_ >= 0) io_->closeFile(fileId_);
+    if (io_ && parityId_ >= 0) io_->closeFile(parityId_);
+    io_ = std::move(io);
+    fileId_ = -1;
+    parityId_ = -1;
+    if (!io_) return;
+
+    const bool complete = hasCompleteFile();
+    fileId_ = io_->openFile(complete ? finalPath_ : partPath_, !complete);
+    if (fileId_ < 0) {
+        std::cerr << "Could not open " << (complete ? finalPath_ : partPath_) << " for async I/O" << std::endl;
+        io_.reset();
+        return;
+    }
+    // pieces arrive in random order while downloading, a finished file is read front to back
+    io_->advise(fileId_, complete ? AccessPattern::Sequential : AccessPattern::Random);
+
+    if (erasure_.enabled()) {
+        parityId_ = io_->openFile(parityPath_, true);
+        if (parityId_ < 0) std::cerr << "Could not open " << parityPath_ << " for async I/O" << std::endl;
+    }
+}
+
+void FileHandling::readPieceAsync(uint32_t index, DiskIO::ReadCallback cb) {
+    P2P_SPAN("readPieceAsync");
+    if (!io_) {
+        PieceStore::readPieceAsync(index, std::move(cb));
+        return;
+    }
+
+    const uint32_t len = pieceLength(index);
+    if (len == 0) {
+        cb(false, nullptr, 0);
+        return;
+    }
+    io_->read(fileIdOf(index), offset(index), len, std::move(cb));
+}
+
+void FileHandling::writePieceAsync(uint32_t index, const uint8_t* buf, size_t len, DiskIO::WriteCallback cb) {
+    P2P_SPAN("writePieceAsync");
+    if (!io_) {
+        PieceStore::writePieceAsync(index, buf, len, std::move(cb));
+        return;
+    }
+
+    if (!writable(index, len)) {
+        cb(false);
+        return;
+    }
+    io_->write(fileIdOf(index), offset(index), buf, static_cast<uint32_t>(len), std::move(cb));
+}
+
+void FileHandling::writeRunAsync(uint32_t firstIndex, const std::vector<IoSlice>& pieces, DiskIO::WriteCallback cb) {
+    P2P_SPAN("writeRunAsync");
+    if (!io_) {
+        PieceStore::writeRunAsync(firstIndex, pieces, std::move(cb));
+        return;
+    }
+    for (size_t i = 0; i < pieces.size(); i++) {
+        if (!writable(firstIndex + static_cast<uint32_t>(i), pieces[i].len)) {
+            cb(false);
+            return;
+        }
+    }
+    // a run that reaches past the last source piece goes on in the parity file
+    const uint32_t lastIndex = firstIndex + static_cast<uint32_t>(pieces.size()) - 1;
+    if (isParity(firstIndex) == isParity(lastIndex)) {
+        io_->writev(fileIdOf(firstIndex), offset(firstIndex), pieces, std::move(cb));
+        return;
+    }
+    const size_t split = erasure_.sourcePieces - firstIndex;
+    auto both = joinWrites(2, std::move(cb));
+    io_->writev(fileId_, offset(firstIndex), std::vector<IoSlice>(pieces.begin(), pieces.begin() + split), both);
+    io_->writev(parityId_, 0, std::vector<IoSlice>(pieces.begin() + split, pieces.end()), both);
+}
+
+void FileHandling::syncAsync(DiskIO::WriteCallback cb) {
+    P2P_SPAN("syncAsync");
+    if (!io_) {
+        // the synchronous path keeps no handle open, so its writes are only as durable as the OS cache
+        cb(true);
+        return;
+    }
+    if (parityId_ < 0) {
+        io_->sync(fileId_, std::move(cb));
+        return;
+    }
+    auto both = joinWrites(2, std::move(cb));
+    io_->sync(fileId_, both);
+    io_->sync(parityId_, both);
+}
+
 bool FileHandling::finalize() {
     if (hasCompleteFile()) return true;
 
@@ -93,6 +232,15 @@ bool FileHandling::finalize() {
     // but i don't want to deal with reverting and maybe messing things up
     for (int i = 0; i < 5; ++i) {
         try {
+            // the backend renames through its open handle so the file id stays valid for serving
+            if (io_ && fileId_ >= 0) {
+                std::error_code ec;
+                if (io_->renameFile(fileId_, finalPath_, ec)) {
+                    io_->advise(fileId_, AccessPattern::Sequential);
+                    return true;
+                }
+                throw std::filesystem::filesystem_error("rename", partPath_, finalPath_, ec);
+            }
             std::filesystem::rename(partPath_, finalPath_);
             return true;
         } 
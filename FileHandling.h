@@ -4,12 +4,14 @@
 #include <optional>
 #include <filesystem>
 #include <cstdint>
+#include <memory>
+#include "PieceStore.h"
 
-class FileHandling {
+// the file store: pieces go in <file>.part under peer_<id>, renamed to the file once complete,
+// parity pieces in <file>.parity beside it
+class FileHandling : public PieceStore {
 public:
 
-    FileHandling ();
-
     FileHandling(std::filesystem::path workDir,
                int peerId,
                std::string fileName,
@@ -17,34 +19,58 @@ public:
                uint32_t pieceSize,
                bool startsWithCompleteFile);
 
-    bool init();
+    const char* name() const override {
+        return "file";
+    }
+    bool init() override;
 
-    bool hasCompleteFile() const;       
-    std::filesystem::path peerDir() const; 
+    bool hasCompleteFile() const;
+    std::filesystem::path peerDir() const;
 
     // Piece API (0-based index)
-    uint32_t pieceLength(uint32_t index) const;            
-    bool writePiece(uint32_t index, const uint8_t* buf, size_t len);
-    std::optional<std::vector<uint8_t>> readPiece(uint32_t index) const;
+    std::optional<std::vector<uint8_t>> readPiece(uint32_t index) const override;
 
-    bool finalize();
+    // asynchronous piece API, completions arrive on a disk thread
+    // without an attached backend these run inline on the caller
+    void attachDiskIO(std::shared_ptr<DiskIO> io) override;
+    void readPieceAsync(uint32_t index, DiskIO::ReadCallback cb) override;
+    void writePieceAsync(uint32_t index, const uint8_t* buf, size_t len, DiskIO::WriteCallback cb) override;
+    // consecutive pieces starting at firstIndex, written as one sequential write
+    void writeRunAsync(uint32_t firstIndex, const std::vector<IoSlice>& pieces, DiskIO::WriteCallback cb) override;
+    void syncAsync(DiskIO::WriteCallback cb) override;
+
+    bool finalize() override;
 
     // Paths (useful for logging)
     std::filesystem::path finalPath() const {
-         return finalPath_; 
+         return finalPath_;
+    }
+    std::filesystem::path partPath()  const {
+        return partPath_;
     }
-    std::filesystem::path partPath()  const { 
-        return partPath_;  
+    // where the pieces are now, the .part file until finalize
+    std::filesystem::path dataPath() const override {
+        return hasCompleteFile() ? finalPath_ : partPath_;
     }
 
-private:
-    std::filesystem::path workDir_, peerDir_, finalPath_, partPath_;
+protected:
+    std::filesystem::path workDir_, peerDir_, finalPath_, partPath_, parityPath_;
     std::string fileName_;
-    uint64_t fileSize_{};
-    uint32_t pieceSize_{};
-    bool seeder_{};
+    std::shared_ptr<DiskIO> io_;
+    int fileId_ = -1;
+    int parityId_ = -1;
+
+    bool preallocate() const;
+    const std::filesystem::path& pathOf(uint32_t idx) const {
+        return isParity(idx) ? parityPath_ : hasCompleteFile() ? finalPath_ : partPath_;
+    }
+    int fileIdOf(uint32_t idx) const {
+        return isParity(idx) ? parityId_ : fileId_;
+    }
+    bool storePiece(uint32_t idx, const uint8_t* buf, size_t len) override;
 
-    uint64_t offset(uint32_t idx) const { 
-        return uint64_t(idx) * pieceSize_; 
+    uint64_t offset(uint32_t idx) const {
+        // parity pieces start over at the front of the parity file
+        return uint64_t(isParity(idx) ? idx - erasure_.sourcePieces : idx) * pieceSize_;
     }
-};
\ No newline at end of file
+};
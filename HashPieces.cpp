@@ -0,0 +1,55 @@
+#include "Sha256.h"
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <map>
+#include <string>
+
+// writes the piece hash file that the PieceHashes key in Common.cfg points at
+//     HashPieces <file> <piece size> [output]
+// one SHA-256 per line in piece order, to standard output unless an output is given
+
+int main(int argc, char* argv[]) {
+    if (argc < 3 || argc > 4) {
+        std::cerr << "HashPieces <file> <piece size> [output]" << std::endl;
+        return 1;
+    }
+
+    std::ifstream in(argv[1], std::ios::binary);
+    if (!in) {
+        std::cerr << "Could not open " << argv[1] << std::endl;
+        return 1;
+    }
+    const size_t pieceSize = std::stoul(argv[2]);
+    if (pieceSize == 0) {
+        std::cerr << "Piece size must be above zero" << std::endl;
+        return 1;
+    }
+
+    std::ofstream file;
+    if (argc == 4) {
+        file.open(argv[3]);
+        if (!file) {
+            std::cerr << "Could not write " << argv[3] << std::endl;
+            return 1;
+        }
+    }
+    std::ostream& out = argc == 4 ? file : std::cout;
+
+    // how often each hash comes up, to tell how much deduplication will save
+    std::map<Sha256Digest, size_t> seen;
+    std::vector<uint8_t> piece(pieceSize);
+    size_t pieces = 0;
+    while (in) {
+        in.read(reinterpret_cast<char*>(piece.data()), static_cast<std::streamsize>(pieceSize));
+        const size_t got = static_cast<size_t>(in.gcount());
+        if (got == 0) break;
+        const Sha256Digest digest = Sha256::hash(piece.data(), got);
+        out << Sha256::toHex(digest) << "\n";
+        seen[digest]++;
+        pieces++;
+    }
+
+    std::cerr << pieces << " pieces, " << pieces - seen.size() << " of them repeat an earlier piece" << std::endl;
+    return out ? 0 : 1;
+}
@@ -0,0 +1,126 @@
+#include "LocalTransport.h"
+#include "Trace.h"
+#include <cstring>
+#include <system_error>
+#ifdef _WIN32
+#include <afunix.h>
+#include <windows.h>
+#else
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace local {
+
+namespace {
+
+bool fillAddress(const std::filesystem::path& path, sockaddr_un& address) {
+    address = sockaddr_un{};
+    address.sun_family = AF_UNIX;
+    const std::string name = path.string();
+    if (name.size() >= sizeof(address.sun_path)) {
+        P2P_ERROR("Local socket path " << name << " is too long");
+        return false;
+    }
+    std::memcpy(address.sun_path, name.c_str(), name.size() + 1);
+    return true;
+}
+
+}
+
+std::filesystem::path socketPath(const std::filesystem::path& dir, int port) {
+    return dir / ("p2p_" + std::to_string(port) + ".sock");
+}
+
+SOCKET listenOn(const std::filesystem::path& path) {
+    sockaddr_un address;
+    if (!fillAddress(path, address)) return INVALID_SOCKET;
+    SOCKET sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == INVALID_SOCKET) return INVALID_SOCKET;
+    // we hold the TCP port, so whoever left this file is gone
+    std::error_code ignored;
+    std::filesystem::remove(path, ignored);
+    if (bind(sock, (SOCKADDR*)&address, sizeof(address)) == SOCKET_ERROR || listen(sock, SOMAXCONN) == SOCKET_ERROR) {
+        closesocket(sock);
+        return INVALID_SOCKET;
+    }
+    return sock;
+}
+
+SOCKET connectTo(const std::filesystem::path& path) {
+    sockaddr_un address;
+    if (!fillAddress(path, address)) return INVALID_SOCKET;
+    std::error_code ec;
+    if (!std::filesystem::exists(path, ec)) return INVALID_SOCKET;
+    SOCKET sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == INVALID_SOCKET) return INVALID_SOCKET;
+    if (connect(sock, (SOCKADDR*)&address, sizeof(address)) == SOCKET_ERROR) {
+        closesocket(sock);
+        return INVALID_SOCKET;
+    }
+    return sock;
+}
+
+bool isLocal(SOCKET sock) {
+    sockaddr_storage address{};
+    socklen_t length = sizeof(address);
+    if (getsockname(sock, (SOCKADDR*)&address, &length) == SOCKET_ERROR) return false;
+    return address.ss_family == AF_UNIX;
+}
+
+bool isLoopback(const std::string& host) {
+    if (host == "localhost") return true;
+    in_addr address{};
+    return inet_pton(AF_INET, host.c_str(), &address) == 1 && (ntohl(address.s_addr) >> 24) == 127;
+}
+
+}
+
+MappedFile::~MappedFile() {
+#ifdef _WIN32
+    if (data_) UnmapViewOfFile(data_);
+    if (mapping_) CloseHandle(mapping_);
+    if (file_ && file_ != INVALID_HANDLE_VALUE) CloseHandle(file_);
+#else
+    if (data_) munmap(const_cast<uint8_t*>(data_), size_);
+#endif
+}
+
+bool MappedFile::open(const std::filesystem::path& path, uint64_t size) {
+    if (data_ || size == 0) return false;
+#ifdef _WIN32
+    // the owner keeps writing the file, so we share every access
+    file_ = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                        nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file_ == INVALID_HANDLE_VALUE) return false;
+    LARGE_INTEGER actual;
+    if (!GetFileSizeEx(file_, &actual) || static_cast<uint64_t>(actual.QuadPart) != size) return false;
+    mapping_ = CreateFileMappingW(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!mapping_) return false;
+    data_ = static_cast<const uint8_t*>(MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0));
+    if (!data_) return false;
+#else
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    struct stat info{};
+    if (fstat(fd, &info) != 0 || static_cast<uint64_t>(info.st_size) != size) {
+        ::close(fd);
+        return false;
+    }
+    void* mapped = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    // the mapping keeps the file alive, a rename or unlink by its owner does not matter
+    ::close(fd);
+    if (mapped == MAP_FAILED) return false;
+    data_ = static_cast<const uint8_t*>(mapped);
+#endif
+    size_ = size;
+    return true;
+}
+
+ByteView MappedFile::view(uint64_t offset, size_t len) const {
+    if (!data_ || offset > size_ || len > size_ - offset) return ByteView();
+    return ByteView(data_ + offset, len);
+}
@@ -0,0 +1,52 @@
+#pragma once
+#include <string>
+#include <filesystem>
+#include <cstdint>
+#include <cstddef>
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include "BufferPool.h"
+
+// same-host connections: besides its TCP port the daemon listens on a Unix socket named
+// after that port, and a peer on the same host connects there instead of going through
+// the network stack, see LocalSocketDir in Swarms.cfg
+namespace local {
+
+// <dir>/p2p_<port>.sock, ports are unique on a host so the name is too
+std::filesystem::path socketPath(const std::filesystem::path& dir, int port);
+// a bound and listening socket, a stale file left by a dead peer is replaced, INVALID_SOCKET on failure
+SOCKET listenOn(const std::filesystem::path& path);
+// INVALID_SOCKET if nobody listens there, the caller falls back to TCP
+SOCKET connectTo(const std::filesystem::path& path);
+// true for a Unix socket, whichever end accepted it
+bool isLocal(SOCKET sock);
+// a host name or address that can only be this machine
+bool isLoopback(const std::string& host);
+
+}
+
+// read-only view of another peer's file on this host, so a piece they serve us is one memcpy
+// out of the page cache instead of a trip through both socket buffers
+class MappedFile {
+public:
+    MappedFile() = default;
+    ~MappedFile();
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    // false unless the file opens and is exactly size bytes, a renamed file stays mapped
+    bool open(const std::filesystem::path& path, uint64_t size);
+    // empty if the range runs past the end
+    ByteView view(uint64_t offset, size_t len) const;
+    uint64_t size() const {
+        return size_;
+    }
+
+private:
+    const uint8_t* data_ = nullptr;
+    uint64_t size_ = 0;
+#ifdef _WIN32
+    void* file_ = nullptr;
+    void* mapping_ = nullptr;
+#endif
+};
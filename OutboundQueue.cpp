@@ -0,0 +1,166 @@
+#include "OutboundQueue.h"
+#include "messageSender.h"
+#include "WireTrace.h"
+#include "Trace.h"
+#include "Profile.h"
+#include <cstring>
+
+OutboundQueue::OutboundQueue(SOCKET sock, int peerId, size_t byteLimit, std::shared_ptr<BufferPool> pool,
+                             std::shared_ptr<UploadBudget> budget)
+    : sock_(sock), peerId_(peerId), byteLimit_(byteLimit), pool_(std::move(pool)), budget_(std::move(budget)) {
+    writer_ = std::thread(&OutboundQueue::writerLoop, this);
+}
+
+OutboundQueue::~OutboundQueue() {
+    stop();
+}
+
+void OutboundQueue::pushControl(const char* frame, size_t len) {
+    Frame f;
+    f.head = pool_->acquire(len);
+    std::memcpy(f.head.data(), frame, len);
+    push(std::move(f), true);
+}
+
+void OutboundQueue::pushPiece(const char* head, size_t headLen, PooledBuffer owner, ByteView body) {
+    Frame f;
+    f.head = pool_->acquire(headLen);
+    std::memcpy(f.head.data(), head, headLen);
+    f.owner = std::move(owner);
+    f.body = body;
+    push(std::move(f), false);
+}
+
+void OutboundQueue::pushPiece(const char* head, size_t headLen, const uint8_t* body, size_t bodyLen) {
+    PooledBuffer copy = pool_->acquire(bodyLen);
+    std::memcpy(copy.data(), body, bodyLen);
+    ByteView view = copy.view();
+    pushPiece(head, headLen, std::move(copy), view);
+}
+
+void OutboundQueue::push(Frame frame, bool control) {
+    WireTrace::onSend(sock_, reinterpret_cast<const char*>(frame.head.data()), frame.head.size());
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (closing_ || done_) return;
+        if (control) {
+            control_.push_back(std::move(frame));
+        }
+        else {
+            pieceBytes_ += frame.body.size;
+            pieces_.push_back(std::move(frame));
+        }
+    }
+    ready_.notify_one();
+}
+
+bool OutboundQueue::deferUntilSpace(std::function<void()> task) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (closing_ || done_) return true;
+    // behind anything already deferred, so requests are served in the order they came
+    if (pieceBytes_ < byteLimit_ && deferred_.empty()) return false;
+    deferred_.push_back(std::move(task));
+    return true;
+}
+
+void OutboundQueue::runDeferred() {
+    while (true) {
+        std::function<void()> task;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (closing_ || done_ || deferred_.empty() || pieceBytes_ >= byteLimit_) return;
+            task = std::move(deferred_.front());
+            deferred_.pop_front();
+        }
+        task();
+    }
+}
+
+void OutboundQueue::close() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closing_ = true;
+        deferred_.clear();
+    }
+    ready_.notify_one();
+}
+
+void OutboundQueue::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        done_ = true;
+        control_.clear();
+        pieces_.clear();
+        deferred_.clear();
+        pieceBytes_ = 0;
+    }
+    ready_.notify_one();
+    if (writer_.joinable() && writer_.get_id() != std::this_thread::get_id()) writer_.join();
+}
+
+size_t OutboundQueue::queuedBytes() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return pieceBytes_;
+}
+
+void OutboundQueue::writerLoop() {
+    profile::nameThread("send to peer " + std::to_string(peerId_));
+    while (true) {
+        Frame frame;
+        bool piece = false;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            ready_.wait(lock, [this]() { return done_ || closing_ || !control_.empty() || !pieces_.empty(); });
+            if (done_) return;
+            if (!control_.empty()) {
+                frame = std::move(control_.front());
+                control_.pop_front();
+            }
+            else if (!pieces_.empty()) {
+                frame = std::move(pieces_.front());
+                pieces_.pop_front();
+                piece = true;
+            }
+            else {
+                // closing and everything queued has been written
+                done_ = true;
+                lock.unlock();
+                shutdown(sock_, SD_SEND);
+                return;
+            }
+        }
+
+        // the upload budget is shared by every swarm in the process, a piece is paid for as it goes
+        // out, so one that is cancelled or never read costs nothing, and waiting holds back only
+        // this connection's writer, a cancelled budget means we are shutting down
+        if (piece && budget_ && !budget_->acquire(frame.body.size)) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            done_ = true;
+            control_.clear();
+            pieces_.clear();
+            deferred_.clear();
+            pieceBytes_ = 0;
+            return;
+        }
+
+        bool ok = sendFrame(sock_, reinterpret_cast<const char*>(frame.head.data()), frame.head.size(),
+                            reinterpret_cast<const char*>(frame.body.data), frame.body.size);
+        if (ok && piece) bytesWritten_.fetch_add(frame.body.size, std::memory_order_relaxed);
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            // stop() already zeroed the count
+            if (piece && !done_) pieceBytes_ -= frame.body.size;
+            if (!ok) {
+                P2P_INFO("Send to peer " << peerId_ << " failed, dropping queued messages");
+                done_ = true;
+                control_.clear();
+                pieces_.clear();
+                deferred_.clear();
+                pieceBytes_ = 0;
+            }
+        }
+        if (!ok) return;
+        // what was held back for room is served as pieces leave
+        if (piece) runDeferred();
+    }
+}
@@ -0,0 +1,81 @@
+#pragma once
+#include <deque>
+#include <functional>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <cstdint>
+#include <winsock2.h>
+#include "BufferPool.h"
+#include "UploadBudget.h"
+
+// frames waiting to go out on one connection, written by its own thread only
+// control messages (everything but PIECE) go ahead of queued pieces, and every
+// frame is written whole, so two frames never interleave on the wire
+class OutboundQueue {
+public:
+    // byteLimit bounds the queued pieces, see deferUntilSpace
+    // each piece is paid for from budget, if there is one, as it is written
+    OutboundQueue(SOCKET sock, int peerId, size_t byteLimit, std::shared_ptr<BufferPool> pool,
+                  std::shared_ptr<UploadBudget> budget);
+    ~OutboundQueue();
+
+    OutboundQueue(const OutboundQueue&) = delete;
+    OutboundQueue& operator=(const OutboundQueue&) = delete;
+
+    // these never block, a closed or failed queue drops the frame
+    void pushControl(const char* frame, size_t len);
+    // owner keeps body alive until it has been written
+    void pushPiece(const char* head, size_t headLen, PooledBuffer owner, ByteView body);
+    // body is copied into a pooled buffer first
+    void pushPiece(const char* head, size_t headLen, const uint8_t* body, size_t bodyLen);
+
+    // never blocks: false if there is room for another piece now, and the caller goes ahead,
+    // otherwise task is kept and run on the writer thread once written pieces make room,
+    // in the order deferred, and is dropped if the queue closes first
+    bool deferUntilSpace(std::function<void()> task);
+    // writes what is already queued, then shuts down our side of the connection
+    void close();
+    // drops what is queued and joins the writer, safe to call more than once
+    void stop();
+
+    size_t queuedBytes() const;
+    // piece bytes that have made it onto the socket, for upload rates, headers and control frames
+    // do not count so a peer is not credited for the HAVEs and PINGs we send it
+    uint64_t bytesWritten() const {
+        return bytesWritten_.load(std::memory_order_relaxed);
+    }
+
+private:
+    // the header is copied into a small pooled buffer, so queueing a frame allocates nothing
+    struct Frame {
+        PooledBuffer head;
+        PooledBuffer owner;
+        ByteView body;
+    };
+
+    void push(Frame frame, bool control);
+    void writerLoop();
+    // on the writer thread, while there is room
+    void runDeferred();
+
+    SOCKET sock_;
+    int peerId_;
+    size_t byteLimit_;
+    std::shared_ptr<BufferPool> pool_;
+    std::shared_ptr<UploadBudget> budget_;
+
+    mutable std::mutex mutex_;
+    std::condition_variable ready_;     // a frame was queued, or we are closing
+    std::deque<Frame> control_;
+    std::deque<Frame> pieces_;
+    std::deque<std::function<void()>> deferred_;
+    size_t pieceBytes_ = 0;
+    bool closing_ = false;  // no new frames, shut down once drained
+    bool done_ = false;     // stopped or a send failed
+    std::atomic<uint64_t> bytesWritten_{0};
+    std::thread writer_;
+};
@@ -0,0 +1,439 @@
+#include <algorithm>
+#include "PeerDaemon.h"
+
+namespace {
+
+// a peer sends its handshake as soon as it connects, don't hold up accept() for longer
+constexpr int kHandshakeTimeoutMs = 2000;
+
+}
+
+PeerDaemon::PeerDaemon(int peerId) : ID(peerId) {}
+
+PeerDaemon::~PeerDaemon() {
+    stop();
+}
+
+// read Swarms.cfg, one swarm directory per line
+void PeerDaemon::readSwarms() {
+    std::ifstream swarmsFile("Swarms.cfg");
+    if (!swarmsFile.is_open()) {
+        swarmDirs.push_back(".");
+        return;
+    }
+
+    std::string line;
+    while (std::getline(swarmsFile, line)) {
+        std::istringstream stream(line);
+        std::string key, value;
+        stream >> key >> value;
+        if (key == "Swarm")
+            swarmDirs.push_back(value);
+        else if (key == "UploadRateLimit")
+            uploadRateLimit = std::stoull(value);
+        else if (key == "TraceLevel")
+            traceLevel = value;
+        else if (key == "ControlSocket")
+            controlPath = value;
+        else if (key == "LocalSocketDir")
+            localSocketDir = value;
+        else if (key == "ProfileSampling")
+            profileSampling = std::stoul(value);
+    }
+    if (swarmDirs.empty()) swarmDirs.push_back(".");
+}
+
+bool PeerDaemon::load() {
+    readSwarms();
+
+    for (const auto& dir : swarmDirs) {
+        auto swarm = std::make_unique<PeerProcess>(ID, dir);
+        if (!swarm->load()) {
+            P2P_ERROR("Peer " << ID << " skipping swarm in " << dir);
+            continue;
+        }
+        if (findSwarm(swarm->swarmId())) {
+            P2P_ERROR("Peer " << ID << " swarm in " << dir << " has the same id as another swarm, skipping it");
+            continue;
+        }
+        swarms.push_back(std::move(swarm));
+    }
+    if (swarms.empty()) return false;
+
+    // process wide, so it overrides whatever the swarms' Common.cfg files said
+    if (!traceLevel.empty()) {
+        int level;
+        if (trace::parseLevel(traceLevel, level))
+            trace::setLevel(level);
+        else
+            P2P_ERROR("Unknown TraceLevel " << traceLevel << " in Swarms.cfg");
+    }
+    profile::setSampling(profileSampling);
+
+    // every swarm is reached on the same port
+    port = swarms.front()->listenPort();
+    for (const auto& swarm : swarms) {
+        if (swarm->listenPort() != port) {
+            P2P_ERROR("Peer " << ID << " swarm " << swarm->swarmId() << " lists port " << swarm->listenPort()
+                      << ", all swarms are served on port " << port);
+        }
+    }
+    return true;
+}
+
+void PeerDaemon::start() {
+    // initialize the winsock
+    static WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 0), &wsaData))
+        exit(1);
+    started = true;
+
+    // one pool with a class for every message size any swarm uses
+    std::vector<size_t> classes;
+    for (const auto& swarm : swarms) {
+        auto sizes = swarm->bufferClasses();
+        classes.insert(classes.end(), sizes.begin(), sizes.end());
+    }
+    shared.bufferPool = std::make_shared<BufferPool>(classes);
+
+    // one set of disk workers, set up from the first swarm and big enough for every piece size
+    const Common& first = swarms.front()->common;
+    DiskIOOptions options;
+    options.backend = first.diskBackend;
+    options.directIO = first.directIO;
+    options.bufferSize = 0;
+    for (const auto& swarm : swarms) {
+        options.bufferSize = std::max<size_t>(options.bufferSize, swarm->common.pieceSize);
+    }
+    shared.diskIO = DiskIO::create(options);
+    shared.uploadBudget = std::make_shared<UploadBudget>(uploadRateLimit);
+    shared.executor = std::make_shared<Executor>(first.executorThreads);
+    if (localSocketDir.empty()) {
+        std::error_code ec;
+        shared.localSocketDir = std::filesystem::temp_directory_path(ec);
+    }
+    else if (localSocketDir != "off") {
+        shared.localSocketDir = localSocketDir;
+    }
+
+    P2P_INFO("Peer " << ID << " hosting " << swarms.size() << " swarm(s) on port " << port);
+
+    // a connection can arrive as soon as we listen, so every swarm is ready for it first,
+    // and we listen before connecting out so peers that connect to us right away are accepted
+    for (auto& swarm : swarms) swarm->init(shared);
+    startListen();
+    for (auto& swarm : swarms) swarm->start();
+
+    if (controlPath.empty()) controlPath = "control_" + std::to_string(ID) + ".sock";
+    if (controlPath != "off") {
+        controlSocket = std::make_unique<ControlSocket>(controlPath, [this](const std::string& line) { return control(line); });
+        if (!controlSocket->start()) controlSocket.reset();
+    }
+}
+
+void PeerDaemon::waitForSwarms() {
+    for (auto& swarm : swarms) swarm->waitForSwarm();
+}
+
+void PeerDaemon::stop() {
+    if (stopped) return;
+    stopped = true;
+    stopRequested = true;
+
+    if (controlSocket) controlSocket->stop();
+    if (listenerThread.joinable()) listenerThread.join();
+    // nobody should sit in the upload budget while their swarm shuts down
+    if (shared.uploadBudget) shared.uploadBudget->cancel();
+    for (auto& swarm : swarms) swarm->stop();
+    if (shared.diskIO) shared.diskIO->drain();
+    if (started) WSACleanup();
+}
+
+PeerProcess* PeerDaemon::findSwarm(uint32_t swarmId) {
+    if (swarmId == 0) return swarms.empty() ? nullptr : swarms.front().get();
+    for (auto& swarm : swarms) {
+        if (swarm->swarmId() == swarmId) return swarm.get();
+    }
+    return nullptr;
+}
+
+namespace {
+
+const char* kControlHelp =
+    "swarms                          every swarm with its id and progress\n"
+    "get [swarm id]                  settings that can be changed at runtime\n"
+    "peers [swarm id]                peer, choke and request state\n"
+    "set [swarm id] <key> <value>... change settings, all of them or none,\n"
+    "                                swarm settings apply at the swarm's next tick\n"
+    "    NumberOfPreferredNeighbors UnchokingInterval OptimisticUnchokingInterval\n"
+    "    RequestWindow PieceCacheBytes PingInterval NearRttUs\n"
+    "    UploadRateLimit TraceLevel (process wide, apply at once)\n"
+    "priority [swarm id] [<first>[-<last>] <level>]\n"
+    "                                piece priorities, or set them for pieces first to last:\n"
+    "                                skip low normal high, applied at once\n"
+    "range [swarm id] <offset> <length> [level]\n"
+    "                                the same for the pieces holding a byte range, normal by default\n"
+    "profile [every <n> | off | clear | dump <path>]\n"
+    "                                timing spans: sampling and spans held, record one in n,\n"
+    "                                stop, drop what is held, or write it as a Chrome trace\n";
+
+}
+
+std::string PeerDaemon::control(const std::string& line) {
+    std::istringstream in(line);
+    std::string command;
+    in >> command;
+    std::vector<std::string> args;
+    for (std::string arg; in >> arg;) args.push_back(arg);
+
+    // a leading "swarm <id>" picks one swarm, otherwise every swarm
+    std::vector<PeerProcess*> targets;
+    if (args.size() >= 2 && args[0] == "swarm") {
+        PeerProcess* swarm = nullptr;
+        try {
+            swarm = findSwarm(static_cast<uint32_t>(std::stoul(args[1])));
+        }
+        catch (const std::exception&) {}
+        if (!swarm) return "error: no swarm " + args[1];
+        targets.push_back(swarm);
+        args.erase(args.begin(), args.begin() + 2);
+    }
+    else {
+        for (auto& swarm : swarms) targets.push_back(swarm.get());
+    }
+
+    std::ostringstream out;
+    if (command == "help") {
+        out << kControlHelp;
+    }
+    else if (command == "swarms") {
+        for (const auto& swarm : swarms) {
+            out << swarm->swarmId() << " " << swarm->directory().string() << " "
+                << swarm->bitfield.count() << "/" << swarm->bitfield.getSize() << "\n";
+        }
+    }
+    else if (command == "get") {
+        out << "UploadRateLimit " << uploadRateLimit << "\n";
+        for (PeerProcess* swarm : targets) out << "swarm " << swarm->swarmId() << "\n" << swarm->describeSettings();
+    }
+    else if (command == "peers") {
+        for (PeerProcess* swarm : targets) out << "swarm " << swarm->swarmId() << "\n" << swarm->describePeers();
+    }
+    else if (command == "set") {
+        if (args.empty() || args.size() % 2) return "error: set takes <key> <value> pairs";
+
+        // the process wide ones are checked here, the rest by each swarm
+        std::vector<std::pair<std::string, std::string>> settings;
+        std::optional<uint64_t> rate;
+        int level = -1;
+        for (size_t i = 0; i < args.size(); i += 2) {
+            if (args[i] == "UploadRateLimit") {
+                try {
+                    rate = std::stoull(args[i + 1]);
+                }
+                catch (const std::exception&) {
+                    return "error: bad value for UploadRateLimit: " + args[i + 1];
+                }
+            }
+            else if (args[i] == "TraceLevel") {
+                if (!trace::parseLevel(args[i + 1], level)) return "error: unknown TraceLevel " + args[i + 1];
+            }
+            else {
+                settings.emplace_back(args[i], args[i + 1]);
+            }
+        }
+        // every swarm checks the same keys, so a bad one fails at the first before anything is staged
+        if (!settings.empty()) {
+            for (PeerProcess* swarm : targets) {
+                std::string error;
+                if (!swarm->stageSettings(settings, error)) return "error: " + error;
+            }
+        }
+        if (rate) {
+            uploadRateLimit = *rate;
+            if (shared.uploadBudget) shared.uploadBudget->setRate(uploadRateLimit);
+        }
+        if (level >= 0) trace::setLevel(level);
+        out << "ok\n";
+    }
+    else if (command == "priority" || command == "range") {
+        const bool bytes = command == "range";
+        uint8_t level = PiecePriorities::Normal;
+        size_t first = 0;
+        size_t last = 0;
+        uint64_t offset = 0;
+        uint64_t length = 0;
+        if (!bytes && args.empty()) {
+            for (PeerProcess* swarm : targets) out << "swarm " << swarm->swarmId() << "\n" << swarm->describePriorities();
+            return out.str();
+        }
+        if (bytes) {
+            if (args.size() < 2 || args.size() > 3) return "error: range takes <offset> <length> [level]";
+            try {
+                offset = std::stoull(args[0]);
+                length = std::stoull(args[1]);
+            }
+            catch (const std::exception&) {
+                return "error: bad byte range " + args[0] + " " + args[1];
+            }
+        }
+        else {
+            if (args.size() != 2) return "error: priority takes <first>[-<last>] <level>";
+            if (!PiecePriorities::parseSpan(args[0], first, last)) return "error: bad piece span " + args[0];
+        }
+        if (args.size() > (bytes ? 2u : 1u) && !PiecePriorities::parseLevel(args.back(), level))
+            return "error: unknown level " + args.back() + ", expected skip, low, normal or high";
+        // pieces and offsets only mean something for one file
+        if (targets.size() != 1) return "error: " + command + " needs one swarm, pick it with swarm <id>";
+
+        std::string error;
+        bool ok = bytes ? targets[0]->setRangePriority(offset, length, level, error)
+                        : targets[0]->setPiecePriority(first, last, level, error);
+        if (!ok) return "error: " + error;
+        out << "ok\n";
+    }
+    else if (command == "profile") {
+        if (args.size() == 2 && args[0] == "every") {
+            uint32_t every = 0;
+            try {
+                every = static_cast<uint32_t>(std::stoul(args[1]));
+            }
+            catch (const std::exception&) {}
+            if (every == 0) return "error: profile every takes a count above zero";
+            profile::setSampling(every);
+        }
+        else if (args.size() == 1 && args[0] == "off") {
+            profile::setSampling(0);
+        }
+        else if (args.size() == 1 && args[0] == "clear") {
+            profile::clear();
+        }
+        else if (args.size() == 2 && args[0] == "dump") {
+            size_t spans = 0;
+            if (!profile::writeChromeTrace(args[1], ID, spans)) return "error: could not write " + args[1];
+            out << "wrote " << spans << " spans to " << args[1] << "\n";
+            return out.str();
+        }
+        else if (!args.empty()) {
+            return "error: profile takes every <n>, off, clear or dump <path>";
+        }
+        const uint32_t every = profile::sampleEvery.load();
+        if (every == 0)
+            out << "sampling off";
+        else
+            out << "sampling 1 in " << every;
+        out << ", " << profile::heldSpans() << " spans held\n";
+    }
+    else {
+        return "error: unknown command " + command + ", try help";
+    }
+    return out.str();
+}
+
+// start listening for connections from other peers
+void PeerDaemon::startListen() {
+    // start thread
+    listenerThread = std::thread([this]() {
+        profile::nameThread("listener");
+        // initialize the server socket
+        SOCKET serverSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (serverSocket == INVALID_SOCKET) {
+            P2P_ERROR("Peer " << ID << " ERROR: Could not create socket");
+            return;
+        }
+
+        // allow reuse of the port
+        BOOL opt = TRUE;
+        setsockopt(serverSocket, SOL_SOCKET, SO_REUSEADDR, (const char *) &opt, sizeof(opt));
+
+        sockaddr_in service{};
+        service.sin_family = AF_INET;
+        service.sin_port = htons(port);
+        service.sin_addr.s_addr = INADDR_ANY;
+
+        // try to bind on peer port
+        if (bind(serverSocket, (SOCKADDR *) &service, sizeof(service)) == SOCKET_ERROR) {
+            P2P_ERROR("Peer " << ID << " ERROR: bind() failed on port" << port);
+            closesocket(serverSocket);
+            return;
+        }
+
+        // initiate listening
+        if (listen(serverSocket, SOMAXCONN) == SOCKET_ERROR) {
+            P2P_ERROR("Peer " << ID << " ERROR: listen() failed");
+            closesocket(serverSocket);
+            return;
+        }
+
+        // socket is successfully listening for other peers
+        P2P_INFO("[RUBRIC 1b] Peer " << ID << " now listening on port " << port);
+
+        // same-host peers come in on a Unix socket named after our port, over the same handshake
+        SOCKET localSocket = INVALID_SOCKET;
+        std::filesystem::path localPath;
+        if (!shared.localSocketDir.empty()) {
+            localPath = local::socketPath(shared.localSocketDir, port);
+            localSocket = local::listenOn(localPath);
+            if (localSocket == INVALID_SOCKET)
+                P2P_ERROR("Peer " << ID << " could not listen on " << localPath << ", same-host peers use TCP");
+            else
+                P2P_INFO("Peer " << ID << " now listening for same-host peers on " << localPath);
+        }
+
+        // listening loop, wakes up now and then to notice a stop request
+        while (!stopRequested.load()) {
+            fd_set readable;
+            FD_ZERO(&readable);
+            FD_SET(serverSocket, &readable);
+            if (localSocket != INVALID_SOCKET) FD_SET(localSocket, &readable);
+            const SOCKET highest = localSocket == INVALID_SOCKET ? serverSocket : std::max(serverSocket, localSocket);
+            timeval timeout{0, 250000};
+            if (select(static_cast<int>(highest) + 1, &readable, nullptr, nullptr, &timeout) <= 0)
+                continue;
+
+            if (FD_ISSET(serverSocket, &readable)) acceptPeer(serverSocket);
+            if (localSocket != INVALID_SOCKET && FD_ISSET(localSocket, &readable)) acceptPeer(localSocket);
+        }
+
+        if (localSocket != INVALID_SOCKET) {
+            closesocket(localSocket);
+            std::error_code ignored;
+            std::filesystem::remove(localPath, ignored);
+        }
+        closesocket(serverSocket);
+    });
+}
+
+void PeerDaemon::acceptPeer(SOCKET serverSocket) {
+    // try to accept incoming message from other peer
+    SOCKET clientSocket = accept(serverSocket, nullptr, nullptr);
+
+    if (clientSocket == INVALID_SOCKET) {
+        P2P_ERROR("Peer " << ID << " ERROR: accept() failed");
+        return;
+    }
+
+    // the handshake says which swarm the connection is for
+    std::array<unsigned char, 32> handshake{};
+    setReceiveTimeout(clientSocket, kHandshakeTimeoutMs);
+    int received = recv(clientSocket, (char*)handshake.data(), 32, MSG_WAITALL);
+    setReceiveTimeout(clientSocket, 0);
+    if (received != 32) {
+        P2P_ERROR("Peer " << ID << " ERROR: Invalid handshake received of size " << received);
+        closesocket(clientSocket);
+        return;
+    }
+
+    uint32_t swarmId;
+    memcpy(&swarmId, handshake.data() + 18, 4);
+    swarmId = ntohl(swarmId);
+    PeerProcess* swarm = findSwarm(swarmId);
+    if (!swarm) {
+        P2P_ERROR("Peer " << ID << " ERROR: no swarm " << swarmId << " here");
+        closesocket(clientSocket);
+        return;
+    }
+
+    // go handle the connection
+    swarm->adoptConnection(clientSocket, handshake);
+}
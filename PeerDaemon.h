@@ -0,0 +1,60 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <filesystem>
+#include "PeerProcess.h"
+#include "ControlSocket.h"
+#include "Profile.h"
+
+// hosts every swarm this peer takes part in behind one listening port
+// Swarms.cfg in the working directory lists them:
+//     Swarm <directory with its own Common.cfg and PeerInfo.cfg>
+//     UploadRateLimit <bytes per second across all swarms, 0 for none>
+//     TraceLevel <error, info, debug or wire>
+//     ControlSocket <path of the local control socket, off for none, control_<id>.sock by default>
+//     LocalSocketDir <where same-host peers find each other's Unix sockets, off for TCP only,
+//                     the system temporary directory by default>
+//     ProfileSampling <record one in this many timing spans, 0 for none by default, see Profile.h>
+// without it the working directory is the only swarm, as before
+class PeerDaemon {
+public:
+    explicit PeerDaemon(int peerId);
+    ~PeerDaemon();
+
+    // false if no swarm could be loaded
+    bool load();
+    void start();
+    // blocks until every swarm is complete
+    void waitForSwarms();
+    void stop();
+
+private:
+    void readSwarms();
+    void startListen();
+    // reads the handshake of an accepted connection and hands it to its swarm
+    void acceptPeer(SOCKET serverSocket);
+    // the swarm a handshake names, 0 names the first one
+    PeerProcess* findSwarm(uint32_t swarmId);
+    // one command from the control socket, see help in PeerDaemon.cpp
+    std::string control(const std::string& line);
+
+    int ID;
+    int port = 0;
+    uint64_t uploadRateLimit = 0;
+    std::string traceLevel;
+    std::string controlPath;
+    std::string localSocketDir;
+    uint32_t profileSampling = 0;
+    std::unique_ptr<ControlSocket> controlSocket;
+    std::vector<std::filesystem::path> swarmDirs;
+    std::vector<std::unique_ptr<PeerProcess>> swarms;
+    SharedResources shared;
+
+    std::thread listenerThread;
+    std::atomic<bool> stopRequested{false};
+    bool started = false;
+    bool stopped = false;
+};
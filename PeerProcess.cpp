@@ -2,33 +2,209 @@
 #include <unordered_set>
 #include "PeerProcess.h"
 
-// initiate with the peer id
-PeerProcess::PeerProcess(int peerId) {
+void setReceiveTimeout(SOCKET sock, int ms) {
+#ifdef _WIN32
+    DWORD timeout = ms;
+#else
+    timeval timeout{ms / 1000, (ms % 1000) * 1000};
+#endif
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char *) &timeout, sizeof(timeout));
+}
+
+namespace {
+
+// how long a closing connection may wait for the other side to finish
+constexpr int kCloseTimeoutMs = 5000;
+
+uint64_t uploadKey(int peerId, int index) {
+    return (static_cast<uint64_t>(static_cast<uint32_t>(peerId)) << 32) | static_cast<uint32_t>(index);
+}
+
+// the Common.cfg keys the control socket may change while the swarm runs,
+// false for any other key, throws on a value that is not a number
+bool parseRuntimeSetting(Common& target, const std::string& key, const std::string& value) {
+    if (key == "NumberOfPreferredNeighbors")
+        target.numberOfPreferredNeighbors = std::max(0, std::stoi(value));
+    else if (key == "UnchokingInterval")
+        target.unchokingInterval = std::max(1, std::stoi(value));
+    else if (key == "OptimisticUnchokingInterval")
+        target.optimisticUnchokingInterval = std::max(1, std::stoi(value));
+    else if (key == "RequestWindow")
+        target.requests.window = std::max<size_t>(1, std::stoul(value));
+    else if (key == "PieceCacheBytes")
+        target.pieceCacheBytes = std::stoull(value);
+    else if (key == "PingInterval")
+        target.pingInterval = std::max(0, std::stoi(value));
+    else if (key == "NearRttUs")
+        target.nearRtt = std::chrono::microseconds(std::max(0, std::stoi(value)));
+    else
+        return false;
+    return true;
+}
+
+// the big endian stamp a PING or PONG carries
+uint64_t readStamp(ByteView payload) {
+    uint64_t stamp = 0;
+    for (int i = 0; i < 8; i++) stamp = (stamp << 8) | payload[i];
+    return stamp;
+}
+
+}
+
+// FNV-1a over the file name and size, so peers sharing the same file agree on the id
+uint32_t contentId(const std::string& fileName, int fileSize) {
+    uint32_t hash = 2166136261u;
+    for (unsigned char c : fileName + ":" + std::to_string(fileSize)) {
+        hash ^= c;
+        hash *= 16777619u;
+    }
+    // 0 is left for peers that do not name a swarm
+    return hash == 0 ? 1 : hash;
+}
+
+// initiate with the peer id and the directory holding this swarm's configuration
+PeerProcess::PeerProcess(int peerId, std::filesystem::path dir) : dir(std::move(dir)) {
     ID = peerId;
 }
 
-// start the peerProcess
-void PeerProcess::start() {
-    // initializers
-    readCommon();
+PeerProcess::~PeerProcess() {
+    stop();
+}
+
+bool PeerProcess::load() {
+    if (!readCommon()) return false;
     readPeerInfo();
+    return true;
+}
+
+// set up everything a connection needs, before the daemon accepts any for us
+void PeerProcess::init(const SharedResources& shared) {
+    diskIO = shared.diskIO;
+    bufferPool = shared.bufferPool;
+    uploadBudget = shared.uploadBudget;
+    localSocketDir = shared.localSocketDir;
+    cpuTasks = std::make_unique<TaskGroup>(shared.executor);
+
+    // initializers
     bitfieldInit();
+    prioritiesInit();
+    pieceHashesInit();
+    bufferPoolInit();
+    requestTrackerInit();
     fileHandlinitInit();
+    superSeedInit();
     loggerInit();
+    if (!offline) wireTraceInit();
+}
 
+// start the peerProcess, the daemon is already listening for us
+void PeerProcess::start() {
     // start peer processes
-    startListen();
     connectToEarlierPeers();
 
     // choose new neighbors
     findPreferredNeighbor();
     startOptimisticUnchoke();
+    startRequestTimer();
+}
+
+// only init(), no connections or schedulers, for the wire replay
+void PeerProcess::startOffline(const SharedResources& shared) {
+    offline = true;
+    init(shared);
+}
+
+void PeerProcess::replayConnect(int peerId) {
+    {
+        std::lock_guard<std::mutex> lock(superSeedMutex);
+        if (superSeeder) superSeeder->addPeer(peerId);
+    }
+    CompressedBitfield nullBitfield(bitfield.getSize(), false);
+    std::lock_guard<std::mutex> lock(peersMutex);
+    PeerRelationship newPeer(INVALID_SOCKET, nullBitfield, peerId, true, true, false, false);
+    newPeer.downloadRate = newPeer.uploadRate = rateEstimator();
+    newPeer.sameHost = onOurHost(peerId);
+    relationships.erase(peerId);
+    relationships.emplace(peerId, newPeer);
+}
+
+void PeerProcess::replayMessage(int peerId, unsigned char type, const PooledBuffer& payload) {
+    {
+        std::lock_guard<std::mutex> lock(peersMutex);
+        if (relationships.find(peerId) == relationships.end()) return;
+    }
+    dispatchMessage(peerId, type, payload);
+}
+
+void PeerProcess::replayDisconnect(int peerId) {
+    {
+        std::lock_guard<std::mutex> lock(peersMutex);
+        if (relationships.find(peerId) == relationships.end()) return;
+    }
+    onPeerDisconnected(peerId);
+}
+
+void PeerProcess::replayChokeRound(bool optimistic) {
+    if (optimistic)
+        optimisticUnchokeRound(replayRng);
+    else
+        preferredNeighborRound(replayRng);
+}
+
+void PeerProcess::waitForSwarm() {
+    std::unique_lock<std::mutex> lock(lifecycleMutex);
+    lifecycleCv.wait(lock, [this]() { return swarmComplete || stopRequested.load(); });
+    if (swarmComplete) {
+        P2P_INFO("[RUBRIC 1c][RUBRIC 4] Peer " << ID << " observed all peers have completed the file. Shutting down cleanly.");
+    }
+}
+
+void PeerProcess::stop() {
+    {
+        std::lock_guard<std::mutex> lock(lifecycleMutex);
+        if (stopped) return;
+        stopped = true;
+        stopRequested = true;
+    }
+    lifecycleCv.notify_all();
+
+    // the schedulers wake up on the stop request by themselves
+    if (preferredNeighborThread.joinable()) preferredNeighborThread.join();
+    if (optimisticUnchokeThread.joinable()) optimisticUnchokeThread.join();
+    if (requestTimerThread.joinable()) requestTimerThread.join();
+
+    // everything received so far goes to disk before the connections go away
+    if (writeBehind) writeBehind->flush();
+    if (cpuTasks) cpuTasks->wait();
+
+    // a shut down socket fails any blocked recv or send, so the connection threads finish
+    std::vector<std::thread> threads;
+    {
+        std::lock_guard<std::mutex> lock(connectionsMutex);
+        for (SOCKET sock : liveSockets) shutdown(sock, SD_BOTH);
+        threads.swap(connectionThreads);
+    }
+    for (auto& thread : threads) thread.join();
+
+    writeBehind.reset();
+    if (diskIO) diskIO->drain();
+    if (wireTrace) wireTrace->flush();
+}
+
+void PeerProcess::adoptConnection(SOCKET sock, const std::array<unsigned char, 32>& handshake) {
+    spawnConnection(sock, true, handshake);
+}
+
+bool PeerProcess::sleepUnlessStopped(std::chrono::milliseconds duration) {
+    std::unique_lock<std::mutex> lock(lifecycleMutex);
+    return lifecycleCv.wait_for(lock, duration, [this]() { return stopRequested.load(); });
 }
 // read the Common.cfg file and place the information in the common strut
-void PeerProcess::readCommon() {
-    std::ifstream commonFile("Common.cfg");
+bool PeerProcess::readCommon() {
+    std::ifstream commonFile(dir / "Common.cfg");
     if (!commonFile.is_open()) {
-        std::cerr << "Failed to open Common.cfg. CWD: " << std::filesystem::current_path() << std::endl;
+        P2P_ERROR("Failed to open Common.cfg. CWD: " << std::filesystem::current_path() << ", swarm directory: " << dir);
+        return false;
     }
     std::string line;
     std::string key, value;
@@ -49,23 +225,229 @@ void PeerProcess::readCommon() {
             common.fileSize = std::stoi(value);
         else if (key == "PieceSize")
             common.pieceSize = std::stoi(value);
+        else if (key == "StorageBackend")
+            common.storageBackend = value;
+        else if (key == "StorageMemory")
+            common.storageMemory = std::stoull(value);
+        else if (key == "DiskBackend")
+            common.diskBackend = value;
+        else if (key == "DirectIO")
+            common.directIO = std::stoi(value) != 0;
+        else if (key == "WriteBehindBytes")
+            common.writeBehindBytes = std::stoull(value);
+        else if (key == "WriteBehindWorkers")
+            common.writeBehindWorkers = std::stoi(value);
+        else if (key == "Durability") {
+            if (!DurabilityPolicy::parseMode(value, common.durability.mode))
+                P2P_ERROR("Unknown Durability " << value << ", expected none, batch or group");
+        }
+        else if (key == "GroupCommitPieces")
+            common.durability.groupPieces = std::stoul(value);
+        else if (key == "SuperSeeding")
+            common.superSeeding = std::stoi(value) != 0;
+        else if (key == "PieceCacheBytes")
+            common.pieceCacheBytes = std::stoull(value);
+        else if (key == "RequestWindow")
+            common.requests.window = std::stoul(value);
+        else if (key == "RequestTimeoutMs")
+            common.requests.minTimeout = std::chrono::milliseconds(std::stoi(value));
+        else if (key == "RequestTimeoutMaxMs")
+            common.requests.maxTimeout = std::chrono::milliseconds(std::stoi(value));
+        else if (key == "SnubTimeout")
+            common.requests.snubTimeout = std::chrono::seconds(std::stoi(value));
+        else if (key == "TraceLevel") {
+            int level;
+            if (trace::parseLevel(value, level))
+                trace::setLevel(level);
+            else
+                P2P_ERROR("Unknown TraceLevel " << value << ", expected error, info, debug or wire");
+        }
+        else if (key == "ExecutorThreads")
+            common.executorThreads = std::stoul(value);
+        else if (key == "OutboundQueueBytes")
+            common.outboundQueueBytes = std::stoull(value);
+        else if (key == "PingInterval")
+            common.pingInterval = std::stoi(value);
+        else if (key == "NearRttUs")
+            common.nearRtt = std::chrono::microseconds(std::stoi(value));
+        else if (key == "WireTrace")
+            common.wireTrace = std::stoi(value) != 0;
+        else if (key == "SwarmId")
+            common.swarmId = static_cast<uint32_t>(std::stoul(value));
+        else if (key == "GroupCommitMs")
+            common.durability.groupDelay = std::chrono::milliseconds(std::stoi(value));
+        else if (key == "PieceHashes")
+            common.pieceHashes = value;
+        else if (key == "ErasureStripe")
+            common.erasureStripe = std::stoul(value);
+        else if (key == "ErasureParity")
+            common.erasureParity = std::stoul(value);
+        else if (key == "DownloadRange") {
+            uint64_t length = 0;
+            if (stream >> length)
+                common.downloadRanges.emplace_back(std::stoull(value), length);
+            else
+                P2P_ERROR("DownloadRange " << value << " has no length, expected <offset> <length>");
+        }
+        else if (key == "PiecePriority") {
+            PiecePriorities::Rule rule;
+            std::string level;
+            stream >> level;
+            if (PiecePriorities::parseSpan(value, rule.first, rule.last) && PiecePriorities::parseLevel(level, rule.level))
+                common.piecePriorities.push_back(rule);
+            else
+                P2P_ERROR("Bad PiecePriority " << value << " " << level << ", expected <first>[-<last>] skip|low|normal|high");
+        }
     }
 
-	std::cout << "[RUBRIC 1a] Peer " << ID
+	P2P_INFO("[RUBRIC 1a] Peer " << ID
               << " read Common.cfg: NumberOfPreferredNeighbors=" << common.numberOfPreferredNeighbors
               << ", UnchokingInterval=" << common.unchokingInterval
               << ", OptimisticUnchokingInterval=" << common.optimisticUnchokingInterval
               << ", FileName=" << common.fileName
               << ", FileSize=" << common.fileSize
-              << ", PieceSize=" << common.pieceSize
-              << std::endl;
+              << ", PieceSize=" << common.pieceSize);
 
     commonFile.close();
+
+    if (common.erasureParity > 0 && (common.erasureStripe == 0 || common.erasureStripe + common.erasureParity > 256)) {
+        P2P_ERROR("ErasureStripe " << common.erasureStripe << " and ErasureParity " << common.erasureParity
+                  << " need 1 to 255 source pieces and at most 256 pieces per stripe, coding is off");
+        common.erasureParity = 0;
+    }
+    erasure.sourcePieces = static_cast<uint32_t>(getSourcePieces());
+    erasure.stripeSource = common.erasureStripe;
+    erasure.stripeParity = common.erasureParity;
+
+    // a coded swarm numbers its pieces differently, so it does not mix with a plain one
+    std::string content = common.fileName;
+    if (erasure.enabled()) content += "#rs" + std::to_string(erasure.stripeSource) + "+" + std::to_string(erasure.stripeParity);
+    if (common.swarmId == 0) common.swarmId = contentId(content, common.fileSize);
+    return true;
+}
+
+bool PeerProcess::stageSettings(const std::vector<std::pair<std::string, std::string>>& settings, std::string& error) {
+    std::lock_guard<std::mutex> lock(stagedMutex);
+    // changes staged since the last tick are kept and added to
+    Common next;
+    if (staged) {
+        next = *staged;
+    }
+    else {
+        std::lock_guard<std::mutex> peersLock(peersMutex);
+        next = common;
+    }
+    for (const auto& [key, value] : settings) {
+        try {
+            if (!parseRuntimeSetting(next, key, value)) {
+                error = "cannot change " + key + " at runtime";
+                return false;
+            }
+        }
+        catch (const std::exception&) {
+            error = "bad value for " + key + ": " + value;
+            return false;
+        }
+    }
+    staged = next;
+    return true;
+}
+
+void PeerProcess::applyStagedSettings() {
+    std::optional<Common> next;
+    {
+        std::lock_guard<std::mutex> lock(stagedMutex);
+        next.swap(staged);
+    }
+    if (!next) return;
+
+    {
+        std::lock_guard<std::mutex> lock(peersMutex);
+        common.numberOfPreferredNeighbors = next->numberOfPreferredNeighbors;
+        common.unchokingInterval = next->unchokingInterval;
+        common.optimisticUnchokingInterval = next->optimisticUnchokingInterval;
+        common.requests.window = next->requests.window;
+        common.pieceCacheBytes = next->pieceCacheBytes;
+        common.pingInterval = next->pingInterval;
+        common.nearRtt = next->nearRtt;
+    }
+    requestTracker->setWindow(next->requests.window);
+    pieceCache->setCapacity(next->pieceCacheBytes);
+    P2P_INFO("Peer " << ID << " applied new settings from the control socket");
+
+    // a larger window can be used straight away
+    fillAllRequests();
+}
+
+std::string PeerProcess::describeSettings() {
+    std::lock_guard<std::mutex> lock(peersMutex);
+    std::ostringstream out;
+    out << "NumberOfPreferredNeighbors " << common.numberOfPreferredNeighbors << "\n"
+        << "UnchokingInterval " << common.unchokingInterval << "\n"
+        << "OptimisticUnchokingInterval " << common.optimisticUnchokingInterval << "\n"
+        << "RequestWindow " << common.requests.window << "\n"
+        << "PieceCacheBytes " << common.pieceCacheBytes << "\n"
+        << "PingInterval " << common.pingInterval << "\n"
+        << "NearRttUs " << common.nearRtt.count() << "\n";
+    return out.str();
+}
+
+std::string PeerProcess::describePeers() {
+    std::ostringstream out;
+    out << "have " << bitfield.count() << "/" << bitfield.getSize()
+        << (bitfield.isComplete() ? " seeding" : downloadDone() ? " upload-only" : endgame.load() ? " endgame" : "")
+        << ", " << wantedMissing.load() << " wanted missing"
+        << ", " << requestTracker->piecesRequested() << " pieces requested\n";
+
+    std::lock_guard<std::mutex> lock(peersMutex);
+    const int optimistic = optimisticUnchokedPeer.load();
+    for (const auto& [id, pr] : relationships) {
+        out << "peer " << id << (pr.connected ? "" : " gone")
+            << " has " << pr.theirBitfield.count()
+            << (pr.chokedThem ? " choked" : id == optimistic ? " optimistic" : " unchoked")
+            << (pr.chokedMe ? " chokes-us" : " sends-us")
+            << (pr.interestedInMe ? " interested" : "")
+            << (pr.interestedInThem ? " wanted" : "")
+            << (pr.uploadOnly ? " upload-only" : "")
+            << (requestTracker->isSnubbed(id) ? " snubbing" : "")
+            << " down " << static_cast<uint64_t>(pr.downloadRate.bytesPerSecond()) << "B/s"
+            << " up " << static_cast<uint64_t>(pr.uploadRate.bytesPerSecond()) << "B/s"
+            << " rtt " << pr.rtt.count() << "us min " << pr.minRtt.count() << "us" << (isNear(pr) ? " near" : "")
+            << " requests " << requestTracker->outstanding(id)
+            << " queued " << (pr.outbound ? pr.outbound->queuedBytes() : 0) << "\n";
+    }
+    return out.str();
+}
+
+bool PeerProcess::setPiecePriority(size_t first, size_t last, uint8_t level, std::string& error) {
+    auto next = std::make_shared<PiecePriorities>(*priorityTable());
+    if (!next->set(first, last, level)) {
+        error = "pieces " + std::to_string(first) + "-" + std::to_string(last) + " lie outside the "
+              + std::to_string(next->getSize()) + " pieces of swarm " + std::to_string(swarmId());
+        return false;
+    }
+    applyPriorities(std::move(next));
+    return true;
+}
+
+bool PeerProcess::setRangePriority(uint64_t offset, uint64_t length, uint8_t level, std::string& error) {
+    if (length == 0 || offset >= static_cast<uint64_t>(common.fileSize)) {
+        error = "bytes " + std::to_string(offset) + "+" + std::to_string(length) + " lie outside the "
+              + std::to_string(common.fileSize) + " bytes of swarm " + std::to_string(swarmId());
+        return false;
+    }
+    return setPiecePriority(offset / common.pieceSize, (offset + length - 1) / common.pieceSize, level, error);
+}
+
+std::string PeerProcess::describePriorities() {
+    auto table = priorityTable();
+    return "want " + std::to_string(table->wantedCount()) + "/" + std::to_string(table->getSize())
+         + ", " + std::to_string(wantedMissing.load()) + " missing: " + table->describe() + "\n";
 }
 
 // read the PeerIndo.cfg file and find the info that matches the ID and fill in the selfInfo struct
 void PeerProcess::readPeerInfo() {
-    std::ifstream peerInfoFile("PeerInfo.cfg");
+    std::ifstream peerInfoFile(dir / "PeerInfo.cfg");
     std::string line;
     int id;
 
@@ -89,13 +471,13 @@ void PeerProcess::readPeerInfo() {
             allPeers.push_back(peer);
             if (id == ID) {
                 // existing assignments...
-                std::cout << "[RUBRIC 1a] Peer " << ID << " set selfInfo: host=" << selfInfo.hostName
-                          << ", port=" << selfInfo.port << ", hasFile=" << selfInfo.has << std::endl;
+                P2P_INFO("[RUBRIC 1a] Peer " << ID << " set selfInfo: host=" << selfInfo.hostName
+                          << ", port=" << selfInfo.port << ", hasFile=" << selfInfo.has);
             } else {
                 // existing allPeers push_back...
-                std::cout << "[RUBRIC 1a] Peer " << ID << " discovered peer: id=" << peer.peerId
+                P2P_INFO("[RUBRIC 1a] Peer " << ID << " discovered peer: id=" << peer.peerId
                           << ", host=" << peer.hostName << ", port=" << peer.port
-                          << ", hasFile=" << peer.has << std::endl;
+                          << ", hasFile=" << peer.has);
             }
         }
     }
@@ -107,133 +489,204 @@ void PeerProcess::bitfieldInit() {
     bitfield = BitfieldManager(getNumPieces(), selfInfo.has);
 }
 
-// get the number of pieces from the common struct pieces
-size_t PeerProcess::getNumPieces() const {
-    return (common.fileSize + common.pieceSize - 1) / common.pieceSize;
+void PeerProcess::pieceHashesInit() {
+    if (common.pieceHashes.empty()) return;
+    pieceHashes = std::make_unique<PieceHashes>();
+    if (!pieceHashes->load(dir / common.pieceHashes, getSourcePieces())) {
+        P2P_ERROR("Peer " << ID << " runs without piece hashes, nothing is verified or deduplicated");
+        pieceHashes.reset();
+        return;
+    }
+    P2P_INFO("Peer " << ID << " loaded piece hashes, " << pieceHashes->redundantPieces() << " pieces are copies in "
+             << pieceHashes->groupCount() << " groups and are filled locally");
 }
 
-void PeerProcess::fileHandlinitInit() {
-    using std::filesystem::exists;
-    fileHandler = FileHandling(std::filesystem::path("."), ID, common.fileName, common.fileSize, common.pieceSize, selfInfo.has == 1);
-    fileHandler.init();
+// DownloadRange picks what we fetch, PiecePriority then reorders or skips within it
+void PeerProcess::prioritiesInit() {
+    const bool selective = !common.downloadRanges.empty();
+    auto table = std::make_shared<PiecePriorities>(getNumPieces(), selective ? PiecePriorities::Skip : PiecePriorities::Normal);
+    for (const auto& [offset, length] : common.downloadRanges) {
+        if (!table->setBytes(offset, length, common.pieceSize, PiecePriorities::Normal))
+            P2P_ERROR("DownloadRange " << offset << " " << length << " lies outside the file");
+    }
+    for (const auto& rule : common.piecePriorities) {
+        if (!table->set(rule.first, rule.last, rule.level))
+            P2P_ERROR("PiecePriority " << rule.first << "-" << rule.last << " lies outside the file");
+    }
 
-    if(selfInfo.has){
-        fileHandler.finalize();
+    size_t missing = 0;
+    for (size_t i = 0; i < table->getSize(); i++) {
+        if (table->wanted(i) && !bitfield.hasPiece(i)) missing++;
     }
+    wantedMissing = missing;
+    if (selective || !common.piecePriorities.empty())
+        P2P_INFO("Peer " << ID << " wants " << table->wantedCount() << "/" << table->getSize() << " pieces: " << table->describe());
+    priorities = std::move(table);
 }
 
-void PeerProcess::loggerInit() {
-    logger.init(ID);
+// message buffers come from a pool sized for control messages, our bitfield and whole pieces
+std::vector<size_t> PeerProcess::bufferClasses() const {
+    const size_t bitfieldBytes = (getNumPieces() + 7) / 8;
+    const size_t pieceMessage = 4 + static_cast<size_t>(common.pieceSize);
+    return {64, bitfieldBytes, pieceMessage};
 }
 
-// start listening for connections from other peers
-void PeerProcess::startListen() {
-    // start thread
-    std::thread listenerThread([this]() {
+// the pool is normally the daemon's, shared with every other swarm
+void PeerProcess::bufferPoolInit() {
+    if (!bufferPool) bufferPool = std::make_shared<BufferPool>(bufferClasses());
+    pieceCache = std::make_unique<PieceCache>(common.pieceCacheBytes);
+}
 
-        // initialize the winsock
-        try {
-            static WSADATA wsaData;
-            int wsaerr = WSAStartup(MAKEWORD(2, 0), &wsaData);
-            if (wsaerr)
-                exit(1);
-        }
-        catch (const std::exception& e) {
-            std::cerr << "Exception in listener thread: " << e.what() << std::endl;
-        } catch (...) {
-            std::cerr << "Unknown exception in listener thread" << std::endl;
-        }
-
-        // initialize the server socket
-        SOCKET serverSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-        if (serverSocket == INVALID_SOCKET) {
-            std::cerr << "Peer " << ID << " ERROR: Could not create socket" << std::endl;
-            WSACleanup(); // have to clean up winsock
-            return;
-        }
+void PeerProcess::requestTrackerInit() {
+    requestTracker = std::make_unique<RequestTracker>(common.requests);
+}
 
-        // allow reuse of the port
-        BOOL opt = TRUE;
-        setsockopt(serverSocket, SOL_SOCKET, SO_REUSEADDR, (const char *) &opt, sizeof(opt));
+// get the number of pieces from the common struct pieces
+size_t PeerProcess::getNumPieces() const {
+    return erasure.enabled() ? erasure.totalPieces() : getSourcePieces();
+}
 
-        sockaddr_in service{};
-        service.sin_family = AF_INET;
-        service.sin_port = htons(selfInfo.port);
-        service.sin_addr.s_addr = INADDR_ANY;
+size_t PeerProcess::getSourcePieces() const {
+    return (common.fileSize + common.pieceSize - 1) / common.pieceSize;
+}
 
-        // try to bind on peer port
-        if (bind(serverSocket, (SOCKADDR *) &service, sizeof(service)) == SOCKET_ERROR) {
-            std::cerr << "Peer " << ID << " ERROR: bind() failed on port" << selfInfo.port << std::endl;
-            closesocket(serverSocket);
-            WSACleanup();
-            return;
-        }
+void PeerProcess::fileHandlinitInit() {
+    using std::filesystem::exists;
+    PieceStoreOptions storeOptions;
+    storeOptions.backend = common.storageBackend;
+    storeOptions.workDir = dir;
+    storeOptions.peerId = ID;
+    storeOptions.fileName = common.fileName;
+    storeOptions.fileSize = common.fileSize;
+    storeOptions.pieceSize = common.pieceSize;
+    storeOptions.seeder = selfInfo.has == 1;
+    storeOptions.memoryBytes = common.storageMemory;
+    pieceStore = PieceStore::create(storeOptions);
+    pieceStore->enableErasureCoding(erasure);
+    if (!pieceStore->init()) P2P_ERROR("Peer " << ID << " could not set up the " << pieceStore->name() << " piece store");
+    P2P_INFO("Peer " << ID << " keeps pieces in the " << pieceStore->name() << " store");
+    stripeStates.assign(erasure.stripes(), StripeOpen);
+
+    // a selection that is already satisfied keeps the .part name, only a whole file gets the final one
+    if(selfInfo.has || bitfield.isComplete()){
+        pieceStore->finalize();
+    }
 
-        // initiate listening
-        if (listen(serverSocket, SOMAXCONN) == SOCKET_ERROR) {
-            std::cerr << "Peer " << ID << " ERROR: listen() failed" << std::endl;
-            closesocket(serverSocket);
-            WSACleanup();
-            return;
+    // piece reads and writes go through the async backend so disk latency stays off the socket threads
+    if (!diskIO) {
+        DiskIOOptions options;
+        options.backend = common.diskBackend;
+        options.directIO = common.directIO;
+        options.bufferSize = common.pieceSize;
+        diskIO = DiskIO::create(options);
+    }
+    pieceStore->attachDiskIO(diskIO);
+    P2P_INFO("Peer " << ID << " using " << diskIO->name() << " disk backend");
+
+    // the seeder has every source piece, so it can work out all the parity before anyone asks
+    if (erasure.enabled() && selfInfo.has) {
+        const auto began = std::chrono::steady_clock::now();
+        for (uint32_t stripe = 0; stripe < erasure.stripes(); stripe++) {
+            if (!pieceStore->encodeStripe(stripe)) P2P_ERROR("Peer " << ID << " could not encode stripe " << stripe);
         }
+        const auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - began);
+        P2P_INFO("Peer " << ID << " encoded " << erasure.stripes() * erasure.stripeParity << " parity pieces in "
+                 << ms.count() << "ms with the " << ReedSolomon::kernelName() << " kernel");
+    }
+    else if (erasure.enabled()) {
+        P2P_INFO("Peer " << ID << " decodes stripes of " << erasure.stripeSource << " pieces plus " << erasure.stripeParity
+                 << " parity with the " << ReedSolomon::kernelName() << " kernel");
+    }
 
-        // socket is successfully listening for other peers
-        std::cout << "[RUBRIC 1b] Peer " << ID << " now listening on port " << selfInfo.port << std::endl;
-
-        // listening loop
-        while(true) {
-            sockaddr_in clientInfo{};
-            int clientInfoSize = sizeof(clientInfo);
+    writeBehind = std::make_unique<WriteBehindQueue>(*pieceStore, common.writeBehindBytes, common.writeBehindWorkers,
+                                                     common.durability,
+                                                     [this](uint32_t index, bool ok) {
+        // the write-behind worker goes straight back to writing, the bookkeeping and
+        // HAVE broadcast for the piece run on the executor
+        cpuTasks->submit([this, index, ok]() { onPieceDurable(index, ok); }, TaskPriority::High);
+    });
+}
 
-            // try to accept incoming message from other peer
-            SOCKET clientSocket = accept(serverSocket, (SOCKADDR*)&clientInfo, &clientInfoSize);
+// super seeding only makes sense for the initial seeder
+void PeerProcess::superSeedInit() {
+    if (common.superSeeding && selfInfo.has) {
+        superSeeder = std::make_unique<SuperSeeder>(getNumPieces());
+        P2P_INFO("Peer " << ID << " is super seeding");
+    }
+}
 
-            if (clientSocket == INVALID_SOCKET) {
-                std::cerr << "Peer " << ID << " ERROR: accept() failed" << std::endl;
-                continue;
-            }
+void PeerProcess::loggerInit() {
+    logger.init(ID, dir);
+}
 
-            // go handle the connection
-            std::thread(&PeerProcess::handleConnection, this, clientSocket, true).detach();
-        }
+void PeerProcess::wireTraceInit() {
+    if (!common.wireTrace) return;
+    wireTrace = std::make_unique<WireTrace>();
+    const std::string name = "wire_peer_" + std::to_string(ID) + ".trace";
+    if (!wireTrace->open(dir / name, ID, static_cast<uint32_t>(getNumPieces())))
+        wireTrace.reset();
+}
 
-        closesocket(serverSocket);
-        WSACleanup();
-    });
+// every connection runs on its own thread until it closes or we stop
+void PeerProcess::spawnConnection(SOCKET sock, bool receiver, std::array<unsigned char, 32> handshake) {
+    std::lock_guard<std::mutex> lock(connectionsMutex);
+    if (stopRequested.load()) {
+        closesocket(sock);
+        return;
+    }
+    liveSockets.insert(sock);
+    connectionThreads.emplace_back(&PeerProcess::handleConnection, this, sock, receiver, handshake);
+}
 
-    listenerThread.detach();
+// forget the socket before closing it so stop() never touches a reused handle
+void PeerProcess::closeConnection(SOCKET sock) {
+    std::lock_guard<std::mutex> lock(connectionsMutex);
+    liveSockets.erase(sock);
+    closesocket(sock);
 }
 
 // handle the connection process, validate handshake
-void PeerProcess::handleConnection(SOCKET clientSocket, bool receiver=true){
-    // confirm handshake size
-    unsigned char handshake[32];
-    int received = recv(clientSocket, (char*)handshake, 32, MSG_WAITALL);
-    if (received != 32) {
-        std::cerr << "Peer " << ID << " ERROR: Invalid handshake received of size " << received << std::endl;
-        closesocket(clientSocket);
-        return;
+void PeerProcess::handleConnection(SOCKET clientSocket, bool receiver, std::array<unsigned char, 32> handshake){
+    // confirm handshake size, the daemon already did this for connections it accepted
+    if (!receiver) {
+        int received = recv(clientSocket, (char*)handshake.data(), 32, MSG_WAITALL);
+        if (received != 32) {
+            P2P_ERROR("Peer " << ID << " ERROR: Invalid handshake received of size " << received);
+            closeConnection(clientSocket);
+            return;
+        }
     }
 
     // validate header
     const char expectedHeader[19] = "P2PFILESHARINGPROJ"; // expected handshake header
-    if (memcmp(handshake, expectedHeader, 18) != 0) {
-        std::cerr << "Peer " << ID << " ERROR: Invalid header" << std::endl;
-        closesocket(clientSocket);
+    if (memcmp(handshake.data(), expectedHeader, 18) != 0) {
+        P2P_ERROR("Peer " << ID << " ERROR: Invalid header");
+        closeConnection(clientSocket);
+        return;
+    }
+
+    // the reply must be for the swarm we asked for, 0 is a peer that does not name one
+    uint32_t theirSwarm;
+    memcpy(&theirSwarm, handshake.data() + 18, 4);
+    theirSwarm = ntohl(theirSwarm);
+    if (theirSwarm != 0 && theirSwarm != common.swarmId) {
+        P2P_ERROR("Peer " << ID << " ERROR: handshake for swarm " << theirSwarm << ", expected " << common.swarmId);
+        closeConnection(clientSocket);
         return;
     }
 
     // get the other peer's ID
     int otherPeerId;
-    memcpy(&otherPeerId, handshake + 28, 4);
+    memcpy(&otherPeerId, handshake.data() + 28, 4);
     otherPeerId = ntohl(otherPeerId);
-    std::cout << "[RUBRIC 2a] Peer " << ID << " received valid handshake from peer " << otherPeerId << std::endl;
+    P2P_INFO("[RUBRIC 2a] Peer " << ID << " received valid handshake from peer " << otherPeerId);
+    profile::nameThread("peer " + std::to_string(ID) + " from " + std::to_string(otherPeerId));
 
     // if didnt send first handshake, send handshake second
     if(receiver) {
-		std::cout << "[RUBRIC 2a] Peer " << ID << " sent handshake to peer " << otherPeerId << std::endl;
+		P2P_INFO("[RUBRIC 2a] Peer " << ID << " sent handshake to peer " << otherPeerId);
         MessageSender sender(ID, clientSocket);
-        sender.sendHandshake();
+        sender.sendHandshake(common.swarmId);
         logger.logConnectedFrom(otherPeerId);
     }
     else{
@@ -241,20 +694,85 @@ void PeerProcess::handleConnection(SOCKET clientSocket, bool receiver=true){
     }
 
     // after connecting and verifying handshake, send bitfield
-    MessageSender bitfieldSender(ID, clientSocket);
-    bitfieldSender.sendBitfield(bitfield.getBits());
-	std::cout << "[RUBRIC 2b] Peer " << ID << " SENT BITFIELD to peer " << otherPeerId
-          << " (has " << (bitfield.isComplete() ? "all pieces" : "partial pieces") << ")" << std::endl;
+    // a super seeder claims to have nothing and then advertises one piece at a time
+    int superSeedOffer = -1;
+    bool superSeeding = false;
+    {
+        std::lock_guard<std::mutex> lock(superSeedMutex);
+        if (superSeeder) {
+            superSeeding = true;
+            superSeedOffer = superSeeder->addPeer(otherPeerId);
+        }
+    }
+    // small frames like REQUEST and PONG go out at once, every frame is written whole anyway
+    const bool overUnix = local::isLocal(clientSocket);
+    if (!overUnix) {
+        BOOL noDelay = TRUE;
+        setsockopt(clientSocket, IPPROTO_TCP, TCP_NODELAY, (const char *) &noDelay, sizeof(noDelay));
+    }
+
+    // from here on one writer thread owns the sending side of the socket
+    auto outbound = std::make_shared<OutboundQueue>(clientSocket, otherPeerId, common.outboundQueueBytes, bufferPool,
+                                                   uploadBudget);
+    MessageSender bitfieldSender(ID, outbound);
+    if (superSeeding) {
+        bitfieldSender.sendBitfield(std::vector<bool>(bitfield.getSize(), false));
+        if (superSeedOffer >= 0) bitfieldSender.sendHave(superSeedOffer);
+    }
+    else {
+        // pieces the memory store has dropped are not offered to a newcomer at all
+        std::vector<bool> bits = bitfield.getBits();
+        for (size_t i = 0; i < bits.size(); i++) {
+            if (bits[i] && !pieceStore->holds(static_cast<uint32_t>(i))) bits[i] = false;
+        }
+        bitfieldSender.sendBitfield(bits);
+        // they cannot tell from the bitfield that we stopped at our selection
+        if (downloadDone() && !bitfield.isComplete()) bitfieldSender.sendUploadOnly(true);
+    }
+    // a peer on this host can copy pieces straight out of our file
+    if (overUnix && !pieceStore->dataPath().empty()) {
+        std::error_code ec;
+        const auto path = std::filesystem::absolute(pieceStore->dataPath(), ec);
+        if (!ec) bitfieldSender.sendLocalFile(path.string());
+    }
+	P2P_DEBUG("[RUBRIC 2b] Peer " << ID << " SENT BITFIELD to peer " << otherPeerId
+          << " (has " << (bitfield.isComplete() ? "all pieces" : "partial pieces") << ")");
 
     // null bitfield as placeholder till their bitfield is recieved, if its not then they have nothing anyway
-    BitfieldManager nullBitfield(bitfield.getSize(), false);
+    CompressedBitfield nullBitfield(bitfield.getSize(), false);
     // choked and not interested initially
     PeerRelationship newPeer(clientSocket, nullBitfield, otherPeerId, true, true, false, false);
+    newPeer.outbound = outbound;
+    newPeer.sameHost = onOurHost(otherPeerId);
+    newPeer.overUnix = overUnix;
     // add them to the relationships list of connected peers
-    relationships.emplace(otherPeerId, newPeer);
+    bool ping;
+    {
+        std::lock_guard<std::mutex> lock(peersMutex);
+        newPeer.downloadRate = newPeer.uploadRate = rateEstimator();
+        ping = common.pingInterval > 0;
+        relationships.erase(otherPeerId);
+        relationships.emplace(otherPeerId, newPeer);
+    }
+    // measure how far away they are before the first choke round
+    if (ping) {
+        MessageSender(otherPeerId, outbound).sendPing(std::chrono::steady_clock::now().time_since_epoch().count());
+    }
 
-    // handle the rest of the message
-    std::thread(&PeerProcess::connectionMessageLoop, this, clientSocket, otherPeerId).detach();
+    // frames sent before this point are not traced, the replay starts every peer from a bitfield
+    if (wireTrace) {
+        wireTrace->record(otherPeerId, false, WireTrace::kConnect, 0, nullptr, 0);
+        WireTrace::attach(clientSocket, wireTrace.get(), otherPeerId);
+    }
+
+    // handle the rest of the messages on this thread
+    connectionMessageLoop(clientSocket, otherPeerId);
+    outbound->stop();
+    if (wireTrace) {
+        WireTrace::detach(clientSocket);
+        wireTrace->record(otherPeerId, false, WireTrace::kDisconnect, 0, nullptr, 0);
+    }
+    closeConnection(clientSocket);
 }
 
 // start connected to peers with a smaller ID
@@ -263,525 +781,1539 @@ void PeerProcess::connectToEarlierPeers() {
     for (const auto& peer : allPeers) {
         if (peer.peerId >= ID)
             continue;
-        std::cout << "Peer " << ID << " attempting connection to Peer "<< peer.peerId << std::endl;
+        P2P_DEBUG("Peer " << ID << " attempting connection to Peer "<< peer.peerId);
+
+        // a peer on this host is reached through its Unix socket, TCP is the fallback
+        if (!localSocketDir.empty() && (onOurHost(peer.peerId) || local::isLoopback(peer.hostName))) {
+            SOCKET sock = local::connectTo(local::socketPath(localSocketDir, peer.port));
+            if (sock != INVALID_SOCKET) {
+                P2P_INFO("[RUBRIC 1b] Peer " << ID << " successfully connected to peer " << peer.peerId
+                          << " over a Unix socket");
+                MessageSender sender(ID, sock);
+                sender.sendHandshake(common.swarmId);
+                spawnConnection(sock, false);
+                continue;
+            }
+        }
 
         addrinfo hints{}, *result = nullptr;
         hints.ai_family = AF_INET;
         hints.ai_socktype = SOCK_STREAM;
 
         // get host name
-	std::cout << "Peer " << ID << " resolving " << peer.hostName << ":" << peer.port << std::endl;
+	P2P_DEBUG("Peer " << ID << " resolving " << peer.hostName << ":" << peer.port);
         std::string portStr = std::to_string(peer.port);
         if (getaddrinfo(peer.hostName.c_str(), portStr.c_str(), &hints, &result) != 0) {
-            std::cerr << "Peer " << ID << " ERROR: getaddrinfo failed.\n";
+            P2P_ERROR("Peer " << ID << " ERROR: getaddrinfo failed");
             continue;
         }
 
         // open socket
         SOCKET sock = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
         if (sock == INVALID_SOCKET) {
-            std::cerr << "Peer " << ID << " ERROR: socket() failed" << std::endl;
+            P2P_ERROR("Peer " << ID << " ERROR: socket() failed");
             freeaddrinfo(result);
             continue;
         }
 
         // attempt to connect to peer
         if (connect(sock, result->ai_addr, (int)result->ai_addrlen) == SOCKET_ERROR) {
-            std::cerr << "Peer " << ID << " ERROR: connect() failed to peer " << peer.peerId << std::endl;
+            P2P_ERROR("Peer " << ID << " ERROR: connect() failed to peer " << peer.peerId);
             closesocket(sock);
             freeaddrinfo(result);
             continue;
         }
         freeaddrinfo(result);
-		std::cout << "[RUBRIC 1b] Peer " << ID << " successfully connected to peer " << peer.peerId
-                  << " (" << peer.hostName << ":" << peer.port << ")" << std::endl;
+		P2P_INFO("[RUBRIC 1b] Peer " << ID << " successfully connected to peer " << peer.peerId
+                  << " (" << peer.hostName << ":" << peer.port << ")");
 
 
         // send handshake message before handling connection
         // this is because this process is the one initiating the connection
         MessageSender sender(ID, sock);
-        sender.sendHandshake();
+        sender.sendHandshake(common.swarmId);
         // handle connection with new peer
-        std::thread(&PeerProcess::handleConnection, this, sock, false).detach();
+        spawnConnection(sock, false);
     }
 }
 
 // keep messaging peers while the connection is open
 void PeerProcess::connectionMessageLoop(SOCKET sock, int peerId){
     while (true) {
-        // first 4 bytes: message length
+        // first 4 bytes: message length, the wait between frames is spent here
         uint32_t netLen;
-        int r = recv(sock, (char *) &netLen, sizeof(netLen), MSG_WAITALL);
+        int r;
+        {
+            P2P_SPAN("wait for frame");
+            r = recv(sock, (char *) &netLen, sizeof(netLen), MSG_WAITALL);
+        }
         if (r <= 0) {
-            std::cout << "Peer " << ID << " disconnected from peer " << peerId << std::endl;
-            closesocket(sock);
-            return;
+            P2P_INFO("Peer " << ID << " disconnected from peer " << peerId);
+            break;
         }
 
         uint32_t messageLen = ntohl(netLen);
 
         // next byte is message type
         unsigned char messageType;
-        r = recv(sock, (char *) &messageType, 1, MSG_WAITALL);
-        if (r <= 0) {
-            std::cout << "Peer " << ID << " lost connection to peer " << peerId << std::endl;
-            closesocket(sock);
-            return;
-        }
-
-        // next part is the actual message msglen bytes
-        std::vector<unsigned char> payload;
-        if (messageLen > 1) {
-            payload.resize(messageLen - 1);
-            r = recv(sock, (char *) payload.data(), messageLen - 1, MSG_WAITALL);
+        PooledBuffer payload;
+        {
+            P2P_SPAN("read frame");
+            r = recv(sock, (char *) &messageType, 1, MSG_WAITALL);
             if (r <= 0) {
-                std::cout << "Peer " << ID << " connection closed while reading payload" << std::endl;
-                closesocket(sock);
-                return;
-            }
-        }
-
-        switch (messageType) {
-            // choke
-            case 0:
-                std::cout << "Peer " << ID << " received CHOKE from " << peerId << std::endl;
-                handleChoke(peerId);
-                break;
-
-            // unchoke
-            case 1:
-                std::cout << "Peer " << ID << " received UNCHOKE from " << peerId << std::endl;
-                handleUnchoke(peerId);
-                break;
-
-            // interested
-            case 2:
-                std::cout << "Peer " << ID << " received INTERESTED from " << peerId << std::endl;
-                handleInterested(peerId);
-                break;
-
-            // not interested
-            case 3:
-                std::cout << "Peer " << ID << " received NOT INTERESTED from " << peerId << std::endl;
-                handleNotInterested(peerId);
-                break;
-
-            // have
-            case 4:
-                std::cout << "Peer " << ID << " received HAVE from " << peerId << std::endl;
-                handleHave(peerId, payload);
+                P2P_INFO("Peer " << ID << " lost connection to peer " << peerId);
                 break;
+            }
 
-            // bitfield
-            case 5:
-                std::cout << "Peer " << ID << " received BITFIELD from " << peerId << std::endl;
-				std::cout << "[RUBRIC 2b] Peer " << ID << " RECEIVED BITFIELD from peer " << peerId
-          << ". Interested=" << (relationships.at(peerId).interestedInThem ? "YES" : "NO") << std::endl;
-                handleBitfield(peerId, payload);
-                break;
+            // next part is the actual message msglen bytes
+            payload = bufferPool->acquire(messageLen > 1 ? messageLen - 1 : 0);
+            if (messageLen > 1) {
+                r = recv(sock, (char *) payload.data(), messageLen - 1, MSG_WAITALL);
+                if (r <= 0) {
+                    P2P_INFO("Peer " << ID << " connection closed while reading payload");
+                    break;
+                }
+            }
+        }
 
-            // request
-            case 6:
-                std::cout << "Peer " << ID << " received REQUEST from " << peerId << std::endl;
-                handleRequest(peerId, payload);
-                break;
+        if (wireTrace) wireTrace->record(peerId, false, messageType, messageLen, payload.data(), messageLen > 1 ? messageLen - 1 : 0);
+        P2P_SPAN("dispatch");
+        dispatchMessage(peerId, messageType, payload);
+    }
 
-            // piece
-            case 7:
-                std::cout << "Peer " << ID << " received PIECE from " << peerId << std::endl;
-                handlePiece(peerId, payload);
-                break;
+    onPeerDisconnected(peerId);
+}
 
-            // other message
-            default:
-                std::cout << "Peer " << ID << " received UNKNOWN message type from" << peerId << std::endl;
-                break;
-        }
+// act on one message from a peer, the wire replay feeds recorded messages through here too
+void PeerProcess::dispatchMessage(int peerId, unsigned char type, const PooledBuffer& payload){
+    switch (type) {
+        // choke
+        case 0:
+            P2P_WIRE("Peer " << ID << " received CHOKE from " << peerId);
+            handleChoke(peerId);
+            break;
+
+        // unchoke
+        case 1:
+            P2P_WIRE("Peer " << ID << " received UNCHOKE from " << peerId);
+            handleUnchoke(peerId);
+            break;
+
+        // interested
+        case 2:
+            P2P_WIRE("Peer " << ID << " received INTERESTED from " << peerId);
+            handleInterested(peerId);
+            break;
+
+        // not interested
+        case 3:
+            P2P_WIRE("Peer " << ID << " received NOT INTERESTED from " << peerId);
+            handleNotInterested(peerId);
+            break;
+
+        // have
+        case 4:
+            P2P_WIRE("Peer " << ID << " received HAVE from " << peerId);
+            handleHave(peerId, payload.view());
+            break;
+
+        // bitfield
+        case 5:
+            P2P_WIRE("Peer " << ID << " received BITFIELD from " << peerId);
+            handleBitfield(peerId, payload.view());
+            break;
+
+        // request
+        case 6:
+            P2P_WIRE("Peer " << ID << " received REQUEST from " << peerId);
+            handleRequest(peerId, payload.view());
+            break;
+
+        // piece
+        case 7:
+            P2P_WIRE("Peer " << ID << " received PIECE from " << peerId);
+            handlePiece(peerId, payload);
+            break;
+
+        // cancel
+        case 8:
+            P2P_WIRE("Peer " << ID << " received CANCEL from " << peerId);
+            handleCancel(peerId, payload.view());
+            break;
+
+        // ping
+        case 9:
+            P2P_WIRE("Peer " << ID << " received PING from " << peerId);
+            handlePing(peerId, payload.view());
+            break;
+
+        // pong
+        case 10:
+            P2P_WIRE("Peer " << ID << " received PONG from " << peerId);
+            handlePong(peerId, payload.view());
+            break;
+
+        // upload only
+        case 11:
+            P2P_WIRE("Peer " << ID << " received UPLOAD ONLY from " << peerId);
+            handleUploadOnly(peerId, payload.view());
+            break;
+
+        // local file
+        case 12:
+            P2P_WIRE("Peer " << ID << " received LOCAL FILE from " << peerId);
+            handleLocalFile(peerId, payload.view());
+            break;
+
+        // local mapped
+        case 13:
+            P2P_WIRE("Peer " << ID << " received LOCAL MAPPED from " << peerId);
+            handleLocalMapped(peerId);
+            break;
+
+        // piece ref
+        case 14:
+            P2P_WIRE("Peer " << ID << " received PIECE REF from " << peerId);
+            handlePieceRef(peerId, payload.view());
+            break;
+
+        // reject
+        case 15:
+            P2P_WIRE("Peer " << ID << " received REJECT from " << peerId);
+            handleReject(peerId, payload.view());
+            break;
+
+        // other message
+        default:
+            P2P_WIRE("Peer " << ID << " received UNKNOWN message type from" << peerId);
+            break;
     }
 }
 
+std::shared_ptr<OutboundQueue> PeerProcess::outboundTo(int peerId){
+    std::lock_guard<std::mutex> lock(peersMutex);
+    auto it = relationships.find(peerId);
+    return it == relationships.end() ? nullptr : it->second.outbound;
+}
+
 void PeerProcess::initShutdown(int peerId){
     std::lock_guard<std::mutex> lock(peersMutex);
     SOCKET theirSocket = relationships.at(peerId).theirSocket;
 
     if (theirSocket == INVALID_SOCKET) return;
 
-    // shutdown connection
-    shutdown(theirSocket, SD_SEND);
+    // stop sending once what is queued is out, the connection thread reads until they
+    // close their side and gives up if that takes too long, so nothing here blocks
+    if (relationships.at(peerId).outbound) relationships.at(peerId).outbound->close();
+    setReceiveTimeout(theirSocket, kCloseTimeoutMs);
 
-    // wait for the connection to clear of any incoming data
-    char buffer[256];
-    while (recv(theirSocket, buffer, sizeof(buffer), 0) > 0);
-
-    // close the socket
     relationships.at(peerId).theirSocket = INVALID_SOCKET;
+    relationships.at(peerId).outbound.reset();
 }
 
-int PeerProcess::getPieceToRequest(int peerId) {
-    // keep a list of candidate pieces
-    std::vector<int> candidates;
-    for (int i = 0; i < bitfield.getSize(); i++) {
-        // the other peer needs to have it and  // we need to not have it
-        if (!relationships.at(peerId).theirBitfield.hasPiece(i) || bitfield.hasPiece(i))
-            continue;
-
-        // we cant have requested it before
-        if (requests.count(i)) {
-            continue;
+void PeerProcess::onPeerDisconnected(int peerId){
+    {
+        std::lock_guard<std::mutex> lock(peersMutex);
+        auto it = relationships.find(peerId);
+        if (it != relationships.end()) {
+            it->second.theirSocket = INVALID_SOCKET;
+            it->second.outbound.reset();
+            it->second.connected = false;
         }
-
-        // add it as a candidate
-        candidates.push_back(i);
     }
-
-    // if there's no candidates then we cant request anything from them
-    if (candidates.empty())
-        return -1;
-
-    // random selection
-    return candidates[rand()%candidates.size()];
+    {
+        std::lock_guard<std::mutex> lock(superSeedMutex);
+        if (superSeeder) superSeeder->removePeer(peerId);
+    }
+    // their parked and in-flight uploads die with the connection, so nothing will erase their keys
+    {
+        std::lock_guard<std::mutex> lock(uploadsMutex);
+        for (auto it = pendingUploads.begin(); it != pendingUploads.end();) {
+            if (static_cast<uint32_t>(*it >> 32) == static_cast<uint32_t>(peerId))
+                it = pendingUploads.erase(it);
+            else
+                ++it;
+        }
+    }
+    // everything they owed us goes to the remaining peers
+    requestTracker->forgetPeer(peerId);
+    reissueRequests({});
+    checkSwarmComplete();
 }
 
-void PeerProcess::handleChoke(int peerId){
-    relationships.at(peerId).chokedMe = true;
-
-    logger.logChokedBy(peerId);
+// wakes waitForSwarm once nobody is left who could still need a piece
+void PeerProcess::checkSwarmComplete(){
+    if (!allPeersHave()) return;
+    {
+        std::lock_guard<std::mutex> lock(lifecycleMutex);
+        swarmComplete = true;
+    }
+    lifecycleCv.notify_all();
 }
 
-void PeerProcess::handleUnchoke(int peerId){
-    relationships.at(peerId).chokedMe = false;
+std::shared_ptr<const PiecePriorities> PeerProcess::priorityTable(){
+    std::lock_guard<std::mutex> lock(peersMutex);
+    return priorities;
+}
 
-    logger.logUnchokedBy(peerId);
+void PeerProcess::applyPriorities(std::shared_ptr<const PiecePriorities> next){
+    std::vector<std::pair<int, std::shared_ptr<OutboundQueue>>> interested;
+    std::vector<std::pair<int, std::shared_ptr<OutboundQueue>>> notInterested;
+    std::vector<std::pair<int, std::shared_ptr<OutboundQueue>>> everyone;
+    bool wasDone;
+    bool done;
+    {
+        std::lock_guard<std::mutex> lock(peersMutex);
+        wasDone = downloadDone();
+        priorities = std::move(next);
+        size_t missing = 0;
+        for (size_t i = 0; i < priorities->getSize(); i++) {
+            if (priorities->wanted(i) && !bitfield.hasPiece(i)) missing++;
+        }
+        wantedMissing = missing;
+        done = missing == 0;
+
+        for (auto& [id, pr] : relationships) {
+            pr.piecesWanted = 0;
+            pr.theirBitfield.forEachNotIn(bitfield, [&](size_t piece) {
+                if (priorities->wanted(piece)) pr.piecesWanted++;
+            });
+            const bool want = pr.piecesWanted > 0;
+            if (pr.outbound && want != pr.interestedInThem) (want ? interested : notInterested).emplace_back(id, pr.outbound);
+            pr.interestedInThem = want;
+            if (pr.outbound) everyone.emplace_back(id, pr.outbound);
+        }
+    }
 
-    // get the next missing piece
-    int piece = getPieceToRequest(peerId);
+    for (const auto& [id, outbound] : interested) MessageSender(id, outbound).sendInterested();
+    for (const auto& [id, outbound] : notInterested) MessageSender(id, outbound).sendNotInterested();
 
-    // send a request for the missing piece
-    if (piece >= 0) {
-        MessageSender sender(peerId, relationships.at(peerId).theirSocket);
-        sender.sendRequest( piece);
-        requests[piece] = peerId;
-        std::cout << "[RUBRIC 3a] Peer " << ID << " requested piece " << piece << " from peer " << peerId << std::endl;
+    if (done && !wasDone) {
+        P2P_INFO("Peer " << ID << " has every selected piece after the priority change");
+        finishDownload();
+        checkSwarmComplete();
+    }
+    else if (!done) {
+        if (wasDone && !bitfield.isComplete()) {
+            for (const auto& [id, outbound] : everyone) MessageSender(id, outbound).sendUploadOnly(false);
+        }
+        // endgame starts over for the pieces just added
+        endgame = false;
+        fillAllRequests();
     }
 }
 
-void PeerProcess::handleInterested(int peerId){
-    relationships.at(peerId).interestedInMe = true;
+void PeerProcess::finishDownload(){
+    if (bitfield.isComplete()) {
+        if (pieceStore->finalize()) {
+            P2P_INFO("File finalized successfully.");
+        } else {
+            P2P_ERROR("Failed to finalize file.");
+        }
+        return;
+    }
 
-    logger.logReceivedInterested(peerId);
+    // done with the selection only, the holes stay in the .part file and we serve what we have from it
+    P2P_INFO("Peer " << ID << " has every selected piece, keeping " << common.fileName << ".part until the rest is in");
+
+    std::vector<std::pair<int, std::shared_ptr<OutboundQueue>>> everyone;
+    {
+        std::lock_guard<std::mutex> lock(peersMutex);
+        for (auto& [id, pr] : relationships) {
+            if (pr.outbound) everyone.emplace_back(id, pr.outbound);
+        }
+    }
+    for (const auto& [id, outbound] : everyone) MessageSender(id, outbound).sendUploadOnly(true);
 }
 
-void PeerProcess::handleNotInterested(int peerId){
-    relationships.at(peerId).interestedInMe = false;
+// we are done and every other peer has either finished, stopped at its selection or left after connecting
+bool PeerProcess::allPeersHave(){
+    if (!downloadDone()) return false;
+    std::lock_guard<std::mutex> lock(peersMutex);
+    for (const auto& peer : allPeers) {
+        auto it = relationships.find(peer.peerId);
+        if (it == relationships.end()) return false;
+        const PeerRelationship& pr = it->second;
+        if (pr.connected && !pr.uploadOnly && !pr.theirBitfield.isComplete()) return false;
+    }
+    return true;
+}
+
+// advertise each offered piece to the peer it was picked for
+void PeerProcess::sendSuperSeedOffers(const std::vector<std::pair<int, int>>& offers){
+    for (const auto& [peerId, piece] : offers) {
+        auto outbound = outboundTo(peerId);
+        if (!outbound) continue;
+        MessageSender sender(ID, outbound);
+        sender.sendHave(piece);
+        P2P_DEBUG("Peer " << ID << " super seeding offers piece " << piece << " to peer " << peerId);
+    }
+}
+
+// every piece is out in the swarm, so announce everything like a normal seeder
+// including pieces they already have, so they see us as complete
+void PeerProcess::endSuperSeeding(){
+    std::vector<std::shared_ptr<OutboundQueue>> queues;
+    {
+        std::lock_guard<std::mutex> lock(peersMutex);
+        for (auto& [pid, pr] : relationships) {
+            if (pr.outbound) queues.push_back(pr.outbound);
+        }
+    }
+    for (const auto& outbound : queues) {
+        MessageSender sender(ID, outbound);
+        for (size_t i = 0; i < bitfield.getSize(); i++) sender.sendHave(static_cast<int>(i));
+    }
+    P2P_INFO("Peer " << ID << " every piece has reached the swarm, super seeding ends");
+}
+
+int PeerProcess::getPieceToRequest(int peerId) {
+    P2P_SPAN("getPieceToRequest");
+    std::shared_ptr<const PiecePriorities> wanted;
+    std::unordered_set<int> corrupt;
+    // what they have and we lack, copied out under the lock since a HAVE or a reconnect
+    // changes their bitfield under us, the rest of the checks take their own locks
+    std::vector<int> offered;
+    {
+        std::lock_guard<std::mutex> lock(peersMutex);
+        auto them = relationships.find(peerId);
+        if (them == relationships.end()) return -1;
+        wanted = priorities;
+        corrupt = them->second.corruptPieces;
+        // a far peer is only asked for pieces no near peer that is sending to us has
+        std::vector<const CompressedBitfield*> nearHolders;
+        if (!isNear(them->second)) {
+            for (auto& [id, pr] : relationships) {
+                if (pr.connected && !pr.chokedMe && isNear(pr) && !requestTracker->isSnubbed(id))
+                    nearHolders.push_back(&pr.theirBitfield);
+            }
+        }
+        them->second.theirBitfield.forEachNotIn(bitfield, [&](size_t piece) {
+            // skipped pieces are below every level
+            if (wanted->level(piece) < PiecePriorities::Low)
+                return;
+            if (std::any_of(nearHolders.begin(), nearHolders.end(),
+                            [piece](const CompressedBitfield* near) { return near->hasPiece(piece); }))
+                return;
+            offered.push_back(static_cast<int>(piece));
+        });
+    }
+
+    // keep a list of candidate pieces, all of the highest priority seen so far
+    std::vector<int> candidates;
+    uint8_t best = PiecePriorities::Low;
+    // stripes looked at so far, coded pieces only
+    std::unordered_map<uint32_t, bool> covered;
+    for (int i : offered) {
+        const uint8_t level = wanted->level(i);
+        if (level < best)
+            continue;
+
+        // we cant have requested it before
+        if (requestTracker->isRequested(i)) {
+            continue;
+        }
+
+        // or had a bad copy of it from them
+        if (!corrupt.empty() && corrupt.count(i)) {
+            continue;
+        }
+
+        // or already have it on its way to disk
+        {
+            std::lock_guard<std::mutex> lock(pendingWritesMutex);
+            if (pendingWrites.count(i))
+                continue;
+        }
+
+        // enough of its stripe is coming to decode the rest
+        if (erasure.enabled()) {
+            const uint32_t stripe = erasure.stripeOf(i);
+            auto known = covered.find(stripe);
+            if (known == covered.end()) known = covered.emplace(stripe, stripeCovered(stripe)).first;
+            if (known->second)
+                continue;
+        }
+
+        // an identical piece on its way fills this one too
+        if (pieceHashes) {
+            bool coming = false;
+            for (int same : pieceHashes->duplicatesOf(i)) {
+                if (same != i && requestTracker->isRequested(same)) {
+                    coming = true;
+                    break;
+                }
+            }
+            if (coming)
+                continue;
+        }
+
+        // add it as a candidate, dropping the lower ones found before it
+        if (level > best) {
+            candidates.clear();
+            best = level;
+        }
+        candidates.push_back(i);
+    }
+
+    // if there's no candidates then we cant request anything from them
+    if (candidates.empty())
+        return -1;
+
+    // random selection
+    return candidates[rand()%candidates.size()];
+}
+
+void PeerProcess::fillRequests(int peerId){
+    P2P_SPAN("fillRequests");
+    std::shared_ptr<OutboundQueue> outbound;
+    {
+        std::lock_guard<std::mutex> lock(peersMutex);
+        auto it = relationships.find(peerId);
+        if (it == relationships.end() || !it->second.connected || it->second.chokedMe) return;
+        outbound = it->second.outbound;
+    }
+    // offline the requests are tracked but never sent
+    if (!outbound && !offline) return;
+
+    while (requestTracker->outstanding(peerId) < requestTracker->window(peerId)) {
+        int piece = getPieceToRequest(peerId);
+        bool duplicate = false;
+        if (piece < 0 && endgame.load()) {
+            piece = getEndgamePiece(peerId);
+            duplicate = true;
+        }
+        if (piece < 0) break;
+        // another thread got to it first
+        if (!requestTracker->add(piece, peerId, common.pieceSize, duplicate)) continue;
+
+        MessageSender sender(peerId, outbound);
+        sender.sendRequest(piece);
+        P2P_DEBUG("[RUBRIC 3a] Peer " << ID << " requested piece " << piece << " from peer " << peerId
+                  << (duplicate ? " (endgame)" : ""));
+    }
+
+    // the last missing piece just went out, ask every other holder too
+    if (!endgame.load() && inEndgame() && !endgame.exchange(true)) {
+        P2P_INFO("Peer " << ID << " entering endgame with " << requestTracker->piecesRequested()
+                  << " pieces left");
+        reissueRequests({});
+    }
+}
+
+int PeerProcess::getEndgamePiece(int peerId) {
+    // their bitfield only under the lock, the request checks take their own
+    std::vector<int> offered;
+    {
+        std::lock_guard<std::mutex> lock(peersMutex);
+        auto them = relationships.find(peerId);
+        if (them == relationships.end()) return -1;
+        std::shared_ptr<const PiecePriorities> wanted = priorities;
+        const std::unordered_set<int>& corrupt = them->second.corruptPieces;
+        // a piece they sent us bad data for is not asked of them again, endgame or not
+        them->second.theirBitfield.forEachNotIn(bitfield, [&](size_t piece) {
+            if (wanted->wanted(piece) && !corrupt.count(static_cast<int>(piece))) offered.push_back(static_cast<int>(piece));
+        });
+    }
+    std::vector<int> candidates;
+    for (int i : offered) {
+        if (!requestTracker->isRequested(i) || requestTracker->isRequestedFrom(i, peerId))
+            continue;
+        {
+            std::lock_guard<std::mutex> lock(pendingWritesMutex);
+            if (pendingWrites.count(i))
+                continue;
+        }
+        candidates.push_back(i);
+    }
+    if (candidates.empty())
+        return -1;
+    return candidates[rand()%candidates.size()];
+}
+
+// nothing we want is left that has not been asked of someone
+bool PeerProcess::inEndgame() {
+    size_t pending;
+    {
+        std::lock_guard<std::mutex> lock(pendingWritesMutex);
+        pending = pendingWrites.size();
+    }
+    const size_t missing = wantedMissing.load();
+    if (pending >= missing) return false;
+    return requestTracker->piecesRequested() >= missing - pending;
+}
+
+void PeerProcess::reissueRequests(const std::unordered_set<int>& slowPeers){
+    std::vector<int> fast;
+    std::vector<int> slow;
+    {
+        std::lock_guard<std::mutex> lock(peersMutex);
+        for (auto& [pid, pr] : relationships) {
+            if (!pr.connected || pr.chokedMe || pr.piecesWanted == 0) continue;
+            if (slowPeers.count(pid) || requestTracker->isSnubbed(pid)) slow.push_back(pid);
+            else fast.push_back(pid);
+        }
+    }
+    for (int pid : fast) fillRequests(pid);
+    for (int pid : slow) fillRequests(pid);
+}
+
+void PeerProcess::handleChoke(int peerId){
+    P2P_SPAN("handleChoke");
+    {
+        std::lock_guard<std::mutex> lock(peersMutex);
+        relationships.at(peerId).chokedMe = true;
+    }
+
+    logger.logChokedBy(peerId);
+
+    // whatever we asked them for will not come, let another peer serve it
+    if (!requestTracker->releasePeer(peerId).empty()) reissueRequests({peerId});
+
+    // far peers were held back for what this one has
+    bool wasNear;
+    {
+        std::lock_guard<std::mutex> lock(peersMutex);
+        wasNear = isNear(relationships.at(peerId));
+    }
+    if (wasNear) fillAllRequests();
+}
+
+void PeerProcess::handleUnchoke(int peerId){
+    P2P_SPAN("handleUnchoke");
+    {
+        std::lock_guard<std::mutex> lock(peersMutex);
+        relationships.at(peerId).chokedMe = false;
+    }
+
+    logger.logUnchokedBy(peerId);
+
+    // request missing pieces up to their window
+    fillRequests(peerId);
+}
+
+void PeerProcess::handleInterested(int peerId){
+    P2P_SPAN("handleInterested");
+    // a peer that ran dry and wants more again takes a free preferred slot now rather than
+    // a round later, a super seeder's peers do this after every piece it offers
+    std::shared_ptr<OutboundQueue> unchoke;
+    {
+        std::lock_guard<std::mutex> lock(peersMutex);
+        PeerRelationship& pr = relationships.at(peerId);
+        pr.interestedInMe = true;
+        if (pr.chokedThem && pr.outbound) {
+            const int optimistic = optimisticUnchokedPeer.load();
+            int busy = 0;
+            for (const auto& [id, other] : relationships) {
+                if (id != peerId && id != optimistic && !other.chokedThem && other.interestedInMe) busy++;
+            }
+            if (busy < common.numberOfPreferredNeighbors) {
+                pr.chokedThem = false;
+                unchoke = pr.outbound;
+            }
+        }
+    }
+
+    logger.logReceivedInterested(peerId);
+    if (unchoke) {
+        MessageSender(peerId, unchoke).sendUnchoke();
+        P2P_DEBUG("[RUBRIC 2d] Peer " << ID << " SENT UNCHOKE to " << peerId << " into a free slot");
+    }
+}
+
+void PeerProcess::handleNotInterested(int peerId){
+    P2P_SPAN("handleNotInterested");
+    {
+        std::lock_guard<std::mutex> lock(peersMutex);
+        relationships.at(peerId).interestedInMe = false;
+    }
 
     logger.logReceivedNotInterested(peerId);
 }
 
-void PeerProcess::handleHave(int peerId, const std::vector<unsigned char>& payload){
+void PeerProcess::handleHave(int peerId, ByteView payload){
+    P2P_SPAN("handleHave");
+    if (payload.size < 4) return;
     // get the index
-    std::string str(payload.begin(), payload.end());
     int index = (payload[0] << 24) | (payload[1] << 16) | (payload[2] << 8)  | payload[3];
-    // update their bitfield with the new piece
-    relationships.at(peerId).theirBitfield.setPiece(index);
+    if (index < 0 || static_cast<size_t>(index) >= getNumPieces()) return;
+
+    // update their bitfield with the new piece, and whether it is one we still need
+    bool becameInterested = false;
+    bool theyAreComplete;
+    {
+        std::lock_guard<std::mutex> lock(peersMutex);
+        PeerRelationship& pr = relationships.at(peerId);
+        if (pr.theirBitfield.setPiece(index) && !bitfield.hasPiece(index) && priorities->wanted(index) && pr.piecesWanted++ == 0) {
+            pr.interestedInThem = true;
+            becameInterested = true;
+        }
+        theyAreComplete = pr.theirBitfield.isComplete();
+    }
 
     logger.logReceivedHave(peerId, index);
 
+    // a super seeder watches HAVEs to see its offers spread
+    std::vector<std::pair<int, int>> offers;
+    bool superSeedDone = false;
+    {
+        std::lock_guard<std::mutex> lock(superSeedMutex);
+        if (superSeeder) {
+            offers = superSeeder->onHave(peerId, index);
+            if (superSeeder->finished()) {
+                superSeeder.reset();
+                superSeedDone = true;
+            }
+        }
+    }
+    sendSuperSeedOffers(offers);
+    if (superSeedDone) endSuperSeeding();
+
     // if we have the full file, and they have the full file, then we can terminate the connection
-    if(bitfield.isComplete() && relationships.at(peerId).theirBitfield.isComplete()){
-		std::cout << "[RUBRIC 3f] Peer " << ID << " processed HAVE from peer " << peerId
-          << " for piece " << index << ". Local have=" << (bitfield.hasPiece(index) ? "YES" : "NO")
-          << std::endl;
+    if(bitfield.isComplete() && theyAreComplete){
+		P2P_DEBUG("[RUBRIC 3f] Peer " << ID << " processed HAVE from peer " << peerId
+          << " for piece " << index << ". Local have=" << (bitfield.hasPiece(index) ? "YES" : "NO"));
         initShutdown(peerId);
-        terminate--;
-        if (terminate == 0) {
-			std::cout << "[RUBRIC 1c][RUBRIC 4] Peer " << ID << " observed all peers have completed the file. Shutting down cleanly." << std::endl;
-			std::exit(0);
-        }
+        checkSwarmComplete();
     }
-    // check to see if we need the piece and check to see if we are not already interested
-    else if(!bitfield.hasPiece(index) && !relationships.at(peerId).interestedInThem){
-        relationships.at(peerId).interestedInThem = true;
-		std::cout << "[RUBRIC 3d] Peer " << ID << " SENT INTERESTED to peer " << peerId << " for piece " << index << std::endl;
+    // they just got their first piece that we lack
+    else if(becameInterested){
+		P2P_DEBUG("[RUBRIC 3d] Peer " << ID << " SENT INTERESTED to peer " << peerId << " for piece " << index);
         // send that we are interested
-        MessageSender sender(peerId, relationships.at(peerId).theirSocket);
+        MessageSender sender(peerId, outboundTo(peerId));
         sender.sendInterested();
-    }\
+    }
+
+    // a peer that already unchoked us and has room in its window can serve the new piece
+    // (a super seeder advertises pieces one at a time, long after it unchoked us)
+    if (!bitfield.hasPiece(index)) fillRequests(peerId);
 }
 
-void PeerProcess::handleBitfield(int peerId, const std::vector<unsigned char>& payload){
-    relationships.at(peerId).theirBitfield = BitfieldManager::toBits(payload, getNumPieces());
+void PeerProcess::handleBitfield(int peerId, ByteView payload){
+    P2P_SPAN("handleBitfield");
+    bool wasInterested;
+    bool interested;
+    // the super seeder gets a copy, a HAVE can change theirs as soon as we unlock
+    std::optional<CompressedBitfield> theirs;
+    {
+        std::lock_guard<std::mutex> lock(peersMutex);
+        PeerRelationship& pr = relationships.at(peerId);
+        pr.theirBitfield = CompressedBitfield::fromBytes(payload.data, payload.size, getNumPieces());
+        // the one full pass, after this the count moves with each HAVE and each piece we finish
+        pr.piecesWanted = 0;
+        pr.theirBitfield.forEachNotIn(bitfield, [&](size_t piece) {
+            if (priorities->wanted(piece)) pr.piecesWanted++;
+        });
+        wasInterested = pr.interestedInThem;
+        interested = pr.piecesWanted > 0;
+        pr.interestedInThem = interested;
+        theirs = pr.theirBitfield;
+    }
+    P2P_DEBUG("[RUBRIC 2b] Peer " << ID << " RECEIVED BITFIELD from peer " << peerId
+              << ". Interested=" << (wasInterested ? "YES" : "NO"));
+
+    {
+        std::lock_guard<std::mutex> lock(superSeedMutex);
+        if (superSeeder && theirs) sendSuperSeedOffers(superSeeder->onBitfield(peerId, *theirs));
+    }
 
-    // check to see if we should be interested i.e. if they have a piece that we do not
-    bool interested = bitfield.compareBitfields(relationships.at(peerId).theirBitfield);
-    if(interested && !relationships.at(peerId).interestedInThem){
+    // interest only changes hands on a transition, they assume we are not interested to begin with
+    if(interested && !wasInterested){
         // send that we are interested
-        MessageSender sender(peerId, relationships.at(peerId).theirSocket);
+        MessageSender sender(peerId, outboundTo(peerId));
         sender.sendInterested();
     }
     // else we are not interested
-    else if (!interested){
-        MessageSender sender(peerId, relationships.at(peerId).theirSocket);
+    else if (!interested && wasInterested){
+        MessageSender sender(peerId, outboundTo(peerId));
         sender.sendNotInterested();
     }
-    relationships.at(peerId).interestedInThem = interested;
+
+    checkSwarmComplete();
 }
 
-void PeerProcess::handleRequest(int peerId, const std::vector<unsigned char>& payload){
+void PeerProcess::handleRequest(int peerId, ByteView payload){
+    P2P_SPAN("handleRequest");
+    if (payload.size < 4) return;
+    //get the index
+    int index = (payload[0] << 24) | (payload[1] << 16) | (payload[2] << 8)  | payload[3];
+    if (index < 0 || static_cast<size_t>(index) >= getNumPieces()) return;
+
     // check to see if we are choking them
-    if(!relationships.at(peerId).chokedThem){
-        //get the index
-        int index = (payload[0] << 24) | (payload[1] << 16) | (payload[2] << 8)  | payload[3];
-
-        std::vector<char> data;
-        
-        auto pieceDataOpt = fileHandler.readPiece(index);
-
-        if(pieceDataOpt.has_value()){
-            
-            for(uint8_t byte : *pieceDataOpt) {
-                data.push_back(static_cast<char>(byte));
+    bool choked;
+    {
+        std::lock_guard<std::mutex> lock(peersMutex);
+        auto it = relationships.find(peerId);
+        choked = it == relationships.end() || it->second.chokedThem;
+    }
+    if(!choked){
+        // while super seeding, a peer only gets the pieces we offered it
+        {
+            std::lock_guard<std::mutex> lock(superSeedMutex);
+            if (superSeeder && !superSeeder->mayServe(peerId, index)) return;
+        }
+
+        // the memory store may have dropped a piece we advertised, telling them lets them ask elsewhere now
+        if (!pieceStore->holds(index)) {
+            P2P_DEBUG("Peer " << ID << " no longer holds piece " << index << " asked for by peer " << peerId);
+            MessageSender(peerId, outboundTo(peerId)).sendReject(index);
+            return;
+        }
+
+        // a same-host peer that mapped our file copies the piece out of it, so nothing goes through
+        // the socket or the upload budget, parity pieces live in another file and go the usual way
+        if (static_cast<size_t>(index) < getSourcePieces() && bitfield.hasPiece(index)) {
+            std::shared_ptr<OutboundQueue> outbound;
+            {
+                std::lock_guard<std::mutex> lock(peersMutex);
+                auto it = relationships.find(peerId);
+                if (it != relationships.end() && it->second.mappedOurFile) {
+                    outbound = it->second.outbound;
+                    it->second.bytesReferenced += pieceStore->pieceLength(index);
+                }
             }
+            if (outbound) {
+                MessageSender(peerId, outbound).sendPieceRef(index);
+                P2P_DEBUG("[RUBRIC 3e] Peer " << ID << " SENT PIECE REF " << index << " to peer " << peerId);
+                return;
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lock(uploadsMutex);
+            pendingUploads.insert(uploadKey(peerId, index));
+        }
+        // while their queue is full the request is parked and served by their writer as it makes
+        // room, blocking here could deadlock two peers that both wait on each other's reader
+        auto outbound = outboundTo(peerId);
+        if (outbound && outbound->deferUntilSpace([this, peerId, index]() { serveRequest(peerId, index); })) return;
+        serveRequest(peerId, index);
+    }
+}
+
+void PeerProcess::serveRequest(int peerId, int index){
+    P2P_SPAN("serveRequest");
+    auto sendPiece = [this, peerId, index](PooledBuffer owner, const uint8_t* bytes, size_t len) {
+        auto outbound = outboundTo(peerId);
+        if (!outbound) return;
+
+        MessageSender sender(peerId, outbound);
+        // without an owner the bytes are only valid during the read callback, so they are copied
+        if (owner)
+            sender.sendPiece(index, std::move(owner), ByteView(bytes, len));
+        else
+            sender.sendPiece(index, bytes, len);
+        P2P_DEBUG("[RUBRIC 3e] Peer " << ID << " SENT PIECE " << index << " to peer " << peerId
+                  << " (size=" << len << " bytes)");
+    };
+
+    // a piece we received recently is served straight from its receive buffer
+    PooledBuffer cached;
+    ByteView cachedPiece;
+    if (pieceCache->lookup(index, cached, cachedPiece)) {
+        // a CANCEL got here first
+        {
+            std::lock_guard<std::mutex> lock(uploadsMutex);
+            if (pendingUploads.erase(uploadKey(peerId, index)) == 0) return;
+        }
+        sendPiece(std::move(cached), cachedPiece.data, cachedPiece.size);
+        return;
+    }
+
+    // otherwise it is sent from the read completion, the receive loop moves on right away
+    pieceStore->readPieceAsync(index, [this, peerId, index, sendPiece](bool ok, const uint8_t* bytes, size_t len) {
+        // a CANCEL got here first
+        {
+            std::lock_guard<std::mutex> lock(uploadsMutex);
+            if (pendingUploads.erase(uploadKey(peerId, index)) == 0) return;
+        }
+        if (!ok) {
+            P2P_ERROR("Peer " << ID << " could not read piece " << index << " for peer " << peerId);
+            // dropped between the request and the read
+            if (!pieceStore->holds(index)) MessageSender(peerId, outboundTo(peerId)).sendReject(index);
+            return;
+        }
+        sendPiece(PooledBuffer(), bytes, len);
+    });
+}
+
+void PeerProcess::handleCancel(int peerId, ByteView payload){
+    P2P_SPAN("handleCancel");
+    if (payload.size < 4) return;
+    int index = (payload[0] << 24) | (payload[1] << 16) | (payload[2] << 8)  | payload[3];
+
+    // an upload still waiting on its disk read is dropped, one already on the wire goes out whole
+    std::lock_guard<std::mutex> lock(uploadsMutex);
+    if (pendingUploads.erase(uploadKey(peerId, index)))
+        P2P_DEBUG("Peer " << ID << " dropped upload of piece " << index << " to peer " << peerId);
+}
+
+// answered straight away, the control lane puts it ahead of any queued pieces
+void PeerProcess::handlePing(int peerId, ByteView payload){
+    P2P_SPAN("handlePing");
+    if (payload.size < 8) return;
+    uint64_t stamp = readStamp(payload);
+    MessageSender(peerId, outboundTo(peerId)).sendPong(stamp);
+}
+
+void PeerProcess::handlePong(int peerId, ByteView payload){
+    P2P_SPAN("handlePong");
+    if (payload.size < 8) return;
+    uint64_t stamp = readStamp(payload);
+    auto sent = std::chrono::steady_clock::time_point(std::chrono::steady_clock::duration(stamp));
+    auto sample = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - sent);
+    // not one of our stamps, as in a replayed trace
+    if (sample.count() < 0 || sample > std::chrono::seconds(60)) return;
+
+    std::lock_guard<std::mutex> lock(peersMutex);
+    auto it = relationships.find(peerId);
+    if (it == relationships.end()) return;
+    // smoothed the way TCP smooths its round trip, an eighth of each new sample
+    auto& rtt = it->second.rtt;
+    rtt = rtt.count() == 0 ? sample : (rtt * 7 + sample) / 8;
+    auto& minRtt = it->second.minRtt;
+    if (minRtt.count() == 0 || sample < minRtt) minRtt = sample;
+    P2P_WIRE("Peer " << ID << " round trip to peer " << peerId << " " << sample.count() << "us, smoothed " << rtt.count() << "us");
+}
+
+void PeerProcess::handleUploadOnly(int peerId, ByteView payload){
+    P2P_SPAN("handleUploadOnly");
+    if (payload.size < 1) return;
+    {
+        std::lock_guard<std::mutex> lock(peersMutex);
+        auto it = relationships.find(peerId);
+        if (it == relationships.end()) return;
+        it->second.uploadOnly = payload[0] != 0;
+    }
+    P2P_DEBUG("Peer " << ID << " peer " << peerId << (payload[0] ? " only uploads now" : " is downloading again"));
+    // they may have been the last one we were staying on for
+    checkSwarmComplete();
+}
+
+void PeerProcess::handleLocalFile(int peerId, ByteView payload){
+    P2P_SPAN("handleLocalFile");
+    if (payload.empty()) return;
+    {
+        std::lock_guard<std::mutex> lock(peersMutex);
+        auto it = relationships.find(peerId);
+        if (it == relationships.end() || !it->second.overUnix) {
+            P2P_ERROR("Peer " << ID << " ignored LOCAL FILE from peer " << peerId << ", it did not come over a Unix socket");
+            return;
         }
+    }
+    // only their own copy of the file, symlinks resolved, is ever mapped and copied into ours
+    const std::string named(reinterpret_cast<const char*>(payload.data), payload.size);
+    std::error_code ec;
+    const std::filesystem::path path = std::filesystem::canonical(named, ec);
+    const std::string fileName = path.filename().string();
+    if (ec || path.parent_path().filename() != "peer_" + std::to_string(peerId) ||
+        (fileName != common.fileName && fileName != common.fileName + ".part")) {
+        P2P_ERROR("Peer " << ID << " ignored LOCAL FILE " << named << " from peer " << peerId << ", it is not their copy of the file");
+        return;
+    }
+    auto file = std::make_shared<MappedFile>();
+    if (!file->open(path, common.fileSize)) {
+        P2P_DEBUG("Peer " << ID << " could not map " << path << " of peer " << peerId << ", their pieces come over the socket");
+        return;
+    }
+    std::shared_ptr<OutboundQueue> outbound;
+    {
+        std::lock_guard<std::mutex> lock(peersMutex);
+        auto it = relationships.find(peerId);
+        if (it == relationships.end()) return;
+        it->second.theirFile = std::move(file);
+        outbound = it->second.outbound;
+    }
+    P2P_INFO("Peer " << ID << " mapped the file of peer " << peerId << ", pieces from them are copied out of it");
+    if (outbound) MessageSender(peerId, outbound).sendLocalMapped();
+}
 
-        MessageSender sender(peerId, relationships.at(peerId).theirSocket);
-        sender.sendPiece(index, data);
-		std::cout << "[RUBRIC 3e] Peer " << ID << " SENT PIECE " << index << " to peer " << peerId
-          << " (size=" << data.size() << " bytes)" << std::endl;
+void PeerProcess::handleLocalMapped(int peerId){
+    P2P_SPAN("handleLocalMapped");
+    std::lock_guard<std::mutex> lock(peersMutex);
+    auto it = relationships.find(peerId);
+    if (it != relationships.end() && it->second.overUnix) it->second.mappedOurFile = true;
+}
+
+void PeerProcess::handlePieceRef(int peerId, ByteView payload){
+    P2P_SPAN("handlePieceRef");
+    if (payload.size < 4) return;
+    int index = (payload[0] << 24) | (payload[1] << 16) | (payload[2] << 8)  | payload[3];
+    if (index < 0 || static_cast<size_t>(index) >= getSourcePieces()) return;
 
+    std::shared_ptr<MappedFile> file;
+    {
+        std::lock_guard<std::mutex> lock(peersMutex);
+        auto it = relationships.find(peerId);
+        if (it != relationships.end() && it->second.overUnix) file = it->second.theirFile;
     }
+    ByteView bytes;
+    if (file) bytes = file->view(uint64_t(index) * common.pieceSize, pieceStore->pieceLength(index));
+    // without their file the request times out and goes to someone else
+    if (bytes.empty()) {
+        P2P_ERROR("Peer " << ID << " got PIECE REF " << index << " from peer " << peerId << " without their file mapped");
+        return;
+    }
+
+    // the one copy, out of their page cache into a receive buffer that is handled like any PIECE
+    PooledBuffer piece = bufferPool->acquire(4 + bytes.size);
+    std::memcpy(piece.data(), payload.data, 4);
+    std::memcpy(piece.data() + 4, bytes.data, bytes.size);
+    handlePiece(peerId, piece);
 }
 
-void PeerProcess::handlePiece(int peerId, const std::vector<unsigned char>& payload){
-    int index = (payload[0] << 24) | (payload[1] << 16) | (payload[2] << 8) | payload[3];
-    
-    std::vector<unsigned char> pieceData(payload.begin() + 4, payload.end());
+// they dropped a piece they advertised, it comes off their bitfield and is asked of whoever else has it
+void PeerProcess::handleReject(int peerId, ByteView payload){
+    P2P_SPAN("handleReject");
+    if (payload.size < 4) return;
+    int index = (payload[0] << 24) | (payload[1] << 16) | (payload[2] << 8)  | payload[3];
+    if (index < 0 || static_cast<size_t>(index) >= getNumPieces()) return;
+
+    bool lostInterest = false;
+    {
+        std::lock_guard<std::mutex> lock(peersMutex);
+        auto it = relationships.find(peerId);
+        if (it == relationships.end()) return;
+        PeerRelationship& pr = it->second;
+        if (pr.theirBitfield.clearPiece(index) && !bitfield.hasPiece(index) && priorities->wanted(index)
+            && pr.piecesWanted > 0 && --pr.piecesWanted == 0 && pr.interestedInThem) {
+            pr.interestedInThem = false;
+            lostInterest = true;
+        }
+    }
+    P2P_DEBUG("Peer " << ID << " was refused piece " << index << " by peer " << peerId);
 
-    fileHandler.writePiece(index, &pieceData[0], pieceData.size());
-    bitfield.setPiece(index);
-    requests.clear();
+    if (lostInterest) MessageSender(peerId, outboundTo(peerId)).sendNotInterested();
+    requestTracker->refused(index, peerId);
+    fillAllRequests();
+}
+
+void PeerProcess::handlePiece(int peerId, const PooledBuffer& payload){
+    P2P_SPAN("handlePiece");
+    if (payload.size() < 4) return;
+    int index = (payload.data()[0] << 24) | (payload.data()[1] << 16) | (payload.data()[2] << 8) | payload.data()[3];
+    if (index < 0 || static_cast<size_t>(index) >= getNumPieces()) return;
+    
+    // the piece stays in the receive buffer, the write-behind queue and cache share it by reference
+    ByteView pieceData = payload.view().subview(4);
+    // a short or long piece is dropped, what we asked them for times out and goes to someone else
+    if (pieceData.size != pieceStore->pieceLength(index)) {
+        P2P_ERROR("Peer " << ID << " piece " << index << " from peer " << peerId << " has " << pieceData.size
+                  << " bytes, not " << pieceStore->pieceLength(index));
+        return;
+    }
+    std::vector<int> alsoAsked = requestTracker->received(index, peerId, pieceData.size);
+
+    // in endgame the other holders are told to drop it
+    for (int other : alsoAsked) {
+        auto outbound = outboundTo(other);
+        if (!outbound) continue;
+        MessageSender sender(other, outbound);
+        sender.sendCancel(index);
+        P2P_DEBUG("Peer " << ID << " SENT CANCEL for piece " << index << " to peer " << other);
+    }
 
     {
         std::lock_guard<std::mutex> lock(peersMutex);
-        relationships.at(peerId).bytesDownloaded += pieceData.size(); 
+        relationships.at(peerId).bytesDownloaded += pieceData.size;
+    }
+
+    // a corrupt piece is dropped and asked of someone else
+    if (pieceHashes && !pieceHashes->verify(index, pieceData)) {
+        P2P_ERROR("Peer " << ID << " piece " << index << " from peer " << peerId << " does not match its hash");
+        {
+            std::lock_guard<std::mutex> lock(peersMutex);
+            relationships.at(peerId).corruptPieces.insert(index);
+        }
+        fillAllRequests();
+        return;
+    }
+
+    // every identical piece we lack is written from this same buffer, no request needed
+    std::vector<int> copies;
+    {
+        std::lock_guard<std::mutex> lock(pendingWritesMutex);
+        // a duplicate of a piece we already have or are already writing
+        if (bitfield.hasPiece(index) || pendingWrites.count(index))
+            return;
+        pendingWrites[index] = peerId;
+        if (pieceHashes) {
+            for (int same : pieceHashes->duplicatesOf(index)) {
+                if (bitfield.hasPiece(same) || pendingWrites.count(same)) continue;
+                pendingWrites[same] = peerId;
+                copies.push_back(same);
+            }
+        }
+    }
+
+    pieceCache->insert(index, payload, pieceData);
+
+    // hand the piece to the write-behind queue, this blocks only when the queue is full
+    writeBehind->push(index, payload, pieceData);
+    for (int same : copies) {
+        writeBehind->push(same, payload, pieceData);
+        // someone may still be sending it, which would only be thrown away
+        for (int holder : requestTracker->cancel(same)) {
+            if (auto outbound = outboundTo(holder)) MessageSender(holder, outbound).sendCancel(same);
+        }
+    }
+    if (!copies.empty())
+        P2P_DEBUG("Peer " << ID << " filled " << copies.size() << " copies of piece " << index << " locally");
+
+    // keep the peer busy while the piece is on its way to disk
+    fillRequests(peerId);
+}
+
+// the bitfield and HAVE only change once the piece is durable on disk
+void PeerProcess::onPieceDurable(int index, bool ok){
+    P2P_SPAN("onPieceDurable");
+    int peerId;
+    // pieces finish on several threads, only the one that sets the last bit finalizes
+    bool completed = false;
+    // peers that no longer have anything we lack
+    std::vector<std::pair<int, std::shared_ptr<OutboundQueue>>> exhausted;
+    {
+        std::lock_guard<std::mutex> peersLock(peersMutex);
+        const bool wanted = priorities->wanted(index);
+        {
+            std::lock_guard<std::mutex> lock(pendingWritesMutex);
+            peerId = pendingWrites.at(index);
+            // done with the last piece we want, or with the whole file once we fetch a piece after that
+            if (ok && bitfield.setPiece(index))
+                completed = (wanted && --wantedMissing == 0) || bitfield.isComplete();
+            pendingWrites.erase(index);
+        }
+        if (ok && wanted) {
+            for (auto& [id, pr] : relationships) {
+                if (pr.theirBitfield.hasPiece(index) && --pr.piecesWanted == 0) {
+                    pr.interestedInThem = false;
+                    if (pr.outbound) exhausted.emplace_back(id, pr.outbound);
+                }
+            }
+        }
+    }
+    if (!ok) {
+        P2P_ERROR("Peer " << ID << " failed to write piece " << index << ", requesting it again");
+        // it is neither on its way nor in the bitfield now, so the next pick finds it missing
+        fillAllRequests();
+        return;
     }
-	
-    int receivedCount = 0;
-    for(size_t i = 0; i < bitfield.getSize(); i++){
-        if(bitfield.hasPiece(i)) receivedCount++;
+
+    for (const auto& [id, outbound] : exhausted) {
+        MessageSender sender(id, outbound);
+        sender.sendNotInterested();
+        P2P_DEBUG("Peer " << ID << " SENT NOT INTERESTED to peer " << id << ", nothing left to get from them");
     }
-    std::cout << "Peer " << ID << " progress: " << receivedCount << "/" << bitfield.getSize() << " pieces." << std::endl;
+
+    if (erasure.enabled()) decodeIfReady(erasure.stripeOf(index), peerId);
+
+    int receivedCount = static_cast<int>(bitfield.count());
+    P2P_DEBUG("Peer " << ID << " progress: " << receivedCount << "/" << bitfield.getSize() << " pieces.");
 
     logger.logDownloadedPiece(peerId, index, receivedCount);
 
 	    // BEFORE broadcasting HAVE
-    std::cout << "[RUBRIC 3b] Peer " << ID << " stored piece " << index
-              << " and will BROADCAST HAVE to other peers" << std::endl;
+    P2P_DEBUG("[RUBRIC 3b] Peer " << ID << " stored piece " << index
+              << " and will BROADCAST HAVE to other peers");
 
-    for (auto& [id, pr] : relationships) {
-        MessageSender sender(pr.theirID, pr.theirSocket);
-        sender.sendHave(index);
+    {
+        std::lock_guard<std::mutex> lock(peersMutex);
+        for (auto& [id, pr] : relationships) {
+            MessageSender sender(pr.theirID, pr.outbound);
+            sender.sendHave(index);
+        }
     }
-	std::cout << "[RUBRIC 3b] Peer " << ID << " BROADCASTED HAVE for piece " << index << std::endl;
+	P2P_DEBUG("[RUBRIC 3b] Peer " << ID << " BROADCASTED HAVE for piece " << index);
 
-    if (bitfield.isComplete()) {
-        std::cout << "Peer " << ID << " has downloaded the complete file!" << std::endl;
+    if (completed && !bitfield.isComplete()) {
+        P2P_INFO("Peer " << ID << " has downloaded every selected piece, " << receivedCount << "/" << bitfield.getSize() << " of the file");
+        finishDownload();
+        checkSwarmComplete();
+    }
+    else if (completed) {
+        P2P_INFO("Peer " << ID << " has downloaded the complete file!");
 
-        if (fileHandler.finalize()) {
-            std::cout << "File finalized successfully." << std::endl;
-        } else {
-            std::cerr << "Failed to finalize file." << std::endl;
-        }
+        finishDownload();
         logger.logCompletedDownload();
 
         // we check every other peer to see if anyone else has all the pieces, we can terminate the connection
-        for (auto &[id, pr]: relationships) {
-            if(pr.theirBitfield.isComplete()){
-                initShutdown(id);
-                terminate--;
-                if (terminate == 0) {
-                    std::exit(0);
-                }
+        std::vector<int> finished;
+        {
+            std::lock_guard<std::mutex> lock(peersMutex);
+            for (auto &[id, pr]: relationships) {
+                if (pr.theirBitfield.isComplete()) finished.push_back(id);
             }
         }
+        for (int id : finished) initShutdown(id);
+        checkSwarmComplete();
     }
-    else{
-        int nextPiece = getPieceToRequest(peerId);
-        if (nextPiece >= 0 && !relationships.at(peerId).chokedMe) {
-            MessageSender sender(peerId, relationships.at(peerId).theirSocket);
-            sender.sendRequest(nextPiece);
-            requests[nextPiece] = peerId;
+}
+
+void PeerProcess::decodeIfReady(uint32_t stripe, int peerId){
+    const std::vector<uint32_t> members = erasure.members(stripe);
+    std::vector<uint32_t> held;
+    std::vector<uint32_t> missing;
+    {
+        std::lock_guard<std::mutex> lock(pendingWritesMutex);
+        if (stripeStates[stripe] != StripeOpen) return;
+        for (uint32_t index : members) {
+            // wait for what is on its way, it lands in the stripe anyway
+            if (pendingWrites.count(index)) return;
+            if (bitfield.hasPiece(index)) held.push_back(index);
+            else missing.push_back(index);
         }
+        if (missing.empty() || held.size() < erasure.sourceCount(stripe)) return;
+        stripeStates[stripe] = StripeDecoding;
+        // from here the missing pieces count as on their way, so nobody asks for them
+        for (uint32_t index : missing) pendingWrites[index] = peerId;
     }
+    for (uint32_t index : missing) {
+        for (int holder : requestTracker->cancel(index)) {
+            if (auto outbound = outboundTo(holder)) MessageSender(holder, outbound).sendCancel(index);
+        }
+    }
+
+    cpuTasks->submit([this, stripe, held, missing]() {
+        if (!pieceStore->decodeStripe(stripe, held)) {
+            P2P_ERROR("Peer " << ID << " could not decode stripe " << stripe << ", downloading the rest of it instead");
+            {
+                std::lock_guard<std::mutex> lock(pendingWritesMutex);
+                stripeStates[stripe] = StripeFailed;
+            }
+            for (uint32_t index : missing) onPieceDurable(static_cast<int>(index), false);
+            return;
+        }
+        P2P_DEBUG("Peer " << ID << " decoded " << missing.size() << " pieces of stripe " << stripe);
+        // decoded pieces are held to the same durability as received ones, the write-behind queue
+        // syncs them with its next commit and reports them through onPieceDurable, no worker waits here
+        writeBehind->pushWritten(missing);
+    }, TaskPriority::Low);
+}
+
+bool PeerProcess::stripeCovered(uint32_t stripe){
+    std::lock_guard<std::mutex> lock(pendingWritesMutex);
+    if (stripeStates[stripe] == StripeFailed) return false;
+    if (stripeStates[stripe] == StripeDecoding) return true;
+    size_t coming = 0;
+    for (uint32_t index : erasure.members(stripe)) {
+        if (bitfield.hasPiece(index) || pendingWrites.count(index) || requestTracker->isRequested(static_cast<int>(index))) coming++;
+    }
+    return coming >= erasure.sourceCount(stripe);
 }
 
 // choosing preffered neighbors
 void PeerProcess::findPreferredNeighbor() {
     preferredNeighborThread = std::thread([this]() {
+        profile::nameThread("preferred neighbors " + std::to_string(ID));
         std::random_device rd;
         std::mt19937 rng(rd());
 
-        const int k = common.numberOfPreferredNeighbors;
-        const int interval = common.unchokingInterval;
-
-        while (!schedulerStop.load()) {
-            // wait for p seconds
-            for (int i = 0; i < interval && !schedulerStop.load(); ++i)
-                std::this_thread::sleep_for(std::chrono::seconds(1));
-            if (schedulerStop.load()) break;
-
-            std::vector<std::pair<int,double>> candidateRates;
+        while (true) {
+            // wait for p seconds, read each round since the control socket may change it
+            int interval;
             {
                 std::lock_guard<std::mutex> lock(peersMutex);
-                for (auto &peer : relationships) {
-                    int pid = peer.first;
-                    if (!peer.second.interestedInMe){
-                        continue;
-                    }
-                    uint64_t delta = peer.second.bytesDownloaded - peer.second.lastDownloaded;
-                    double rate = static_cast<double>(delta) / std::max(1, interval);
-                    candidateRates.emplace_back(pid, rate);
-                }
+                interval = common.unchokingInterval;
             }
+            if (sleepUnlessStopped(std::chrono::seconds(interval))) break;
+            preferredNeighborRound(rng);
+        }
+    });
+}
 
-            // if we are a seeder i.e have the whole file, randomly choose peers
-            bool amSeeder = bitfield.isComplete();
-
-            std::vector<int> selected; selected.reserve(k);
-
-            if (amSeeder) {
-                std::vector<int> ids;
-                ids.reserve(candidateRates.size());
-                for (auto &pr : candidateRates){
-                    ids.push_back(pr.first);
-                }
-                if (!ids.empty()) {
-                    std::shuffle(ids.begin(), ids.end(), rng);
-                    for (size_t i = 0; i < ids.size() && (int)selected.size() < k; ++i) {
-                        selected.push_back(ids[i]);
-                    }
-                }
+// one round of choosing preferred neighbors, also driven by the wire replay
+void PeerProcess::preferredNeighborRound(std::mt19937& rng) {
+    P2P_SPAN("preferredNeighborRound");
+    int k;
+
+    std::vector<std::pair<int,double>> candidateRates;
+    // seeder only: interested peers by how long we have been choking them
+    std::vector<std::pair<std::chrono::steady_clock::time_point, int>> waiting;
+    const auto roundStart = std::chrono::steady_clock::now();
+    std::unordered_set<int> nearPeers;
+    // if we are a seeder i.e have the whole file, or everything we wanted of it, rank by how fast they take data from us
+    bool amSeeder = downloadDone();
+    {
+        std::lock_guard<std::mutex> lock(peersMutex);
+        k = common.numberOfPreferredNeighbors;
+        for (auto &peer : relationships) {
+            int pid = peer.first;
+            if (!peer.second.interestedInMe){
+                continue;
+            }
+            // a leecher does not reward peers that have stopped sending to it
+            if (!amSeeder && requestTracker->isSnubbed(pid)) {
+                continue;
             }
-            else {
-                // break ties randomly
-                std::shuffle(candidateRates.begin(), candidateRates.end(), rng);
-                std::stable_sort(candidateRates.begin(), candidateRates.end(),
-                                 [](const auto &a, const auto &b){ return a.second > b.second; });
-                for (size_t i = 0; i < candidateRates.size() && (int)selected.size() < k; ++i)
-                    selected.push_back(candidateRates[i].first);
+            double rate = amSeeder ? peer.second.uploadRate.bytesPerSecond() : peer.second.downloadRate.bytesPerSecond();
+            // a near peer counts double, so it wins unless a far one is clearly faster
+            if (isNear(peer.second)) {
+                rate *= 2;
+                nearPeers.insert(pid);
             }
+            candidateRates.emplace_back(pid, rate);
+            // a peer we are not choking is not waiting, so it sorts after every choked one
+            waiting.emplace_back(peer.second.chokedThem ? peer.second.lastChoked : roundStart, pid);
+        }
+    }
+
+    std::vector<int> selected; selected.reserve(k);
+
+    // break ties by locality, then randomly
+    std::shuffle(candidateRates.begin(), candidateRates.end(), rng);
+    std::stable_sort(candidateRates.begin(), candidateRates.end(),
+                     [&nearPeers](const auto &a, const auto &b){
+                         if (a.second != b.second) return a.second > b.second;
+                         return nearPeers.count(a.first) > nearPeers.count(b.first);
+                     });
+
+    // a seeder keeps a third of its slots (at least one) for whoever has waited longest,
+    // so peers that start slow still get the chance to show their rate
+    int rotating = 0;
+    if (amSeeder && static_cast<int>(candidateRates.size()) > k) {
+        rotating = std::max(1, k / 3);
+    }
+    for (size_t i = 0; i < candidateRates.size() && (int)selected.size() < k - rotating; ++i)
+        selected.push_back(candidateRates[i].first);
+    if (rotating > 0) {
+        std::sort(waiting.begin(), waiting.end());
+        for (size_t i = 0; i < waiting.size() && (int)selected.size() < k; ++i) {
+            if (std::find(selected.begin(), selected.end(), waiting[i].second) == selected.end())
+                selected.push_back(waiting[i].second);
+        }
+    }
 
-            // make lookup table for optimistic candidates
-            std::unordered_set<int> selectedSet(selected.begin(), selected.end());
-            int currentOptimistic = optimisticUnchokedPeer.load();
+    // make lookup table for optimistic candidates
+    std::unordered_set<int> selectedSet(selected.begin(), selected.end());
+    int currentOptimistic = optimisticUnchokedPeer.load();
 
-            // decide if we should choke or unchoke
-            {
-                std::lock_guard<std::mutex> lock(peersMutex);
-                std::vector<int> preferredNeighbors;
+    // decide if we should choke or unchoke
+    {
+        std::lock_guard<std::mutex> lock(peersMutex);
+        std::vector<int> preferredNeighbors;
 
-                for (auto &peer : relationships) {
-                    int pid = peer.first;
-                    bool shouldBeUnchoked = (selectedSet.count(pid));
-                    if (shouldBeUnchoked) {
+        for (auto &peer : relationships) {
+            int pid = peer.first;
+            bool shouldBeUnchoked = (selectedSet.count(pid));
+            if (shouldBeUnchoked) {
 					    if (peer.second.chokedThem) {
-					        SOCKET theirSocket = peer.second.theirSocket;
-					        if (theirSocket != INVALID_SOCKET){
-					            MessageSender sender(pid, theirSocket);
+					        if (peer.second.outbound){
+					            MessageSender sender(pid, peer.second.outbound);
 					            sender.sendUnchoke();
 					        }
 					        peer.second.chokedThem = false;
-					        std::cout << "[RUBRIC 2d] Peer " << ID << " SENT UNCHOKE to " << pid << std::endl;
+					        P2P_DEBUG("[RUBRIC 2d] Peer " << ID << " SENT UNCHOKE to " << pid);
 					    }
 					    preferredNeighbors.push_back(pid);
 					}
 					else {
 					    if (!peer.second.chokedThem) {
-					        SOCKET theirSocket = peer.second.theirSocket;
-					        if (theirSocket != INVALID_SOCKET){
-					            MessageSender sender(pid, theirSocket);
+					        if (peer.second.outbound){
+					            MessageSender sender(pid, peer.second.outbound);
 					            sender.sendChoke();
 					        }
 					        peer.second.chokedThem = true;
-					        std::cout << "[RUBRIC 2d] Peer " << ID << " SENT CHOKE to " << pid << std::endl;
+					        peer.second.lastChoked = std::chrono::steady_clock::now();
+					        P2P_DEBUG("[RUBRIC 2d] Peer " << ID << " SENT CHOKE to " << pid);
 					    }
 					}
+        }
+        if(!preferredNeighbors.empty()){
+            logger.logChangePreferredNeighbors(preferredNeighbors);
+					if (P2P_TRACE_ON(trace::Debug)) {
+					    std::ostringstream ids;
+					    for (int pid : preferredNeighbors) ids << pid << " ";
+					    P2P_DEBUG("[RUBRIC 2d] Peer " << ID << " preferredNeighbors set: " << ids.str());
+					}
 
-                    // update snapshot for next interval
-                    peer.second.lastDownloaded = peer.second.bytesDownloaded;
-                }
-                if(!preferredNeighbors.empty()){
-                    logger.logChangePreferredNeighbors(preferredNeighbors);
-					std::cout << "[RUBRIC 2d] Peer " << ID << " preferredNeighbors set: ";
-					for (int pid : preferredNeighbors) std::cout << pid << " ";
-					std::cout << std::endl;
-
-                }
-            }
         }
-    });
+    }
 }
 
 // choosing who to optimisticly unchoke
 void PeerProcess::startOptimisticUnchoke() {
     optimisticUnchokeThread = std::thread([this]() {
+        profile::nameThread("optimistic unchoke " + std::to_string(ID));
         std::random_device rd;
         std::mt19937 rng(rd());
 
-        const int interval = common.optimisticUnchokingInterval;
-
-        while (!schedulerStop.load()) {
-            for (int i = 0; i < interval && !schedulerStop.load(); ++i)
-                std::this_thread::sleep_for(std::chrono::seconds(1));
-            if (schedulerStop.load()) break;
-
-            // candidates must be choked by us and interested in us
-            std::vector<int> candidates;
+        while (true) {
+            int interval;
             {
                 std::lock_guard<std::mutex> lock(peersMutex);
-                for (auto &peer: relationships) {
-                    int pid = peer.first;
-                    if (peer.second.interestedInMe && peer.second.chokedThem) candidates.push_back(pid);
-                }
+                interval = common.optimisticUnchokingInterval;
             }
+            if (sleepUnlessStopped(std::chrono::seconds(interval))) break;
+            optimisticUnchokeRound(rng);
+        }
+    });
+}
 
-            if (candidates.empty()) {
-                continue;
+void PeerProcess::optimisticUnchokeRound(std::mt19937& rng) {
+    P2P_SPAN("optimisticUnchokeRound");
+    // candidates must be choked by us and interested in us
+    std::vector<int> candidates;
+    // near peers are three times as likely to be picked
+    std::vector<double> weights;
+    {
+        std::lock_guard<std::mutex> lock(peersMutex);
+        for (auto &peer: relationships) {
+            int pid = peer.first;
+            if (peer.second.interestedInMe && peer.second.chokedThem) {
+                candidates.push_back(pid);
+                weights.push_back(isNear(peer.second) ? 3.0 : 1.0);
             }
+        }
+    }
 
-            std::uniform_int_distribution<size_t> dist(0, candidates.size() - 1);
-            int chosen = candidates[dist(rng)];
-            int prev = optimisticUnchokedPeer.exchange(chosen);
+    if (candidates.empty()) {
+        return;
+    }
 
-            {
-                std::lock_guard<std::mutex> lock(peersMutex);
-                // unchoke the optimistic peer only if they are choked
-                if (relationships.at(chosen).chokedThem) {
-                    SOCKET theirSocket = relationships.at(chosen).theirSocket;
-                    if (theirSocket != INVALID_SOCKET) {
-						std::cout << "[RUBRIC 2e] Peer " << ID << " optimistically UNCHOKED peer " << chosen << std::endl;
-                        MessageSender sender(chosen, theirSocket);
-                        sender.sendUnchoke();
-                    }
-                    relationships.at(chosen).chokedThem = false;
-
-                    logger.logChangeOptimisticUnchoke(chosen);
-                }
+    std::discrete_distribution<size_t> dist(weights.begin(), weights.end());
+    int chosen = candidates[dist(rng)];
+    int prev = optimisticUnchokedPeer.exchange(chosen);
+
+    {
+        std::lock_guard<std::mutex> lock(peersMutex);
+        // unchoke the optimistic peer only if they are choked
+        if (relationships.at(chosen).chokedThem) {
+            auto outbound = relationships.at(chosen).outbound;
+            if (outbound) {
+						P2P_DEBUG("[RUBRIC 2e] Peer " << ID << " optimistically UNCHOKED peer " << chosen);
+                MessageSender sender(chosen, outbound);
+                sender.sendUnchoke();
+            }
+            relationships.at(chosen).chokedThem = false;
+
+            logger.logChangeOptimisticUnchoke(chosen);
+        }
 
-                // choke previous optimistic peer
-                if (prev != -1 && prev != chosen) {
-                    if (!relationships.at(prev).chokedThem) {
-                        SOCKET theirSocket = relationships.at(prev).theirSocket;
-                        if (theirSocket != INVALID_SOCKET) {
-							std::cout << "[RUBRIC 2e] Peer " << ID << " removed optimistic UNCHOKE from peer " << prev << std::endl;
-                            MessageSender sender(prev, theirSocket);
-                            sender.sendChoke();
-                        }
-                        relationships.at(prev).chokedThem = true;
-                    }
+        // choke previous optimistic peer
+        if (prev != -1 && prev != chosen) {
+            if (!relationships.at(prev).chokedThem) {
+                auto outbound = relationships.at(prev).outbound;
+                if (outbound) {
+							P2P_DEBUG("[RUBRIC 2e] Peer " << ID << " removed optimistic UNCHOKE from peer " << prev);
+                    MessageSender sender(prev, outbound);
+                    sender.sendChoke();
                 }
+                relationships.at(prev).chokedThem = true;
+                relationships.at(prev).lastChoked = std::chrono::steady_clock::now();
+            }
+        }
+    }
+}
+
+// expiring overdue requests
+void PeerProcess::startRequestTimer() {
+    requestTimerThread = std::thread([this]() {
+        auto lastPing = std::chrono::steady_clock::now();
+        profile::nameThread("request timer " + std::to_string(ID));
+        while (!sleepUnlessStopped(std::chrono::milliseconds(250))) {
+            P2P_SPAN("request timer pass");
+            applyStagedSettings();
+            RequestTracker::Tick tick = requestTracker->expire();
+
+            std::unordered_set<int> slowPeers;
+            for (const auto& [piece, peerId] : tick.expired) {
+                P2P_DEBUG("Peer " << ID << " request for piece " << piece << " to peer " << peerId
+                          << " timed out, requesting it elsewhere");
+                slowPeers.insert(peerId);
+            }
+            for (int peerId : tick.snubbed) {
+                P2P_INFO("Peer " << ID << " has been snubbed by peer " << peerId);
+            }
+
+            if (!tick.expired.empty()) reissueRequests(slowPeers);
+            if (!tick.snubbed.empty()) {
+                replaceSnubbers(tick.snubbed);
+                fillAllRequests();
+            }
+            sampleRates();
+
+            if (common.pingInterval > 0 && std::chrono::steady_clock::now() - lastPing >= std::chrono::seconds(common.pingInterval)) {
+                lastPing = std::chrono::steady_clock::now();
+                sendPings();
             }
         }
     });
 }
 
+bool PeerProcess::isNear(const PeerRelationship& peer) const {
+    return peer.sameHost || (peer.minRtt.count() > 0 && peer.minRtt <= common.nearRtt);
+}
+
+bool PeerProcess::onOurHost(int peerId) const {
+    for (const auto& peer : allPeers) {
+        if (peer.peerId == peerId) return peer.hostName == selfInfo.hostName;
+    }
+    return false;
+}
+
+void PeerProcess::sendPings() {
+    const uint64_t stamp = std::chrono::steady_clock::now().time_since_epoch().count();
+    std::lock_guard<std::mutex> lock(peersMutex);
+    for (auto& [id, pr] : relationships) {
+        if (pr.outbound) MessageSender(id, pr.outbound).sendPing(stamp);
+    }
+}
+
+void PeerProcess::fillAllRequests() {
+    std::vector<int> sending;
+    {
+        std::lock_guard<std::mutex> lock(peersMutex);
+        for (auto& [id, pr] : relationships) {
+            if (pr.connected && !pr.chokedMe) sending.push_back(id);
+        }
+    }
+    for (int peerId : sending) fillRequests(peerId);
+}
+
+// rates are averaged over about one unchoking interval, what a choke round looks back on
+// call with peersMutex held
+RateEstimator PeerProcess::rateEstimator() const {
+    return RateEstimator(std::chrono::seconds(std::max(1, common.unchokingInterval)));
+}
 
+void PeerProcess::sampleRates() {
+    const auto now = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lock(peersMutex);
+    for (auto& [id, pr] : relationships) {
+        if (pr.outbound) pr.bytesUploaded = pr.outbound->bytesWritten() + pr.bytesReferenced;
+        pr.downloadRate.sample(pr.bytesDownloaded, now);
+        pr.uploadRate.sample(pr.bytesUploaded, now);
+    }
+}
+
+void PeerProcess::replaceSnubbers(const std::vector<int>& snubbed) {
+    // a seeder is not waiting on anyone
+    if (downloadDone()) return;
+
+    std::lock_guard<std::mutex> lock(peersMutex);
+    for (int pid : snubbed) {
+        auto it = relationships.find(pid);
+        // the optimistic slot is theirs to keep until it rotates
+        if (it == relationships.end() || it->second.chokedThem || pid == optimisticUnchokedPeer.load()) continue;
+
+        MessageSender(pid, it->second.outbound).sendChoke();
+        it->second.chokedThem = true;
+        it->second.lastChoked = std::chrono::steady_clock::now();
+        P2P_DEBUG("Peer " << ID << " CHOKED peer " << pid << ", it stopped sending to us");
+
+        // the slot goes to the fastest choked peer that is interested and still sending
+        int best = -1;
+        double bestRate = -1;
+        for (auto& [id, pr] : relationships) {
+            if (!pr.connected || !pr.chokedThem || !pr.interestedInMe || id == pid || requestTracker->isSnubbed(id)) continue;
+            if (pr.downloadRate.bytesPerSecond() > bestRate) {
+                best = id;
+                bestRate = pr.downloadRate.bytesPerSecond();
+            }
+        }
+        if (best < 0) continue;
+        PeerRelationship& replacement = relationships.at(best);
+        MessageSender(best, replacement.outbound).sendUnchoke();
+        replacement.chokedThem = false;
+        P2P_DEBUG("[RUBRIC 2d] Peer " << ID << " SENT UNCHOKE to " << best << " in place of " << pid);
+    }
+}
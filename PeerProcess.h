@@ -5,6 +5,7 @@
 #include <sstream>
 #include <thread>
 #include <unordered_map>
+#include <unordered_set>
 #include <unistd.h>
 #include <winsock2.h>
 #include <ws2tcpip.h>
@@ -13,10 +14,28 @@
 #include <atomic>
 #include <condition_variable>
 #include <random>
+#include <array>
+#include <optional>
 #include "BitfieldManager.h"
+#include "CompressedBitfield.h"
 #include "messageSender.h"
-#include "FileHandling.h"
+#include "PieceStore.h"
+#include "WriteBehind.h"
+#include "BufferPool.h"
+#include "PieceCache.h"
+#include "SuperSeeder.h"
+#include "RequestTracker.h"
+#include "UploadBudget.h"
+#include "WireTrace.h"
+#include "OutboundQueue.h"
+#include "Executor.h"
+#include "RateEstimator.h"
+#include "PiecePriorities.h"
+#include "PieceHashes.h"
+#include "LocalTransport.h"
 #include "logger.h"
+#include "Trace.h"
+#include "Profile.h"
 
 #pragma once
 
@@ -36,78 +55,304 @@ struct Common{
     std::string fileName;
     int fileSize;
     int pieceSize;
+    std::string storageBackend = "file";
+    size_t storageMemory = 256 << 20;
+    std::string diskBackend = "auto";
+    bool directIO = false;
+    size_t writeBehindBytes = 8 << 20;
+    int writeBehindWorkers = 2;
+    DurabilityPolicy durability;
+    size_t pieceCacheBytes = 4 << 20;       // receive buffers kept for serving, whatever the piece size
+    bool superSeeding = false;
+    RequestPolicy requests;
+    uint32_t swarmId = 0;   // from the file name and size unless SwarmId is set
+    unsigned executorThreads = 0;           // CPU workers shared by every swarm, 0 for one per core
+    size_t outboundQueueBytes = 4 << 20;    // queued piece bytes per connection before we stop serving it
+    bool wireTrace = false;  // record every frame to wire_peer_<id>.trace in the swarm directory
+    int pingInterval = 2;    // seconds between PINGs that measure each peer's round trip, 0 for none
+    std::chrono::microseconds nearRtt{1000};    // peers this close, or on our host, are served and asked first
+    // byte ranges (offset, length) to fetch, once there is one every piece outside them is skipped
+    std::vector<std::pair<uint64_t, uint64_t>> downloadRanges;
+    // applied in order over the ranges
+    std::vector<PiecePriorities::Rule> piecePriorities;
+    // one SHA-256 per piece, relative to the swarm directory, received pieces are checked against it
+    // and pieces with equal hashes are fetched once, empty for none
+    std::string pieceHashes;
+    // coded pieces: each stripe of ErasureStripe pieces gets ErasureParity parity pieces,
+    // any ErasureStripe of which rebuild the stripe, 0 parity for plain pieces
+    uint32_t erasureStripe = 32;
+    uint32_t erasureParity = 0;
+};
+
+// 0 waits forever
+void setReceiveTimeout(SOCKET sock, int ms);
+
+// what every swarm hosted by one process shares
+struct SharedResources {
+    std::shared_ptr<DiskIO> diskIO;
+    std::shared_ptr<BufferPool> bufferPool;
+    std::shared_ptr<UploadBudget> uploadBudget;
+    std::shared_ptr<Executor> executor;
+    // where same-host peers listen on Unix sockets, empty to reach them over TCP like anyone else
+    std::filesystem::path localSocketDir;
 };
 
 struct PeerRelationship {
-    PeerRelationship(SOCKET ts, BitfieldManager tb, int ti, bool cm, bool ct, bool im, bool it):
+    PeerRelationship(SOCKET ts, CompressedBitfield tb, int ti, bool cm, bool ct, bool im, bool it):
     theirSocket(ts), theirBitfield(tb), theirID(ti), chokedMe(cm), chokedThem(ct), interestedInMe(im), interestedInThem(it) {}
     SOCKET theirSocket;
-    BitfieldManager theirBitfield;
+    // every message to them goes through here, empty once we stop sending
+    std::shared_ptr<OutboundQueue> outbound;
+    CompressedBitfield theirBitfield;
     int theirID;
     bool chokedMe;
     bool chokedThem;
     bool interestedInMe;
     bool interestedInThem;
+    // pieces they have that we lack, interested exactly while this is above zero
+    size_t piecesWanted = 0;
     uint64_t bytesDownloaded = 0;
-    uint64_t lastDownloaded = 0;
+    // piece bytes that reached their socket, copied from the outbound queue
+    uint64_t bytesUploaded = 0;
+    RateEstimator downloadRate;
+    RateEstimator uploadRate;
+    // when we last choked them, unset if we never have, a seeder's rotating slot goes to
+    // the interested peer that has been choked longest
+    std::chrono::steady_clock::time_point lastChoked{};
+    // smoothed round trip from PING/PONG, zero until the first PONG
+    std::chrono::microseconds rtt{0};
+    // the lowest seen, what is left once queued pieces are not in the way, locality goes by this
+    std::chrono::microseconds minRtt{0};
+    // PeerInfo.cfg lists them under our host name
+    bool sameHost = false;
+    // pieces they sent that failed the hash check, never asked of them again
+    std::unordered_set<int> corruptPieces;
+    // they sent UPLOAD_ONLY, they have every piece they want and stay only to serve
+    bool uploadOnly = false;
+    // the connection is a Unix socket, the only kind LOCAL_FILE and PIECE_REF are taken on
+    bool overUnix = false;
+    // same-host connections only: their file, mapped once they sent LOCAL_FILE
+    std::shared_ptr<MappedFile> theirFile;
+    // they mapped ours, so their requests are answered with PIECE_REF
+    bool mappedOurFile = false;
+    // piece bytes they copied out of our file, counted as uploaded
+    uint64_t bytesReferenced = 0;
+    // false once the connection has closed, for whatever reason
+    bool connected = true;
 };
 
+// one swarm: the file described by Common.cfg and PeerInfo.cfg in its directory
 class PeerProcess {
 public:
-    explicit PeerProcess(int peerId);
+    explicit PeerProcess(int peerId, std::filesystem::path dir = ".");
+    ~PeerProcess();
+    // reads the configuration, false if Common.cfg could not be opened
+    bool load();
+    // init before the daemon starts listening, start once it is
+    void init(const SharedResources& shared);
     void start();
+    // a connection the daemon accepted and whose handshake named this swarm
+    void adoptConnection(SOCKET sock, const std::array<unsigned char, 32>& handshake);
+    // blocks until every peer has the whole file or stop() was called
+    void waitForSwarm();
+    // wakes and joins every thread, safe to call more than once
+    void stop();
+
+    // drive the protocol logic without sockets or timers, for WireReplay
+    // nothing is sent and received pieces are written, so replay into a scratch copy
+    void startOffline(const SharedResources& shared);
+    void replayConnect(int peerId);
+    void replayMessage(int peerId, unsigned char type, const PooledBuffer& payload);
+    void replayDisconnect(int peerId);
+    void replayChokeRound(bool optimistic);
+
+    uint32_t swarmId() const {
+        return common.swarmId;
+    }
+    int listenPort() const {
+        return selfInfo.port;
+    }
+    const std::filesystem::path& directory() const {
+        return dir;
+    }
+    // buffer sizes this swarm's messages need from the shared pool
+    std::vector<size_t> bufferClasses() const;
+
+    // for the control socket: settings are checked and staged together, all or none,
+    // and take effect together at the next request timer tick
+    bool stageSettings(const std::vector<std::pair<std::string, std::string>>& settings, std::string& error);
+    std::string describeSettings();
+    // our progress, then one line per peer with its choke state, rates and requests
+    std::string describePeers();
+    // piece priorities, applied at once, false with a reason if the span lies outside the file
+    bool setPiecePriority(size_t first, size_t last, uint8_t level, std::string& error);
+    bool setRangePriority(uint64_t offset, uint64_t length, uint8_t level, std::string& error);
+    std::string describePriorities();
 
     Common common;
     BitfieldManager bitfield;
-    FileHandling fileHandler;
+    std::unique_ptr<PieceStore> pieceStore;
+    std::shared_ptr<DiskIO> diskIO;
+    std::filesystem::path localSocketDir;
+    std::unique_ptr<WriteBehindQueue> writeBehind;
+    // our work on the shared executor, waited for before we tear down
+    std::unique_ptr<TaskGroup> cpuTasks;
+    std::shared_ptr<BufferPool> bufferPool;
+    std::shared_ptr<UploadBudget> uploadBudget;
+    std::unique_ptr<PieceCache> pieceCache;
+    // only set while we are the initial seeder rationing pieces
+    std::unique_ptr<SuperSeeder> superSeeder;
+    std::mutex superSeedMutex;
     Logger logger;
 
 private:
     int ID;
-    int terminate = 5;
+    std::filesystem::path dir;
     PeerInfo selfInfo;
     std::vector<PeerInfo> allPeers;
     std::vector<PeerInfo> neighborPeers;
     std::unordered_map<int, PeerRelationship> relationships;
-    std::unordered_map<int, int> requests;
+    std::unique_ptr<RequestTracker> requestTracker;
+    // every missing piece has a request out, so they are asked of every holder
+    std::atomic<bool> endgame{false};
+    // uploads waiting on a disk read, a CANCEL removes them before they are sent
+    std::unordered_set<uint64_t> pendingUploads;
+    std::mutex uploadsMutex;
+    // pieces received but not yet durable, piece -> peer it came from
+    std::unordered_map<int, int> pendingWrites;
+    std::mutex pendingWritesMutex;
+    std::unique_ptr<WireTrace> wireTrace;
+    // only set with a PieceHashes file
+    std::unique_ptr<PieceHashes> pieceHashes;
+    ErasureLayout erasure;
+    // per stripe, under pendingWritesMutex: being or done being decoded, or failed to and downloaded instead
+    enum StripeState : uint8_t { StripeOpen, StripeDecoding, StripeFailed };
+    std::vector<uint8_t> stripeStates;
+    // replaced whole on a change, read under peersMutex or through a copy of the pointer
+    std::shared_ptr<const PiecePriorities> priorities;
+    // pieces we want and do not have yet, done downloading at zero
+    std::atomic<size_t> wantedMissing{0};
+    // settings from the control socket waiting for the next tick
+    std::optional<Common> staged;
+    std::mutex stagedMutex;
+    // no sockets, see startOffline
+    bool offline = false;
+    std::mt19937 replayRng{1};
 
-    void readCommon();
+    bool readCommon();
     void readPeerInfo();
     void bitfieldInit();
+    void prioritiesInit();
+    void pieceHashesInit();
+    void bufferPoolInit();
+    void requestTrackerInit();
+    // every piece on the wire, parity pieces included
     size_t getNumPieces() const;
+    // the pieces of the file itself
+    size_t getSourcePieces() const;
     void fileHandlinitInit();
     void loggerInit();
+    void wireTraceInit();
 
-    void startListen();
-    void handleConnection(SOCKET clientSocket, bool receiver);
+    void spawnConnection(SOCKET sock, bool receiver, std::array<unsigned char, 32> handshake = {});
+    void closeConnection(SOCKET sock);
+    // a receiver gets the handshake the daemon already read, an initiator reads the reply itself
+    void handleConnection(SOCKET clientSocket, bool receiver, std::array<unsigned char, 32> handshake);
     void connectToEarlierPeers();
     void connectionMessageLoop(SOCKET sock, int peerId);
+    void dispatchMessage(int peerId, unsigned char type, const PooledBuffer& payload);
     int getPieceToRequest(int peerId);
+    // a piece already requested from someone else, for endgame
+    int getEndgamePiece(int peerId);
+    bool inEndgame();
+    // request from the peer until its window is full
+    void fillRequests(int peerId);
+    // hand released or expired pieces to whoever can serve them, slow peers last
+    void reissueRequests(const std::unordered_set<int>& slowPeers);
+    // null if they are gone or we are done sending to them
+    std::shared_ptr<OutboundQueue> outboundTo(int peerId);
     void initShutdown(int peerId);
+    void onPeerDisconnected(int peerId);
+    void checkSwarmComplete();
+    // every piece we want is on disk, we may still lack the pieces we skipped
+    bool downloadDone() const {
+        return wantedMissing.load() == 0;
+    }
+    std::shared_ptr<const PiecePriorities> priorityTable();
+    // recounts what we want from everyone, sends the interest and UPLOAD_ONLY changes
+    void applyPriorities(std::shared_ptr<const PiecePriorities> next);
+    // puts the file in place and tells everyone we only upload from now on
+    void finishDownload();
+
+    // on our host or with a minimum round trip within NearRttUs, call with peersMutex held
+    bool isNear(const PeerRelationship& peer) const;
+    bool onOurHost(int peerId) const;
+    void sendPings();
+    // every peer that is sending to us, after a near one stops and far ones may take over
+    void fillAllRequests();
+
+    void superSeedInit();
+    void sendSuperSeedOffers(const std::vector<std::pair<int, int>>& offers);
+    void endSuperSeeding();
 
     void handleChoke(int peerId);
     void handleUnchoke(int peerId);
     void handleInterested(int peerId);
     void handleNotInterested(int peerId);
-    void handleHave(int peerId, const std::vector<unsigned char>& payload);
-    void handleBitfield(int peerId, const std::vector<unsigned char>& payload);
-    void handleRequest(int peerId, const std::vector<unsigned char>& payload);
-    void handlePiece(int peerId, const std::vector<unsigned char>& payload);
+    void handleHave(int peerId, ByteView payload);
+    void handleBitfield(int peerId, ByteView payload);
+    void handleRequest(int peerId, ByteView payload);
+    // sends a piece asked for, from the cache or a disk read, once their queue has room for it
+    void serveRequest(int peerId, int index);
+    void handlePiece(int peerId, const PooledBuffer& payload);
+    void handleCancel(int peerId, ByteView payload);
+    void handlePing(int peerId, ByteView payload);
+    void handlePong(int peerId, ByteView payload);
+    void handleUploadOnly(int peerId, ByteView payload);
+    void handleLocalFile(int peerId, ByteView payload);
+    void handleLocalMapped(int peerId);
+    void handlePieceRef(int peerId, ByteView payload);
+    void handleReject(int peerId, ByteView payload);
+    void onPieceDurable(int index, bool ok);
+    // once a stripe holds as many pieces as it has source pieces the rest are decoded, not downloaded
+    void decodeIfReady(uint32_t stripe, int peerId);
+    // held, on its way or requested pieces already make up the stripe
+    bool stripeCovered(uint32_t stripe);
 
     std::mutex peersMutex;
     std::atomic<int> optimisticUnchokedPeer{-1};
     std::thread preferredNeighborThread;
     std::thread optimisticUnchokeThread;
+    std::thread requestTimerThread;
+
+    // one thread per connection, and the sockets they have open
+    std::vector<std::thread> connectionThreads;
+    std::unordered_set<SOCKET> liveSockets;
+    std::mutex connectionsMutex;
 
-    std::atomic<bool> schedulerStop{false};
-    std::condition_variable_any schedulerCv;
-    std::mutex schedulerMutex;
+    std::atomic<bool> stopRequested{false};
+    bool swarmComplete = false;
+    bool stopped = false;
+    std::condition_variable lifecycleCv;
+    std::mutex lifecycleMutex;
+    // sleeps for the duration, returns true early if a stop was requested
+    bool sleepUnlessStopped(std::chrono::milliseconds duration);
 
     // algorithms for choosing preferred neighbors and optimistic unchoking
     void findPreferredNeighbor();
     void startOptimisticUnchoke();
+    void preferredNeighborRound(std::mt19937& rng);
+    void optimisticUnchokeRound(std::mt19937& rng);
+    // expires overdue requests and flags snubbing peers
+    void startRequestTimer();
+    void applyStagedSettings();
+    RateEstimator rateEstimator() const;
+    // feeds every connection's byte counts to its rate estimators
+    void sampleRates();
+    // a preferred neighbor that snubs us loses its slot now rather than at the next round
+    void replaceSnubbers(const std::vector<int>& snubbed);
 
-    // when all other peers have the complete file
+    // when we and all other peers are done downloading
     bool allPeersHave();
 };
 
@@ -0,0 +1,46 @@
+#include "PieceCache.h"
+
+PieceCache::PieceCache(size_t capacity) : capacity_(capacity) {}
+
+void PieceCache::insert(uint32_t index, PooledBuffer owner, ByteView data) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (capacity_ == 0) return;
+
+    auto it = entries_.find(index);
+    if (it != entries_.end()) {
+        bytes_ -= it->second->owner.capacity();
+        lru_.erase(it->second);
+        entries_.erase(it);
+    }
+    // a piece larger than the whole cache would only push everything else out
+    if (owner.capacity() > capacity_) return;
+    bytes_ += owner.capacity();
+    lru_.push_front(Entry{index, std::move(owner), data});
+    entries_[index] = lru_.begin();
+    evictLocked();
+}
+
+bool PieceCache::lookup(uint32_t index, PooledBuffer& owner, ByteView& data) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(index);
+    if (it == entries_.end()) return false;
+
+    lru_.splice(lru_.begin(), lru_, it->second);
+    owner = it->second->owner;
+    data = it->second->data;
+    return true;
+}
+
+void PieceCache::setCapacity(size_t capacity) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    capacity_ = capacity;
+    evictLocked();
+}
+
+void PieceCache::evictLocked() {
+    while (bytes_ > capacity_) {
+        bytes_ -= lru_.back().owner.capacity();
+        entries_.erase(lru_.back().index);
+        lru_.pop_back();
+    }
+}
@@ -0,0 +1,34 @@
+#pragma once
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <cstdint>
+#include "BufferPool.h"
+
+// recently received pieces, kept in their receive buffers so other peers
+// can be served from memory without a disk read or another copy
+// capacity is in bytes of receive buffer, so large pieces do not hold more memory than small ones
+class PieceCache {
+public:
+    explicit PieceCache(size_t capacity);
+
+    void insert(uint32_t index, PooledBuffer owner, ByteView data);
+    // on a hit, owner keeps the bytes alive for as long as the caller needs them
+    bool lookup(uint32_t index, PooledBuffer& owner, ByteView& data);
+    void setCapacity(size_t capacity);
+
+private:
+    struct Entry {
+        uint32_t index;
+        PooledBuffer owner;
+        ByteView data;
+    };
+
+    void evictLocked();
+
+    std::mutex mutex_;
+    size_t capacity_;
+    size_t bytes_ = 0;      // capacity of the buffers held, not just the piece bytes
+    std::list<Entry> lru_;  // most recently used first
+    std::unordered_map<uint32_t, std::list<Entry>::iterator> entries_;
+};
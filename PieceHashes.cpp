@@ -0,0 +1,52 @@
+#include "PieceHashes.h"
+#include "Trace.h"
+#include <fstream>
+#include <map>
+
+bool PieceHashes::load(const std::filesystem::path& path, size_t numPieces) {
+    std::ifstream in(path);
+    if (!in.is_open()) {
+        P2P_ERROR("Could not open piece hashes " << path);
+        return false;
+    }
+    std::vector<Sha256Digest> hashes;
+    hashes.reserve(numPieces);
+    std::string line;
+    while (std::getline(in, line)) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (line.empty()) continue;
+        Sha256Digest digest;
+        if (!Sha256::fromHex(line, digest)) {
+            P2P_ERROR("Bad hash on line " << hashes.size() + 1 << " of " << path);
+            return false;
+        }
+        hashes.push_back(digest);
+    }
+    if (hashes.size() != numPieces) {
+        P2P_ERROR(path << " lists " << hashes.size() << " hashes for " << numPieces << " pieces");
+        return false;
+    }
+
+    // sort the indices by hash so each run of equal hashes becomes a group
+    std::map<Sha256Digest, std::vector<int>> byHash;
+    for (size_t i = 0; i < hashes.size(); i++) byHash[hashes[i]].push_back(static_cast<int>(i));
+    group_.assign(numPieces, -1);
+    groups_.clear();
+    for (auto& [digest, indices] : byHash) {
+        if (indices.size() < 2) continue;
+        for (int i : indices) group_[i] = static_cast<int>(groups_.size());
+        groups_.push_back(std::move(indices));
+    }
+    hashes_ = std::move(hashes);
+    return true;
+}
+
+bool PieceHashes::verify(size_t index, ByteView data) const {
+    return index >= hashes_.size() || Sha256::hash(data.data, data.size) == hashes_[index];
+}
+
+size_t PieceHashes::redundantPieces() const {
+    size_t redundant = 0;
+    for (const auto& group : groups_) redundant += group.size() - 1;
+    return redundant;
+}
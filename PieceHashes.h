@@ -0,0 +1,35 @@
+#pragma once
+#include <vector>
+#include <filesystem>
+#include <cstdint>
+#include <cstddef>
+#include "Sha256.h"
+#include "BufferPool.h"
+
+// the SHA-256 of every piece, read from a file with one hex digest per line in piece order
+// (HashPieces writes one), so received pieces can be checked and identical pieces found:
+// a piece whose hash repeats is fetched once and copied into every index that shares it
+class PieceHashes {
+public:
+    // false if the file is missing, malformed or lists other than numPieces hashes
+    bool load(const std::filesystem::path& path, size_t numPieces);
+
+    // pieces past the hashed ones, parity pieces, have nothing to check against and pass
+    bool verify(size_t index, ByteView data) const;
+
+    // every index with the same hash, this one included, empty if the piece is unique
+    const std::vector<int>& duplicatesOf(size_t index) const {
+        static const std::vector<int> none;
+        return index >= group_.size() || group_[index] < 0 ? none : groups_[group_[index]];
+    }
+    // pieces that need not come over the network, all but one of each group
+    size_t redundantPieces() const;
+    size_t groupCount() const {
+        return groups_.size();
+    }
+
+private:
+    std::vector<Sha256Digest> hashes_;
+    std::vector<int> group_;                    // index into groups_, -1 for a unique piece
+    std::vector<std::vector<int>> groups_;
+};
@@ -0,0 +1,67 @@
+#include "PiecePriorities.h"
+#include <algorithm>
+#include <sstream>
+
+PiecePriorities::PiecePriorities(size_t numPieces, uint8_t level) : levels_(numPieces, level) {}
+
+bool PiecePriorities::parseLevel(const std::string& name, uint8_t& level) {
+    if (name == "skip") level = Skip;
+    else if (name == "low") level = Low;
+    else if (name == "normal") level = Normal;
+    else if (name == "high") level = High;
+    else return false;
+    return true;
+}
+
+const char* PiecePriorities::levelName(uint8_t level) {
+    static const char* names[] = {"skip", "low", "normal", "high"};
+    return level <= High ? names[level] : "unknown";
+}
+
+bool PiecePriorities::parseSpan(const std::string& text, size_t& first, size_t& last) {
+    try {
+        size_t used;
+        first = std::stoull(text, &used);
+        if (used == text.size()) {
+            last = first;
+            return true;
+        }
+        if (text[used] != '-') return false;
+        const std::string rest = text.substr(used + 1);
+        last = std::stoull(rest, &used);
+        return used == rest.size() && first <= last;
+    }
+    catch (const std::exception&) {
+        return false;
+    }
+}
+
+bool PiecePriorities::set(size_t first, size_t last, uint8_t level) {
+    if (first >= levels_.size() || first > last) return false;
+    last = std::min(last, levels_.size() - 1);
+    std::fill(levels_.begin() + first, levels_.begin() + last + 1, level);
+    return true;
+}
+
+bool PiecePriorities::setBytes(uint64_t offset, uint64_t length, uint32_t pieceSize, uint8_t level) {
+    if (length == 0 || pieceSize == 0) return false;
+    return set(offset / pieceSize, (offset + length - 1) / pieceSize, level);
+}
+
+size_t PiecePriorities::wantedCount() const {
+    return levels_.size() - std::count(levels_.begin(), levels_.end(), uint8_t(Skip));
+}
+
+std::string PiecePriorities::describe() const {
+    std::ostringstream out;
+    for (size_t first = 0; first < levels_.size();) {
+        size_t last = first;
+        while (last + 1 < levels_.size() && levels_[last + 1] == levels_[first]) last++;
+        if (first) out << ", ";
+        out << first;
+        if (last != first) out << "-" << last;
+        out << " " << levelName(levels_[first]);
+        first = last + 1;
+    }
+    return out.str();
+}
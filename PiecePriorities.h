@@ -0,0 +1,50 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+// how much we want each piece, the picker takes the highest level first and never asks for a skipped one
+// once every piece that is not skipped is on disk we are done, even with the rest of the file missing
+class PiecePriorities {
+public:
+    enum Level : uint8_t { Skip = 0, Low = 1, Normal = 2, High = 3 };
+
+    // pieces first to last inclusive, as written in Common.cfg and on the control socket
+    struct Rule {
+        size_t first;
+        size_t last;
+        uint8_t level;
+    };
+
+    PiecePriorities() = default;
+    explicit PiecePriorities(size_t numPieces, uint8_t level = Normal);
+
+    // skip, low, normal or high
+    static bool parseLevel(const std::string& name, uint8_t& level);
+    static const char* levelName(uint8_t level);
+    // "<first>" or "<first>-<last>"
+    static bool parseSpan(const std::string& text, size_t& first, size_t& last);
+
+    // clamped to the file, false if nothing of it lies inside
+    bool set(size_t first, size_t last, uint8_t level);
+    // the pieces that hold any of the bytes [offset, offset + length)
+    bool setBytes(uint64_t offset, uint64_t length, uint32_t pieceSize, uint8_t level);
+
+    uint8_t level(size_t index) const {
+        return levels_[index];
+    }
+    bool wanted(size_t index) const {
+        return levels_[index] != Skip;
+    }
+    size_t getSize() const {
+        return levels_.size();
+    }
+    size_t wantedCount() const;
+
+    // runs of equal level, "0-99 high, 100-4095 skip"
+    std::string describe() const;
+
+private:
+    std::vector<uint8_t> levels_;
+};
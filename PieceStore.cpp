@@ -0,0 +1,438 @@
+#include "PieceStore.h"
+#include "FileHandling.h"
+#include "Profile.h"
+#include "Trace.h"
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+PieceStore::PieceStore(uint64_t fileSize, uint32_t pieceSize, bool seeder)
+    : fileSize_(fileSize), pieceSize_(pieceSize), seeder_(seeder) {}
+
+void PieceStore::enableErasureCoding(const ErasureLayout& layout) {
+    erasure_ = layout;
+}
+
+uint32_t PieceStore::pieceLength(uint32_t index) const {
+    if (isParity(index)) return index < erasure_.totalPieces() ? pieceSize_ : 0;
+    const uint64_t start = uint64_t(index) * pieceSize_;
+    if (start >= fileSize_) return 0;
+    const uint64_t end = std::min(start + uint64_t(pieceSize_), fileSize_);
+    return static_cast<uint32_t>(end - start);
+}
+
+bool PieceStore::writable(uint32_t index, size_t len) const {
+    const uint32_t need = pieceLength(index);
+    return !seeder_ && need != 0 && len == need;
+}
+
+bool PieceStore::writePiece(uint32_t index, const uint8_t* buf, size_t len) {
+    P2P_SPAN("writePiece");
+    return writable(index, len) && storePiece(index, buf, len);
+}
+
+void PieceStore::readPieceAsync(uint32_t index, DiskIO::ReadCallback cb) {
+    auto piece = readPiece(index);
+    if (piece) cb(true, piece->data(), piece->size());
+    else cb(false, nullptr, 0);
+}
+
+void PieceStore::writePieceAsync(uint32_t index, const uint8_t* buf, size_t len, DiskIO::WriteCallback cb) {
+    cb(writePiece(index, buf, len));
+}
+
+void PieceStore::writeRunAsync(uint32_t firstIndex, const std::vector<IoSlice>& pieces, DiskIO::WriteCallback cb) {
+    for (size_t i = 0; i < pieces.size(); i++) {
+        if (!writable(firstIndex + static_cast<uint32_t>(i), pieces[i].len)) {
+            cb(false);
+            return;
+        }
+    }
+    bool ok = true;
+    for (size_t i = 0; i < pieces.size(); i++) {
+        ok = writePiece(firstIndex + static_cast<uint32_t>(i), pieces[i].data, pieces[i].len) && ok;
+    }
+    cb(ok);
+}
+
+void PieceStore::syncAsync(DiskIO::WriteCallback cb) {
+    cb(true);
+}
+
+bool PieceStore::readBlock(uint32_t index, std::vector<uint8_t>& block) const {
+    auto piece = readPiece(index);
+    if (!piece) return false;
+    block.assign(pieceSize_, 0);
+    std::copy(piece->begin(), piece->end(), block.begin());
+    return true;
+}
+
+bool PieceStore::encodeStripe(uint32_t stripe) {
+    P2P_SPAN("encodeStripe");
+    const std::vector<uint32_t> members = erasure_.members(stripe);
+    const uint32_t k = erasure_.sourceCount(stripe);
+    std::vector<std::vector<uint8_t>> blocks(members.size());
+    for (uint32_t i = 0; i < k; i++) {
+        if (!readBlock(members[i], blocks[i])) return false;
+    }
+
+    std::vector<const uint8_t*> source;
+    std::vector<uint8_t*> parity;
+    for (uint32_t i = 0; i < k; i++) source.push_back(blocks[i].data());
+    for (size_t j = k; j < members.size(); j++) {
+        blocks[j].resize(pieceSize_);
+        parity.push_back(blocks[j].data());
+    }
+    ReedSolomon(k, erasure_.stripeParity).encode(source, parity, pieceSize_);
+    for (size_t j = k; j < members.size(); j++) {
+        if (!storePiece(members[j], blocks[j].data(), pieceSize_)) return false;
+    }
+    return true;
+}
+
+bool PieceStore::decodeStripe(uint32_t stripe, const std::vector<uint32_t>& held) {
+    P2P_SPAN("decodeStripe");
+    const std::vector<uint32_t> members = erasure_.members(stripe);
+    const uint32_t k = erasure_.sourceCount(stripe);
+    if (held.size() < k) return false;
+
+    // any k of the pieces held will do, as rows of the stacked generator
+    std::vector<std::vector<uint8_t>> blocks(members.size());
+    std::vector<bool> present(members.size(), false);
+    std::vector<unsigned> rows;
+    std::vector<const uint8_t*> given;
+    for (uint32_t index : held) {
+        const size_t row = std::find(members.begin(), members.end(), index) - members.begin();
+        if (row == members.size() || present[row]) return false;
+        if (!readBlock(index, blocks[row])) return false;
+        present[row] = true;
+        if (rows.size() < k) {
+            rows.push_back(static_cast<unsigned>(row));
+            given.push_back(blocks[row].data());
+        }
+    }
+
+    std::vector<unsigned> wanted;
+    std::vector<uint8_t*> out;
+    for (uint32_t i = 0; i < k; i++) {
+        if (present[i]) continue;
+        blocks[i].resize(pieceSize_);
+        wanted.push_back(i);
+        out.push_back(blocks[i].data());
+    }
+    ReedSolomon code(k, erasure_.stripeParity);
+    if (!code.decode(rows, given, wanted, out, pieceSize_)) return false;
+    for (unsigned i : wanted) {
+        if (!storePiece(members[i], blocks[i].data(), pieceLength(members[i]))) return false;
+    }
+
+    // with every source piece known, the missing parity is encoded again so we can serve the whole stripe
+    std::vector<const uint8_t*> source;
+    std::vector<uint8_t*> parity;
+    std::vector<std::vector<uint8_t>> fresh(members.size() - k, std::vector<uint8_t>(pieceSize_));
+    for (uint32_t i = 0; i < k; i++) source.push_back(blocks[i].data());
+    for (auto& block : fresh) parity.push_back(block.data());
+    code.encode(source, parity, pieceSize_);
+    for (size_t j = k; j < members.size(); j++) {
+        if (present[j]) continue;
+        if (!storePiece(members[j], fresh[j - k].data(), pieceSize_)) return false;
+    }
+    return true;
+}
+
+namespace {
+
+// pieces in RAM, least recently used first out once the budget is spent
+// a seeder's own pieces are loaded from its file at init and never dropped
+class MemoryStore : public PieceStore {
+public:
+    explicit MemoryStore(const PieceStoreOptions& options)
+        : PieceStore(options.fileSize, options.pieceSize, options.seeder),
+          seedPath_(options.workDir / ("peer_" + std::to_string(options.peerId)) / options.fileName),
+          budget_(options.memoryBytes) {}
+
+    const char* name() const override {
+        return "memory";
+    }
+
+    bool init() override {
+        if (!seeder_) return true;
+        if (fileSize_ > budget_) {
+            P2P_ERROR("The memory store holds " << budget_ << " bytes, too few for the " << fileSize_ << " we seed");
+            return false;
+        }
+        std::ifstream in(seedPath_, std::ios::binary);
+        if (!in) {
+            P2P_ERROR("Could not open " << seedPath_ << " to seed from memory");
+            return false;
+        }
+        const uint32_t pieces = static_cast<uint32_t>((fileSize_ + pieceSize_ - 1) / pieceSize_);
+        for (uint32_t index = 0; index < pieces; index++) {
+            auto bytes = std::make_shared<std::vector<uint8_t>>(pieceLength(index));
+            in.read(reinterpret_cast<char*>(bytes->data()), static_cast<std::streamsize>(bytes->size()));
+            if (!in) return false;
+            std::lock_guard<std::mutex> lock(mutex_);
+            insert(index, std::move(bytes), true);
+        }
+        return true;
+    }
+
+    std::optional<std::vector<uint8_t>> readPiece(uint32_t index) const override {
+        auto bytes = lookup(index);
+        if (!bytes) return std::nullopt;
+        return *bytes;
+    }
+
+    // the callback gets the stored bytes, a reference keeps them alive through an eviction
+    void readPieceAsync(uint32_t index, DiskIO::ReadCallback cb) override {
+        P2P_SPAN("readPieceAsync");
+        auto bytes = lookup(index);
+        if (bytes) cb(true, bytes->data(), bytes->size());
+        else cb(false, nullptr, 0);
+    }
+
+    // nothing to put in place, a relay serves from memory until it exits
+    bool finalize() override {
+        return true;
+    }
+
+    bool holds(uint32_t index) const override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return pieces_.count(index) != 0;
+    }
+
+protected:
+    bool storePiece(uint32_t idx, const uint8_t* buf, size_t len) override {
+        auto bytes = std::make_shared<std::vector<uint8_t>>(buf, buf + len);
+        std::lock_guard<std::mutex> lock(mutex_);
+        return insert(idx, std::move(bytes), false);
+    }
+
+private:
+    struct Entry {
+        std::shared_ptr<const std::vector<uint8_t>> bytes;
+        std::list<uint32_t>::iterator age;      // end() for a pinned piece
+    };
+
+    // under mutex_, false if the piece cannot fit even with every unpinned piece gone
+    bool insert(uint32_t index, std::shared_ptr<const std::vector<uint8_t>> bytes, bool pinned) {
+        drop(index);
+        size_t dropped = 0;
+        while (used_ + bytes->size() > budget_ && !lru_.empty()) {
+            drop(lru_.front());
+            dropped++;
+        }
+        if (dropped) P2P_DEBUG("Memory store dropped " << dropped << " pieces to make room for piece " << index);
+        if (used_ + bytes->size() > budget_) {
+            P2P_ERROR("Memory store has no room for piece " << index << ", " << used_ << " of " << budget_ << " bytes are pinned");
+            return false;
+        }
+        used_ += bytes->size();
+        Entry entry{std::move(bytes), lru_.end()};
+        if (!pinned) entry.age = lru_.insert(lru_.end(), index);
+        pieces_[index] = std::move(entry);
+        return true;
+    }
+
+    void drop(uint32_t index) {
+        auto it = pieces_.find(index);
+        if (it == pieces_.end()) return;
+        used_ -= it->second.bytes->size();
+        if (it->second.age != lru_.end()) lru_.erase(it->second.age);
+        pieces_.erase(it);
+    }
+
+    std::shared_ptr<const std::vector<uint8_t>> lookup(uint32_t index) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = pieces_.find(index);
+        if (it == pieces_.end()) return nullptr;
+        // a piece someone asked for is worth keeping a while longer
+        if (it->second.age != lru_.end()) lru_.splice(lru_.end(), lru_, it->second.age);
+        return it->second.bytes;
+    }
+
+    std::filesystem::path seedPath_;
+    size_t budget_;
+    mutable std::mutex mutex_;
+    std::unordered_map<uint32_t, Entry> pieces_;
+    mutable std::list<uint32_t> lru_;       // oldest first, pinned pieces are not in it
+    size_t used_ = 0;
+};
+
+// one file mapped whole, shared so writes land in the page cache the file is served from
+class Mapping {
+public:
+    ~Mapping() {
+        close();
+    }
+
+    bool open(const std::filesystem::path& path, uint64_t size, bool writable) {
+        close();
+        if (size == 0) return true;
+#ifdef _WIN32
+        // shared for delete too, so finalize can rename the file under the mapping
+        file_ = CreateFileW(path.c_str(), GENERIC_READ | (writable ? GENERIC_WRITE : 0),
+                            FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING,
+                            FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file_ == INVALID_HANDLE_VALUE) return false;
+        mapping_ = CreateFileMappingW(file_, nullptr, writable ? PAGE_READWRITE : PAGE_READONLY, 0, 0, nullptr);
+        if (!mapping_) return false;
+        data_ = static_cast<uint8_t*>(MapViewOfFile(mapping_, writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, 0));
+        if (!data_) return false;
+#else
+        int fd = ::open(path.c_str(), (writable ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+        if (fd < 0) return false;
+        struct stat info{};
+        if (fstat(fd, &info) != 0 || static_cast<uint64_t>(info.st_size) < size) {
+            ::close(fd);
+            return false;
+        }
+        void* mapped = mmap(nullptr, size, PROT_READ | (writable ? PROT_WRITE : 0), MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (mapped == MAP_FAILED) return false;
+        data_ = static_cast<uint8_t*>(mapped);
+#endif
+        size_ = size;
+        writable_ = writable;
+        return true;
+    }
+
+    void close() {
+#ifdef _WIN32
+        if (data_) UnmapViewOfFile(data_);
+        if (mapping_) CloseHandle(mapping_);
+        if (file_ && file_ != INVALID_HANDLE_VALUE) CloseHandle(file_);
+        mapping_ = nullptr;
+        file_ = nullptr;
+#else
+        if (data_) munmap(data_, size_);
+#endif
+        data_ = nullptr;
+        size_ = 0;
+        writable_ = false;
+    }
+
+    // written pages out to the file
+    bool sync() const {
+        if (!data_ || !writable_) return true;
+#ifdef _WIN32
+        return FlushViewOfFile(data_, 0) && FlushFileBuffers(file_);
+#else
+        return msync(data_, size_, MS_SYNC) == 0;
+#endif
+    }
+
+    uint8_t* at(uint64_t offset, size_t len) const {
+        if (!data_ || offset > size_ || len > size_ - offset) return nullptr;
+        return data_ + offset;
+    }
+    bool writable() const {
+        return writable_;
+    }
+
+private:
+    uint8_t* data_ = nullptr;
+    uint64_t size_ = 0;
+    bool writable_ = false;
+#ifdef _WIN32
+    void* file_ = nullptr;
+    void* mapping_ = nullptr;
+#endif
+};
+
+// the file store's files, read and written through mappings instead of the disk backend
+class MappedStore : public FileHandling {
+public:
+    using FileHandling::FileHandling;
+
+    const char* name() const override {
+        return "mmap";
+    }
+
+    bool init() override {
+        if (!FileHandling::init()) return false;
+        // a seeder's file is never written, the parity always is
+        if (!source_.open(dataPath(), fileSize_, !seeder_)) {
+            P2P_ERROR("Could not map " << dataPath());
+            return false;
+        }
+        if (erasure_.enabled()) {
+            const uint64_t paritySize = uint64_t(erasure_.stripes()) * erasure_.stripeParity * pieceSize_;
+            if (!parity_.open(parityPath_, paritySize, true)) {
+                P2P_ERROR("Could not map " << parityPath_);
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // no disk backend, pieces are copied in and out of the page cache on the caller's thread
+    void attachDiskIO(std::shared_ptr<DiskIO> io) override {
+        (void) io;
+    }
+
+    std::optional<std::vector<uint8_t>> readPiece(uint32_t index) const override {
+        P2P_SPAN("readPiece");
+        const uint32_t len = pieceLength(index);
+        const uint8_t* bytes = len ? mapOf(index).at(offset(index), len) : nullptr;
+        if (!bytes) return std::nullopt;
+        return std::vector<uint8_t>(bytes, bytes + len);
+    }
+
+    // straight out of the mapping, the callback copies what it keeps
+    void readPieceAsync(uint32_t index, DiskIO::ReadCallback cb) override {
+        P2P_SPAN("readPieceAsync");
+        const uint32_t len = pieceLength(index);
+        const uint8_t* bytes = len ? mapOf(index).at(offset(index), len) : nullptr;
+        if (bytes) cb(true, bytes, len);
+        else cb(false, nullptr, 0);
+    }
+
+    void syncAsync(DiskIO::WriteCallback cb) override {
+        P2P_SPAN("syncAsync");
+        const bool ok = source_.sync();
+        cb(parity_.sync() && ok);
+    }
+
+protected:
+    bool storePiece(uint32_t idx, const uint8_t* buf, size_t len) override {
+        const Mapping& map = mapOf(idx);
+        uint8_t* bytes = map.writable() ? map.at(offset(idx), len) : nullptr;
+        if (!bytes) return false;
+        std::memcpy(bytes, buf, len);
+        return true;
+    }
+
+private:
+    const Mapping& mapOf(uint32_t idx) const {
+        return isParity(idx) ? parity_ : source_;
+    }
+
+    // the mapping outlives finalize's rename, it follows the file rather than the name
+    Mapping source_;
+    Mapping parity_;
+};
+
+}
+
+std::unique_ptr<PieceStore> PieceStore::create(const PieceStoreOptions& options) {
+    if (options.backend == "memory") return std::make_unique<MemoryStore>(options);
+    if (options.backend == "mmap") {
+        return std::make_unique<MappedStore>(options.workDir, options.peerId, options.fileName,
+                                             options.fileSize, options.pieceSize, options.seeder);
+    }
+    if (options.backend != "file") P2P_ERROR("Unknown StorageBackend " << options.backend << ", using file");
+    return std::make_unique<FileHandling>(options.workDir, options.peerId, options.fileName,
+                                          options.fileSize, options.pieceSize, options.seeder);
+}
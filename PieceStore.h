@@ -0,0 +1,93 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <optional>
+#include <filesystem>
+#include <memory>
+#include <cstdint>
+#include <cstddef>
+#include "DiskIO.h"
+#include "ErasureCode.h"
+
+// what a swarm's pieces are kept in, chosen with StorageBackend in Common.cfg
+struct PieceStoreOptions {
+    std::string backend = "file";       // file, memory or mmap
+    std::filesystem::path workDir;      // pieces go in <workDir>/peer_<id>/<fileName>
+    int peerId = 0;
+    std::string fileName;
+    uint64_t fileSize = 0;
+    uint32_t pieceSize = 0;
+    bool seeder = false;                // starts with the whole file, which is never written
+    size_t memoryBytes = 256 << 20;     // the memory store's budget
+};
+
+// the piece API, 0-based indices that take in parity pieces once erasure coding is enabled
+//     file    the .part file, renamed to the file once complete, I/O through the DiskIO backend
+//     memory  pieces in RAM up to memoryBytes, the least recently used are dropped to make room,
+//             for relays that forward a file and never keep it, nothing is left on disk
+//     mmap    the same files as file, written and served through a shared mapping with no syscalls
+// the async calls run inline unless a backend does better, completions may come on any thread
+class PieceStore {
+public:
+    // unknown backends fall back to file
+    static std::unique_ptr<PieceStore> create(const PieceStoreOptions& options);
+
+    PieceStore(uint64_t fileSize, uint32_t pieceSize, bool seeder);
+    virtual ~PieceStore() = default;
+    PieceStore(const PieceStore&) = delete;
+    PieceStore& operator=(const PieceStore&) = delete;
+
+    virtual const char* name() const = 0;
+    // call enableErasureCoding first, false if the store could not be set up
+    virtual bool init() = 0;
+
+    virtual uint32_t pieceLength(uint32_t index) const;
+    // false for a seeder, a wrong length or a failed write
+    virtual bool writePiece(uint32_t index, const uint8_t* buf, size_t len);
+    virtual std::optional<std::vector<uint8_t>> readPiece(uint32_t index) const = 0;
+    // every piece is in, the file store puts the file in place
+    virtual bool finalize() = 0;
+    // false once a piece we had is gone again, only the memory store ever drops one
+    virtual bool holds(uint32_t index) const {
+        (void) index;
+        return true;
+    }
+    // the file the source pieces are in, for a same-host peer to map, empty when they are not in one
+    virtual std::filesystem::path dataPath() const {
+        return {};
+    }
+
+    virtual void attachDiskIO(std::shared_ptr<DiskIO> io) {
+        (void) io;
+    }
+    virtual void readPieceAsync(uint32_t index, DiskIO::ReadCallback cb);
+    virtual void writePieceAsync(uint32_t index, const uint8_t* buf, size_t len, DiskIO::WriteCallback cb);
+    // consecutive pieces starting at firstIndex
+    virtual void writeRunAsync(uint32_t firstIndex, const std::vector<IoSlice>& pieces, DiskIO::WriteCallback cb);
+    // flush written pieces to stable storage
+    virtual void syncAsync(DiskIO::WriteCallback cb);
+
+    // coded pieces, see ErasureLayout, call before init
+    void enableErasureCoding(const ErasureLayout& layout);
+    // works out the stripe's parity from its source pieces and writes it, a seeder does every stripe at startup
+    bool encodeStripe(uint32_t stripe);
+    // rebuilds and writes every piece of the stripe missing from held, which lists at least
+    // as many of its pieces as it has source pieces, false if a read or write failed
+    bool decodeStripe(uint32_t stripe, const std::vector<uint32_t>& held);
+
+protected:
+    uint64_t fileSize_{};
+    uint32_t pieceSize_{};
+    bool seeder_{};
+    ErasureLayout erasure_;
+
+    bool isParity(uint32_t idx) const {
+        return erasure_.enabled() && erasure_.isParity(idx);
+    }
+    // no seeder or length check, a seeder writes its own parity
+    virtual bool storePiece(uint32_t idx, const uint8_t* buf, size_t len) = 0;
+    // a piece's bytes, padded with zeros to a whole piece for the coder
+    bool readBlock(uint32_t idx, std::vector<uint8_t>& block) const;
+    // the length checks every write path makes
+    bool writable(uint32_t index, size_t len) const;
+};
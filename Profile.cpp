@@ -0,0 +1,222 @@
+#include "Profile.h"
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace profile {
+
+std::atomic<uint32_t> sampleEvery{0};
+
+namespace {
+
+struct Event {
+    const char* name;
+    uint64_t start;     // nanoseconds since the process epoch
+    uint64_t end;
+};
+
+// one thread's spans, the lock is only ever contended by an export
+struct ThreadBuffer {
+    std::mutex mutex;
+    std::vector<Event> ring;
+    size_t next = 0;
+    bool wrapped = false;
+    uint32_t tid = 0;
+    std::string name;
+    bool alive = true;
+};
+
+struct Registry {
+    std::mutex mutex;
+    std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+    uint32_t nextTid = 1;
+};
+
+Registry& registry() {
+    static Registry instance;
+    return instance;
+}
+
+const std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+
+uint64_t now() {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - epoch).count());
+}
+
+// what a thread knows about itself, its buffer is made on its first recorded span
+struct ThreadState {
+    std::shared_ptr<ThreadBuffer> buffer;
+    std::string name;
+    uint32_t depth = 0;
+    // xorshift, a counter would keep sampling the same phase of a loop that opens several spans
+    uint32_t random = 0;
+    bool sampling = false;
+
+    ~ThreadState() {
+        // an exited thread's spans stay until the next export has written them
+        if (!buffer) return;
+        std::lock_guard<std::mutex> lock(buffer->mutex);
+        buffer->alive = false;
+    }
+
+    ThreadBuffer& get() {
+        if (!buffer) {
+            buffer = std::make_shared<ThreadBuffer>();
+            buffer->ring.resize(kEventsPerThread);
+            buffer->name = name;
+            Registry& r = registry();
+            std::lock_guard<std::mutex> lock(r.mutex);
+            buffer->tid = r.nextTid++;
+            if (buffer->name.empty()) buffer->name = "thread " + std::to_string(buffer->tid);
+            r.buffers.push_back(buffer);
+        }
+        return *buffer;
+    }
+};
+
+thread_local ThreadState self;
+
+void appendEscaped(std::string& out, const std::string& text) {
+    for (char c : text) {
+        if (c == '"' || c == '\\') out += '\\';
+        if (static_cast<unsigned char>(c) >= 0x20) out += c;
+    }
+}
+
+}
+
+void setSampling(uint32_t every) {
+    sampleEvery.store(every, std::memory_order_relaxed);
+}
+
+void nameThread(std::string name) {
+    if (self.buffer) {
+        std::lock_guard<std::mutex> lock(self.buffer->mutex);
+        self.buffer->name = name;
+    }
+    self.name = std::move(name);
+}
+
+void Span::open(const char* name) {
+    entered_ = true;
+    // nested spans go with the decision made for the outermost one
+    if (self.depth++ == 0) {
+        const uint32_t every = sampleEvery.load(std::memory_order_relaxed);
+        if (every <= 1) {
+            self.sampling = every == 1;
+        }
+        else {
+            uint32_t x = self.random ? self.random : static_cast<uint32_t>(reinterpret_cast<uintptr_t>(&self)) | 1;
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            self.random = x;
+            self.sampling = x % every == 0;
+        }
+    }
+    if (self.sampling) {
+        name_ = name;
+        start_ = now();
+    }
+}
+
+void Span::close() {
+    self.depth--;
+    if (!name_) return;
+    const uint64_t end = now();
+    ThreadBuffer& buffer = self.get();
+    std::lock_guard<std::mutex> lock(buffer.mutex);
+    buffer.ring[buffer.next] = Event{name_, start_, end};
+    if (++buffer.next == buffer.ring.size()) {
+        buffer.next = 0;
+        buffer.wrapped = true;
+    }
+}
+
+size_t heldSpans() {
+    Registry& r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    size_t held = 0;
+    for (const auto& buffer : r.buffers) {
+        std::lock_guard<std::mutex> bufferLock(buffer->mutex);
+        held += buffer->wrapped ? buffer->ring.size() : buffer->next;
+    }
+    return held;
+}
+
+void clear() {
+    Registry& r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    std::vector<std::shared_ptr<ThreadBuffer>> kept;
+    for (auto& buffer : r.buffers) {
+        std::lock_guard<std::mutex> bufferLock(buffer->mutex);
+        buffer->next = 0;
+        buffer->wrapped = false;
+        if (buffer->alive) kept.push_back(buffer);
+    }
+    r.buffers.swap(kept);
+}
+
+bool writeChromeTrace(const std::filesystem::path& path, int pid, size_t& spans) {
+    spans = 0;
+    // copied out under the locks and formatted after, so recording threads wait only for the copy
+    struct Copy {
+        uint32_t tid;
+        std::string name;
+        std::vector<Event> events;
+    };
+    std::vector<Copy> copies;
+    {
+        Registry& r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        std::vector<std::shared_ptr<ThreadBuffer>> kept;
+        for (auto& buffer : r.buffers) {
+            std::lock_guard<std::mutex> bufferLock(buffer->mutex);
+            Copy copy{buffer->tid, buffer->name, {}};
+            // oldest first
+            if (buffer->wrapped)
+                copy.events.assign(buffer->ring.begin() + buffer->next, buffer->ring.end());
+            copy.events.insert(copy.events.end(), buffer->ring.begin(), buffer->ring.begin() + buffer->next);
+            copies.push_back(std::move(copy));
+            if (buffer->alive) kept.push_back(buffer);
+        }
+        r.buffers.swap(kept);
+    }
+
+    std::FILE* file = std::fopen(path.string().c_str(), "wb");
+    if (!file) return false;
+    std::string out = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    bool first = true;
+    char number[96];
+    for (const auto& copy : copies) {
+        out += first ? "" : ",\n";
+        first = false;
+        out += "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":" + std::to_string(pid) +
+               ",\"tid\":" + std::to_string(copy.tid) + ",\"args\":{\"name\":\"";
+        appendEscaped(out, copy.name);
+        out += "\"}}";
+        for (const Event& event : copy.events) {
+            // microseconds with the nanoseconds kept as decimals
+            std::snprintf(number, sizeof(number), "\"ts\":%llu.%03llu,\"dur\":%llu.%03llu",
+                          static_cast<unsigned long long>(event.start / 1000), static_cast<unsigned long long>(event.start % 1000),
+                          static_cast<unsigned long long>((event.end - event.start) / 1000),
+                          static_cast<unsigned long long>((event.end - event.start) % 1000));
+            out += ",\n{\"ph\":\"X\",\"cat\":\"p2p\",\"name\":\"";
+            appendEscaped(out, event.name);
+            out += "\",\"pid\":" + std::to_string(pid) + ",\"tid\":" + std::to_string(copy.tid) + "," + number + "}";
+            spans++;
+        }
+        if (out.size() > (1 << 20)) {
+            std::fwrite(out.data(), 1, out.size(), file);
+            out.clear();
+        }
+    }
+    out += "\n]}\n";
+    std::fwrite(out.data(), 1, out.size(), file);
+    return std::fclose(file) == 0;
+}
+
+}
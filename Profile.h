@@ -0,0 +1,71 @@
+#pragma once
+#include <string>
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <filesystem>
+
+// timing spans around the hot paths, for finding where a slow transfer spends its time
+//     void PeerProcess::handlePiece(...) {
+//         P2P_SPAN("handlePiece");
+// a span is timed on the monotonic clock and kept in a ring owned by its thread, the last
+// kEventsPerThread of them per thread are written out on demand as a Chrome trace
+// (chrome://tracing or ui.perfetto.dev), see profile in the control socket help
+// off by default, where a span costs one relaxed load, ProfileSampling in Swarms.cfg
+// records about one in every N outermost spans, picked at random, with every span nested inside it
+// P2P_PROFILE=0 compiles them out
+namespace profile {
+
+constexpr size_t kEventsPerThread = 1 << 15;
+
+// 0 is off, 1 records every span
+extern std::atomic<uint32_t> sampleEvery;
+
+inline bool enabled() {
+    return sampleEvery.load(std::memory_order_relaxed) != 0;
+}
+void setSampling(uint32_t every);
+
+// the calling thread's name in the trace, cheap, nothing is allocated until it records a span
+void nameThread(std::string name);
+
+// every span held, as Chrome trace event JSON with pid as the process id, false if the file
+// could not be written, spans counts what went in
+bool writeChromeTrace(const std::filesystem::path& path, int pid, size_t& spans);
+// spans held across every thread
+size_t heldSpans();
+void clear();
+
+class Span {
+public:
+    explicit Span(const char* name) {
+        if (enabled()) open(name);
+    }
+    ~Span() {
+        if (entered_) close();
+    }
+    Span(const Span&) = delete;
+    Span& operator=(const Span&) = delete;
+
+private:
+    void open(const char* name);
+    void close();
+
+    const char* name_ = nullptr;    // null unless this one is sampled
+    uint64_t start_ = 0;
+    bool entered_ = false;
+};
+
+}
+
+#ifndef P2P_PROFILE
+#define P2P_PROFILE 1
+#endif
+
+#if P2P_PROFILE
+#define P2P_SPAN_JOIN2(a, b) a##b
+#define P2P_SPAN_JOIN(a, b) P2P_SPAN_JOIN2(a, b)
+#define P2P_SPAN(name) profile::Span P2P_SPAN_JOIN(profile_span_, __LINE__)(name)
+#else
+#define P2P_SPAN(name) do {} while (0)
+#endif
@@ -0,0 +1,25 @@
+#include "RateEstimator.h"
+#include <algorithm>
+#include <cmath>
+
+RateEstimator::RateEstimator(std::chrono::milliseconds timeConstant)
+    : timeConstant_(std::max(0.001, timeConstant.count() / 1000.0)) {}
+
+void RateEstimator::sample(uint64_t totalBytes, Clock::time_point now) {
+    // the first sample only sets the starting point
+    if (lastSample_ == Clock::time_point{}) {
+        lastSample_ = now;
+        lastTotal_ = totalBytes;
+        return;
+    }
+    const double dt = std::chrono::duration<double>(now - lastSample_).count();
+    if (dt <= 0) return;
+
+    const double instant = static_cast<double>(totalBytes - lastTotal_) / dt;
+    // weight by elapsed time, so uneven sampling still decays at the same speed
+    const double alpha = 1.0 - std::exp(-dt / timeConstant_);
+    rate_ += alpha * (instant - rate_);
+
+    lastSample_ = now;
+    lastTotal_ = totalBytes;
+}
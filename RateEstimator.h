@@ -0,0 +1,24 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+
+// smoothed transfer rate of one connection in one direction
+// fed the running byte total every so often, each sample is the rate since the last one
+// and is folded into an exponentially weighted average with the given time constant
+class RateEstimator {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    explicit RateEstimator(std::chrono::milliseconds timeConstant = std::chrono::seconds(5));
+
+    void sample(uint64_t totalBytes, Clock::time_point now = Clock::now());
+    double bytesPerSecond() const {
+        return rate_;
+    }
+
+private:
+    double timeConstant_;   // seconds
+    double rate_ = 0;
+    uint64_t lastTotal_ = 0;
+    Clock::time_point lastSample_{};
+};
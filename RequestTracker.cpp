@@ -0,0 +1,213 @@
+#include "RequestTracker.h"
+#include <algorithm>
+
+namespace {
+
+// a request may take this many times longer than the peer's rate says it should
+constexpr double kSlack = 3.0;
+// weight of the newest throughput sample
+constexpr double kRateAlpha = 0.3;
+
+}
+
+RequestTracker::RequestTracker(RequestPolicy policy) : policy_(policy) {}
+
+bool RequestTracker::add(int piece, int peerId, size_t bytes, bool duplicate) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto existing = requests_.find(piece);
+    if (existing != requests_.end()) {
+        if (!duplicate) return false;
+        for (const auto& request : existing->second) {
+            if (request.peerId == peerId) return false;
+        }
+    }
+
+    PeerStats& stats = peers_[peerId];
+    const auto now = Clock::now();
+    // everything already queued at this peer comes out ahead of this piece
+    const auto timeout = timeoutFor(stats, bytes * (stats.outstanding + 1));
+    requests_[piece].push_back(Request{peerId, now, now + timeout});
+    if (stats.outstanding++ == 0 && stats.waitingSince == Clock::time_point{}) stats.waitingSince = now;
+    return true;
+}
+
+bool RequestTracker::isRequested(int piece) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return requests_.count(piece) != 0;
+}
+
+bool RequestTracker::isRequestedFrom(int piece, int peerId) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = requests_.find(piece);
+    if (it == requests_.end()) return false;
+    for (const auto& request : it->second) {
+        if (request.peerId == peerId) return true;
+    }
+    return false;
+}
+
+size_t RequestTracker::piecesRequested() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return requests_.size();
+}
+
+size_t RequestTracker::outstanding(int peerId) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = peers_.find(peerId);
+    return it == peers_.end() ? 0 : it->second.outstanding;
+}
+
+size_t RequestTracker::window(int peerId) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = peers_.find(peerId);
+    if (it != peers_.end() && it->second.snubbed) return 1;
+    return std::max<size_t>(1, policy_.window);
+}
+
+void RequestTracker::setWindow(size_t window) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    policy_.window = window;
+}
+
+bool RequestTracker::isSnubbed(int peerId) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = peers_.find(peerId);
+    return it != peers_.end() && it->second.snubbed;
+}
+
+std::vector<int> RequestTracker::received(int piece, int peerId, size_t bytes) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const auto now = Clock::now();
+
+    std::vector<int> others;
+    auto it = requests_.find(piece);
+    if (it != requests_.end()) {
+        // it may have been re-requested elsewhere, whoever holds a request is done with it
+        for (const auto& request : it->second) {
+            auto holder = peers_.find(request.peerId);
+            if (holder != peers_.end() && holder->second.outstanding > 0) holder->second.outstanding--;
+            if (request.peerId != peerId) others.push_back(request.peerId);
+        }
+        requests_.erase(it);
+    }
+
+    // measure from the later of the last delivery and the oldest thing they owed us
+    PeerStats& stats = peers_[peerId];
+    Clock::time_point from = std::max(stats.lastReceived, stats.waitingSince);
+    if (from != Clock::time_point{} && now > from) {
+        const double seconds = std::chrono::duration<double>(now - from).count();
+        const double sample = static_cast<double>(bytes) / seconds;
+        stats.bytesPerSecond = stats.bytesPerSecond == 0 ? sample
+                             : kRateAlpha * sample + (1 - kRateAlpha) * stats.bytesPerSecond;
+    }
+    stats.lastReceived = now;
+    stats.waitingSince = stats.outstanding > 0 ? now : Clock::time_point{};
+    stats.snubbed = false;
+    return others;
+}
+
+std::vector<int> RequestTracker::cancel(int piece) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<int> holders;
+    auto it = requests_.find(piece);
+    if (it == requests_.end()) return holders;
+    for (const auto& request : it->second) {
+        auto holder = peers_.find(request.peerId);
+        if (holder != peers_.end() && holder->second.outstanding > 0 && --holder->second.outstanding == 0)
+            holder->second.waitingSince = Clock::time_point{};
+        holders.push_back(request.peerId);
+    }
+    requests_.erase(it);
+    return holders;
+}
+
+bool RequestTracker::refused(int piece, int peerId) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = requests_.find(piece);
+    if (it == requests_.end()) return true;
+    auto& pieceRequests = it->second;
+    auto request = std::find_if(pieceRequests.begin(), pieceRequests.end(),
+                                [peerId](const Request& r) { return r.peerId == peerId; });
+    if (request == pieceRequests.end()) return false;
+    pieceRequests.erase(request);
+    // an answer, if not the one we wanted, so it does not count towards a snub
+    auto stats = peers_.find(peerId);
+    if (stats != peers_.end() && stats->second.outstanding > 0 && --stats->second.outstanding == 0)
+        stats->second.waitingSince = Clock::time_point{};
+    if (!pieceRequests.empty()) return false;
+    requests_.erase(it);
+    return true;
+}
+
+std::vector<int> RequestTracker::releasePeer(int peerId) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<int> released;
+    for (auto it = requests_.begin(); it != requests_.end();) {
+        auto& pieceRequests = it->second;
+        pieceRequests.erase(std::remove_if(pieceRequests.begin(), pieceRequests.end(),
+                                           [peerId](const Request& r) { return r.peerId == peerId; }),
+                            pieceRequests.end());
+        if (pieceRequests.empty()) {
+            released.push_back(it->first);
+            it = requests_.erase(it);
+        }
+        else {
+            ++it;
+        }
+    }
+    auto stats = peers_.find(peerId);
+    if (stats != peers_.end()) {
+        stats->second.outstanding = 0;
+        // being choked is not being snubbed
+        stats->second.waitingSince = Clock::time_point{};
+    }
+    return released;
+}
+
+void RequestTracker::forgetPeer(int peerId) {
+    releasePeer(peerId);
+    std::lock_guard<std::mutex> lock(mutex_);
+    peers_.erase(peerId);
+}
+
+RequestTracker::Tick RequestTracker::expire() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const auto now = Clock::now();
+    Tick tick;
+
+    for (auto it = requests_.begin(); it != requests_.end();) {
+        auto& pieceRequests = it->second;
+        for (auto r = pieceRequests.begin(); r != pieceRequests.end();) {
+            if (now >= r->deadline) {
+                tick.expired.emplace_back(it->first, r->peerId);
+                auto stats = peers_.find(r->peerId);
+                if (stats != peers_.end() && stats->second.outstanding > 0) stats->second.outstanding--;
+                r = pieceRequests.erase(r);
+            }
+            else {
+                ++r;
+            }
+        }
+        if (pieceRequests.empty()) it = requests_.erase(it);
+        else ++it;
+    }
+
+    // waitingSince survives an expiry, so a peer that never answers is still caught
+    for (auto& [peerId, stats] : peers_) {
+        if (stats.snubbed || stats.waitingSince == Clock::time_point{}) continue;
+        if (now - stats.waitingSince >= policy_.snubTimeout) {
+            stats.snubbed = true;
+            tick.snubbed.push_back(peerId);
+        }
+    }
+    return tick;
+}
+
+RequestTracker::Clock::duration RequestTracker::timeoutFor(const PeerStats& stats, size_t bytes) const {
+    // no rate yet, give them a few times the floor
+    if (stats.bytesPerSecond <= 0) return std::min<Clock::duration>(policy_.minTimeout * 4, policy_.maxTimeout);
+
+    const auto expected = std::chrono::duration<double>(kSlack * static_cast<double>(bytes) / stats.bytesPerSecond);
+    const auto timeout = std::chrono::duration_cast<Clock::duration>(expected);
+    return std::clamp<Clock::duration>(timeout, policy_.minTimeout, policy_.maxTimeout);
+}
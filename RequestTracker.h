@@ -0,0 +1,78 @@
+#pragma once
+#include <vector>
+#include <mutex>
+#include <chrono>
+#include <unordered_map>
+#include <utility>
+#include <cstddef>
+
+// how long requests may stay outstanding and how many each peer gets
+struct RequestPolicy {
+    size_t window = 4;                              // outstanding requests per peer
+    std::chrono::milliseconds minTimeout{2000};
+    std::chrono::milliseconds maxTimeout{20000};
+    std::chrono::milliseconds snubTimeout{30000};   // nothing delivered for this long
+};
+
+// every piece request we have in flight, who it went to and when it is due
+// deadlines follow the throughput we have seen from that peer
+// a piece normally has one request, in endgame it may be asked of several peers
+class RequestTracker {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    explicit RequestTracker(RequestPolicy policy = RequestPolicy());
+
+    // false if the piece is already requested from this peer,
+    // or from anyone at all unless duplicate is set
+    bool add(int piece, int peerId, size_t bytes, bool duplicate = false);
+    bool isRequested(int piece) const;
+    bool isRequestedFrom(int piece, int peerId) const;
+    // distinct pieces with at least one request out
+    size_t piecesRequested() const;
+    size_t outstanding(int peerId) const;
+    // a snubbed peer only gets one request at a time
+    size_t window(int peerId) const;
+    // requests already out stay out, the new size shows as peers refill
+    void setWindow(size_t window);
+    bool isSnubbed(int peerId) const;
+
+    // the piece arrived, every request for it is done
+    // returns the other peers it was also asked of, so they can be cancelled
+    std::vector<int> received(int piece, int peerId, size_t bytes);
+    // we got the piece some other way, returns the peers it was asked of so they can be cancelled
+    std::vector<int> cancel(int piece);
+    // they no longer have the piece, true if nobody else was asked for it either
+    bool refused(int piece, int peerId);
+    // they choked us or went away, returns the pieces nobody else was asked for
+    std::vector<int> releasePeer(int peerId);
+    void forgetPeer(int peerId);
+
+    struct Tick {
+        std::vector<std::pair<int, int>> expired;   // (piece, peer) past its deadline
+        std::vector<int> snubbed;                   // peers newly flagged as snubbed
+    };
+    // drops overdue requests and updates snub flags
+    Tick expire();
+
+private:
+    struct Request {
+        int peerId;
+        Clock::time_point sent;
+        Clock::time_point deadline;
+    };
+    struct PeerStats {
+        size_t outstanding = 0;
+        double bytesPerSecond = 0;      // smoothed, 0 until the first piece
+        Clock::time_point lastReceived{};
+        Clock::time_point waitingSince{};   // unset while nothing is owed to us
+        bool snubbed = false;
+    };
+
+    Clock::duration timeoutFor(const PeerStats& stats, size_t bytes) const;
+
+    RequestPolicy policy_;
+    mutable std::mutex mutex_;
+    std::unordered_map<int, std::vector<Request>> requests_;   // piece -> requests
+    std::unordered_map<int, PeerStats> peers_;
+};
@@ -0,0 +1,28 @@
+#pragma once
+#include <array>
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+// FIPS 180-4 SHA-256, enough for piece hashes without pulling in a crypto library
+using Sha256Digest = std::array<uint8_t, 32>;
+
+class Sha256 {
+public:
+    Sha256();
+    void update(const uint8_t* data, size_t len);
+    Sha256Digest finish();
+
+    static Sha256Digest hash(const uint8_t* data, size_t len);
+    // 64 lowercase hex digits
+    static std::string toHex(const Sha256Digest& digest);
+    static bool fromHex(const std::string& text, Sha256Digest& digest);
+
+private:
+    void block(const uint8_t* data);
+
+    uint32_t state_[8];
+    uint8_t buffer_[64];
+    size_t buffered_ = 0;
+    uint64_t length_ = 0;
+};
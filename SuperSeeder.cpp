@@ -0,0 +1,100 @@
+#include "SuperSeeder.h"
+#include <limits>
+
+SuperSeeder::SuperSeeder(size_t numPieces)
+    : numPieces_(numPieces), holders_(numPieces, 0), offers_(numPieces, 0) {}
+
+int SuperSeeder::addPeer(int peerId) {
+    held_[peerId] = std::vector<bool>(numPieces_, false);
+    std::vector<std::pair<int, int>> offers;
+    offer(peerId, offers);
+    return offers.empty() ? -1 : offers.front().second;
+}
+
+void SuperSeeder::removePeer(int peerId) {
+    auto it = current_.find(peerId);
+    if (it != current_.end()) {
+        offers_[it->second]--;
+        current_.erase(it);
+    }
+    offered_.erase(peerId);
+
+    // what they held is no longer in the swarm through them
+    auto held = held_.find(peerId);
+    if (held == held_.end()) return;
+    for (size_t i = 0; i < numPieces_; i++) {
+        if (held->second[i] && --holders_[i] == 0) piecesSeen_--;
+    }
+    held_.erase(held);
+}
+
+std::vector<std::pair<int, int>> SuperSeeder::onBitfield(int peerId, const CompressedBitfield& theirs) {
+    std::vector<std::pair<int, int>> offers;
+    theirs.forEach([&](size_t i) {
+        if (i < numPieces_) markHeld(peerId, static_cast<int>(i), offers);
+    });
+    return offers;
+}
+
+std::vector<std::pair<int, int>> SuperSeeder::onHave(int peerId, int piece) {
+    std::vector<std::pair<int, int>> offers;
+    if (piece >= 0 && static_cast<size_t>(piece) < numPieces_) markHeld(peerId, piece, offers);
+    return offers;
+}
+
+bool SuperSeeder::mayServe(int peerId, int piece) const {
+    auto it = offered_.find(peerId);
+    return it != offered_.end() && it->second.count(piece);
+}
+
+void SuperSeeder::markHeld(int peerId, int piece, std::vector<std::pair<int, int>>& offers) {
+    auto held = held_.find(peerId);
+    if (held == held_.end() || held->second[piece]) return;
+    held->second[piece] = true;
+    if (holders_[piece]++ == 0) piecesSeen_++;
+
+    // whoever we offered this piece to has passed it on, give them a new one
+    std::vector<int> spread;
+    for (const auto& [other, offered] : current_) {
+        if (other != peerId && offered == piece) spread.push_back(other);
+    }
+    for (int other : spread) offer(other, offers);
+
+    // they finished their own offer, move on once it is known to exist elsewhere too
+    // or straight away if there is nobody else for it to spread to
+    auto mine = current_.find(peerId);
+    if (mine != current_.end() && mine->second == piece && (holders_[piece] > 1 || held_.size() == 1)) {
+        offer(peerId, offers);
+    }
+}
+
+// the piece fewest peers hold, preferring ones nobody else has been offered
+int SuperSeeder::pickPiece(int peerId) {
+    const auto& held = held_[peerId];
+    int best = -1;
+    long bestScore = std::numeric_limits<long>::max();
+    for (size_t i = 0; i < numPieces_; i++) {
+        if (held[i]) continue;
+        long score = static_cast<long>(holders_[i]) * 1024 + offers_[i];
+        if (score < bestScore) {
+            best = static_cast<int>(i);
+            bestScore = score;
+        }
+    }
+    return best;
+}
+
+void SuperSeeder::offer(int peerId, std::vector<std::pair<int, int>>& offers) {
+    auto it = current_.find(peerId);
+    if (it != current_.end()) {
+        offers_[it->second]--;
+        current_.erase(it);
+    }
+
+    int piece = pickPiece(peerId);
+    if (piece < 0) return;
+    current_[peerId] = piece;
+    offers_[piece]++;
+    offered_[peerId].insert(piece);
+    offers.emplace_back(peerId, piece);
+}
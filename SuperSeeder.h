@@ -0,0 +1,44 @@
+#pragma once
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <cstddef>
+#include "CompressedBitfield.h"
+
+// piece rationing for the initial seeder
+// each peer is offered one piece at a time, the rarest we can find, and is only
+// offered its next piece once the previous one has shown up at some other peer
+class SuperSeeder {
+public:
+    explicit SuperSeeder(size_t numPieces);
+
+    // returns the piece to advertise to a newly connected peer, or -1
+    int addPeer(int peerId);
+    void removePeer(int peerId);
+
+    // returns (peer, piece) offers to advertise as a result
+    std::vector<std::pair<int, int>> onBitfield(int peerId, const CompressedBitfield& theirs);
+    std::vector<std::pair<int, int>> onHave(int peerId, int piece);
+
+    // only pieces we offered a peer are served to it
+    bool mayServe(int peerId, int piece) const;
+
+    // every piece has been seen at some other peer, the swarm can take it from here
+    bool finished() const {
+        return piecesSeen_ == numPieces_;
+    }
+
+private:
+    void markHeld(int peerId, int piece, std::vector<std::pair<int, int>>& offers);
+    int pickPiece(int peerId);
+    void offer(int peerId, std::vector<std::pair<int, int>>& offers);
+
+    size_t numPieces_;
+    size_t piecesSeen_ = 0;
+    std::vector<int> holders_;          // peers known to hold each piece
+    std::vector<int> offers_;           // outstanding offers of each piece
+    std::unordered_map<int, std::vector<bool>> held_;
+    std::unordered_map<int, int> current_;  // peer -> piece currently offered to it
+    std::unordered_map<int, std::unordered_set<int>> offered_;
+};
@@ -0,0 +1,577 @@
+#include <winsock2.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <filesystem>
+#include <algorithm>
+#include <cstring>
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <signal.h>
+#endif
+
+// runs a whole swarm of peer processes on this machine and writes how it went to a CSV
+//     SwarmBench [--peers N] [--file-size BYTES] [--piece-size BYTES] [--port BASE]
+//                [--delay MS] [--bandwidth BYTES_PER_S] [--set KEY=VALUE]...
+//                [--peer PATH] [--dir PATH] [--csv PATH] [--label TEXT] [--timeout S] [--seed N]
+// every peer gets its own directory under --dir with a Common.cfg and PeerInfo.cfg, peer 1 seeds a
+// file generated from --seed, so the same options always give the same workload
+// peers start in id order, each once the one before has opened its control socket
+// with --delay or --bandwidth every link goes through a proxy in this process that holds each
+// direction back by the delay and paces it to the bandwidth, peers are told the proxy's port
+// one row per peer and one "all" row are appended to the CSV, which gets a header when new
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+    int peers = 4;
+    uint64_t fileSize = 20 << 20;
+    int pieceSize = 16384;
+    int basePort = 7000;
+    int delayMs = 0;
+    uint64_t bandwidth = 0;     // bytes per second each way on every link, 0 for none
+    std::vector<std::string> settings;  // extra Common.cfg lines
+    std::string peer = "./P2P_Project";
+    std::filesystem::path dir = "swarmbench";
+    std::string csv = "swarmbench.csv";
+    std::string label = "run";
+    int timeout = 300;
+    uint32_t seed = 1;
+};
+
+bool parseOptions(int argc, char* argv[], Options& options) {
+    for (int i = 1; i < argc; i++) {
+        std::string flag = argv[i];
+        if (i + 1 >= argc) return false;
+        std::string value = argv[++i];
+        try {
+            if (flag == "--peers") options.peers = std::stoi(value);
+            else if (flag == "--file-size") options.fileSize = std::stoull(value);
+            else if (flag == "--piece-size") options.pieceSize = std::stoi(value);
+            else if (flag == "--port") options.basePort = std::stoi(value);
+            else if (flag == "--delay") options.delayMs = std::stoi(value);
+            else if (flag == "--bandwidth") options.bandwidth = std::stoull(value);
+            else if (flag == "--set") {
+                std::replace(value.begin(), value.end(), '=', ' ');
+                options.settings.push_back(value);
+            }
+            else if (flag == "--peer") options.peer = value;
+            else if (flag == "--dir") options.dir = value;
+            else if (flag == "--csv") options.csv = value;
+            else if (flag == "--label") options.label = value;
+            else if (flag == "--timeout") options.timeout = std::stoi(value);
+            else if (flag == "--seed") options.seed = static_cast<uint32_t>(std::stoul(value));
+            else return false;
+        }
+        catch (const std::exception&) {
+            return false;
+        }
+    }
+    return options.peers >= 2 && options.fileSize > 0 && options.pieceSize > 0;
+}
+
+int peerId(int index) {
+    return 1001 + index;
+}
+
+// the port peer `from` dials to reach peer `to`, only lower ids are dialed
+// with shaping each such link has a proxy port of its own above the peers' ports
+int dialPort(const Options& options, int from, int to) {
+    if (options.delayMs == 0 && options.bandwidth == 0) return options.basePort + to;
+    return options.basePort + options.peers + from * options.peers + to;
+}
+
+bool writeSwarm(const Options& options) {
+    std::error_code ec;
+    std::filesystem::remove_all(options.dir, ec);
+    const std::string fileName = "bench.dat";
+
+    for (int i = 0; i < options.peers; i++) {
+        const std::filesystem::path home = options.dir / std::to_string(peerId(i));
+        std::filesystem::create_directories(home / ("peer_" + std::to_string(peerId(i))), ec);
+        if (ec) {
+            std::cerr << "Could not create " << home << ": " << ec.message() << std::endl;
+            return false;
+        }
+
+        std::ofstream common(home / "Common.cfg");
+        common << "NumberOfPreferredNeighbors 3\n"
+               << "UnchokingInterval 5\n"
+               << "OptimisticUnchokingInterval 15\n"
+               << "FileName " << fileName << "\n"
+               << "FileSize " << options.fileSize << "\n"
+               << "PieceSize " << options.pieceSize << "\n";
+        // later lines win, so these override the defaults above
+        for (const auto& line : options.settings) common << line << "\n";
+
+        // every peer has its own view: its real port for itself, the dialed port for the others
+        std::ofstream peerInfo(home / "PeerInfo.cfg");
+        for (int j = 0; j < options.peers; j++) {
+            const int port = j == i ? options.basePort + j : dialPort(options, i, j);
+            peerInfo << peerId(j) << " 127.0.0.1 " << port << " " << (j == 0 ? 1 : 0) << "\n";
+        }
+    }
+
+    // the same seed always gives the same bytes
+    std::ofstream seeded(options.dir / std::to_string(peerId(0)) / ("peer_" + std::to_string(peerId(0))) / fileName,
+                         std::ios::binary);
+    std::mt19937_64 rng(options.seed);
+    std::vector<uint64_t> block(8192);
+    for (uint64_t written = 0; written < options.fileSize;) {
+        for (auto& word : block) word = rng();
+        const uint64_t n = std::min<uint64_t>(options.fileSize - written, block.size() * sizeof(uint64_t));
+        seeded.write(reinterpret_cast<const char*>(block.data()), static_cast<std::streamsize>(n));
+        written += n;
+    }
+    return static_cast<bool>(seeded);
+}
+
+// a peer dials the lower ids once, when it starts, so each one has to be up before the next starts
+// it opens its control socket once it is listening and has connected out
+bool waitUntilUp(const Options& options, int index) {
+    const std::filesystem::path control = options.dir / std::to_string(peerId(index)) /
+                                          ("control_" + std::to_string(peerId(index)) + ".sock");
+    const Clock::time_point deadline = Clock::now() + std::chrono::seconds(10);
+    while (!std::filesystem::exists(control)) {
+        if (Clock::now() > deadline) return false;
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    return true;
+}
+
+std::filesystem::path finishedFile(const Options& options, int index) {
+    const std::string id = std::to_string(peerId(index));
+    return options.dir / id / ("peer_" + id) / "bench.dat";
+}
+
+// a connected pair of sockets, each direction delayed and paced on its own
+// a reader takes bytes off one socket as they come, a writer hands them on once they are due
+class ShapedLink {
+public:
+    ShapedLink(SOCKET a, SOCKET b, const Options& options)
+        : delay_(std::chrono::milliseconds(options.delayMs)), bandwidth_(options.bandwidth) {
+        sockets_[0] = a;
+        sockets_[1] = b;
+        for (int d = 0; d < 2; d++) {
+            threads_.emplace_back(&ShapedLink::read, this, d);
+            threads_.emplace_back(&ShapedLink::write, this, d);
+        }
+    }
+
+    ~ShapedLink() {
+        for (auto& thread : threads_) thread.join();
+        closesocket(sockets_[0]);
+        closesocket(sockets_[1]);
+    }
+
+private:
+    struct Chunk {
+        Clock::time_point due;
+        std::vector<char> bytes;
+    };
+    struct Direction {
+        std::mutex mutex;
+        std::condition_variable ready;
+        std::condition_variable space;
+        std::deque<Chunk> chunks;
+        size_t bytes = 0;
+        bool closed = false;
+    };
+
+    // about what a socket buffer holds, so a sender still feels a slow link push back
+    static constexpr size_t kMaxQueued = 256 << 10;
+
+    // direction d carries what arrives on sockets_[d] to sockets_[1 - d]
+    void read(int d) {
+        Direction& dir = directions_[d];
+        char buffer[16384];
+        while (true) {
+            int r = recv(sockets_[d], buffer, sizeof(buffer), 0);
+            std::unique_lock<std::mutex> lock(dir.mutex);
+            if (r <= 0) {
+                dir.closed = true;
+                dir.ready.notify_one();
+                return;
+            }
+            dir.chunks.push_back(Chunk{Clock::now() + delay_, std::vector<char>(buffer, buffer + r)});
+            dir.bytes += r;
+            dir.ready.notify_one();
+            dir.space.wait(lock, [&dir]() { return dir.bytes < kMaxQueued || dir.closed; });
+        }
+    }
+
+    void write(int d) {
+        Direction& dir = directions_[d];
+        SOCKET out = sockets_[1 - d];
+        // the link is free again at this time, which paces it to the bandwidth
+        Clock::time_point free = Clock::now();
+        while (true) {
+            Chunk chunk;
+            {
+                std::unique_lock<std::mutex> lock(dir.mutex);
+                dir.ready.wait(lock, [&dir]() { return dir.closed || !dir.chunks.empty(); });
+                if (dir.chunks.empty()) break;
+                chunk = std::move(dir.chunks.front());
+                dir.chunks.pop_front();
+                dir.bytes -= chunk.bytes.size();
+            }
+            dir.space.notify_one();
+            std::this_thread::sleep_until(std::max(chunk.due, free));
+            if (bandwidth_) {
+                free = std::max(chunk.due, free) + std::chrono::duration_cast<Clock::duration>(
+                    std::chrono::duration<double>(double(chunk.bytes.size()) / bandwidth_));
+            }
+            size_t sent = 0;
+            while (sent < chunk.bytes.size()) {
+                int r = send(out, chunk.bytes.data() + sent, static_cast<int>(chunk.bytes.size() - sent), 0);
+                if (r <= 0) break;
+                sent += r;
+            }
+            if (sent < chunk.bytes.size()) break;
+        }
+        {
+            // the reader may be waiting for room that will not come
+            std::lock_guard<std::mutex> lock(dir.mutex);
+            dir.closed = true;
+        }
+        dir.space.notify_one();
+        // pass the close on, the other direction finds out through its own recv
+        shutdown(out, SD_SEND);
+    }
+
+    std::chrono::milliseconds delay_;
+    uint64_t bandwidth_;
+    SOCKET sockets_[2];
+    Direction directions_[2];
+    std::vector<std::thread> threads_;
+};
+
+SOCKET listenOn(int port) {
+    SOCKET sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    BOOL opt = TRUE;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const char*)&opt, sizeof(opt));
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(sock, (SOCKADDR*)&address, sizeof(address)) == SOCKET_ERROR || listen(sock, 16) == SOCKET_ERROR) {
+        closesocket(sock);
+        return INVALID_SOCKET;
+    }
+    return sock;
+}
+
+SOCKET connectTo(int port) {
+    SOCKET sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(sock, (SOCKADDR*)&address, sizeof(address)) == SOCKET_ERROR) {
+        closesocket(sock);
+        return INVALID_SOCKET;
+    }
+    return sock;
+}
+
+// accepts on every link's proxy port and joins each connection to the peer it stands for
+class Proxy {
+public:
+    bool start(const Options& options) {
+        for (int from = 0; from < options.peers; from++) {
+            for (int to = 0; to < from; to++) {
+                SOCKET sock = listenOn(dialPort(options, from, to));
+                if (sock == INVALID_SOCKET) {
+                    std::cerr << "Could not listen on proxy port " << dialPort(options, from, to) << std::endl;
+                    return false;
+                }
+                listeners_.push_back({sock, options.basePort + to});
+            }
+        }
+        thread_ = std::thread(&Proxy::run, this, options);
+        return true;
+    }
+
+    void stop() {
+        stopRequested_ = true;
+        if (thread_.joinable()) thread_.join();
+        for (auto& listener : listeners_) closesocket(listener.sock);
+        // a link still open has peers on both ends that are gone by now
+        links_.clear();
+    }
+
+private:
+    struct Listener {
+        SOCKET sock;
+        int target;
+    };
+
+    void run(Options options) {
+        while (!stopRequested_.load()) {
+            fd_set readable;
+            FD_ZERO(&readable);
+            SOCKET highest = 0;
+            for (auto& listener : listeners_) {
+                FD_SET(listener.sock, &readable);
+                highest = std::max(highest, listener.sock);
+            }
+            timeval timeout{0, 100000};
+            if (select(static_cast<int>(highest) + 1, &readable, nullptr, nullptr, &timeout) <= 0) continue;
+
+            for (auto& listener : listeners_) {
+                if (!FD_ISSET(listener.sock, &readable)) continue;
+                SOCKET client = accept(listener.sock, nullptr, nullptr);
+                if (client == INVALID_SOCKET) continue;
+                SOCKET server = connectTo(listener.target);
+                if (server == INVALID_SOCKET) {
+                    closesocket(client);
+                    continue;
+                }
+                links_.push_back(std::make_unique<ShapedLink>(client, server, options));
+            }
+        }
+    }
+
+    std::vector<Listener> listeners_;
+    std::vector<std::unique_ptr<ShapedLink>> links_;
+    std::thread thread_;
+    std::atomic<bool> stopRequested_{false};
+};
+
+struct PeerRun {
+    int id = 0;
+    double completeSeconds = -1;    // -1 while the file is not there
+    double cpuSeconds = 0;
+    uint64_t peakRssKb = 0;
+    int exitCode = -1;
+    bool exited = false;
+    bool matches = false;
+#ifdef _WIN32
+    HANDLE process = nullptr;
+#else
+    pid_t pid = -1;
+#endif
+};
+
+bool launch(const Options& options, PeerRun& run) {
+    const std::filesystem::path home = std::filesystem::absolute(options.dir / std::to_string(run.id));
+    const std::string peer = std::filesystem::absolute(options.peer).string();
+    const std::string log = (home / "peer.log").string();
+#ifdef _WIN32
+    SECURITY_ATTRIBUTES inherit{sizeof(inherit), nullptr, TRUE};
+    HANDLE out = CreateFileA(log.c_str(), GENERIC_WRITE, FILE_SHARE_READ, &inherit, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    STARTUPINFOA startup{};
+    startup.cb = sizeof(startup);
+    startup.dwFlags = STARTF_USESTDHANDLES;
+    startup.hStdOutput = out;
+    startup.hStdError = out;
+    PROCESS_INFORMATION info{};
+    std::string command = "\"" + peer + "\" peerProcess " + std::to_string(run.id);
+    BOOL ok = CreateProcessA(nullptr, command.data(), nullptr, nullptr, TRUE, 0, nullptr,
+                             home.string().c_str(), &startup, &info);
+    CloseHandle(out);
+    if (!ok) return false;
+    CloseHandle(info.hThread);
+    run.process = info.hProcess;
+    return true;
+#else
+    pid_t pid = fork();
+    if (pid < 0) return false;
+    if (pid == 0) {
+        FILE* out = std::freopen(log.c_str(), "w", stdout);
+        if (out) dup2(fileno(stdout), fileno(stderr));
+        if (chdir(home.string().c_str()) != 0) _exit(127);
+        const std::string id = std::to_string(run.id);
+        execl(peer.c_str(), peer.c_str(), "peerProcess", id.c_str(), static_cast<char*>(nullptr));
+        _exit(127);
+    }
+    run.pid = pid;
+    return true;
+#endif
+}
+
+// collects the exit status, CPU time and peak memory of a peer that has exited
+bool reap(PeerRun& run, bool block) {
+#ifdef _WIN32
+    if (WaitForSingleObject(run.process, block ? INFINITE : 0) != WAIT_OBJECT_0) return false;
+    DWORD code = 0;
+    GetExitCodeProcess(run.process, &code);
+    run.exitCode = static_cast<int>(code);
+    FILETIME created, exited, kernel, user;
+    if (GetProcessTimes(run.process, &created, &exited, &kernel, &user)) {
+        auto seconds = [](FILETIME t) {
+            return (double(t.dwHighDateTime) * 4294967296.0 + t.dwLowDateTime) / 1e7;
+        };
+        run.cpuSeconds = seconds(kernel) + seconds(user);
+    }
+    PROCESS_MEMORY_COUNTERS memory{};
+    if (GetProcessMemoryInfo(run.process, &memory, sizeof(memory))) run.peakRssKb = memory.PeakWorkingSetSize / 1024;
+    CloseHandle(run.process);
+#else
+    int status = 0;
+    rusage usage{};
+    if (wait4(run.pid, &status, block ? 0 : WNOHANG, &usage) != run.pid) return false;
+    run.exitCode = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    run.cpuSeconds = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6
+                   + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+    run.peakRssKb = static_cast<uint64_t>(usage.ru_maxrss);
+#endif
+    run.exited = true;
+    return true;
+}
+
+void killPeer(PeerRun& run) {
+#ifdef _WIN32
+    TerminateProcess(run.process, 1);
+#else
+    ::kill(run.pid, SIGKILL);
+#endif
+}
+
+bool sameContents(const std::filesystem::path& a, const std::filesystem::path& b) {
+    std::ifstream fa(a, std::ios::binary), fb(b, std::ios::binary);
+    if (!fa || !fb) return false;
+    std::vector<char> ba(1 << 16), bb(1 << 16);
+    while (fa && fb) {
+        fa.read(ba.data(), ba.size());
+        fb.read(bb.data(), bb.size());
+        if (fa.gcount() != fb.gcount() || std::memcmp(ba.data(), bb.data(), fa.gcount()) != 0) return false;
+    }
+    return fa.eof() && fb.eof();
+}
+
+void writeCsv(const Options& options, const std::vector<PeerRun>& runs, double lastComplete) {
+    const bool fresh = !std::filesystem::exists(options.csv);
+    std::ofstream csv(options.csv, std::ios::app);
+    if (fresh) {
+        csv << "label,peers,file_bytes,piece_bytes,delay_ms,link_bytes_per_s,peer,complete_s,"
+               "throughput_bytes_per_s,cpu_s,peak_rss_kb,exit_code,ok\n";
+    }
+    auto prefix = [&]() -> std::ofstream& {
+        csv << options.label << "," << options.peers << "," << options.fileSize << "," << options.pieceSize << ","
+            << options.delayMs << "," << options.bandwidth << ",";
+        return csv;
+    };
+    csv << std::fixed << std::setprecision(3);
+
+    double cpu = 0;
+    uint64_t peakRss = 0;
+    bool allOk = true;
+    for (size_t i = 0; i < runs.size(); i++) {
+        const PeerRun& run = runs[i];
+        cpu += run.cpuSeconds;
+        peakRss = std::max(peakRss, run.peakRssKb);
+        allOk = allOk && run.matches;
+        prefix() << run.id << ",";
+        // the seeder has nothing to download
+        if (i > 0 && run.completeSeconds >= 0)
+            csv << run.completeSeconds << "," << options.fileSize / std::max(run.completeSeconds, 1e-3);
+        else
+            csv << ",";
+        csv << "," << run.cpuSeconds << "," << run.peakRssKb << "," << run.exitCode << "," << (run.matches ? 1 : 0) << "\n";
+    }
+
+    // every leecher's copy over the time until the last one had it
+    prefix() << "all,";
+    if (lastComplete >= 0)
+        csv << lastComplete << "," << double(options.fileSize) * (options.peers - 1) / std::max(lastComplete, 1e-3);
+    else
+        csv << ",";
+    csv << "," << cpu << "," << peakRss << ",," << (allOk ? 1 : 0) << "\n";
+}
+
+}
+
+int main(int argc, char* argv[]) {
+    Options options;
+    if (!parseOptions(argc, argv, options)) {
+        std::cerr << "SwarmBench [--peers N] [--file-size BYTES] [--piece-size BYTES] [--port BASE]\n"
+                     "           [--delay MS] [--bandwidth BYTES_PER_S] [--set KEY=VALUE]...\n"
+                     "           [--peer PATH] [--dir PATH] [--csv PATH] [--label TEXT] [--timeout S] [--seed N]"
+                  << std::endl;
+        return 1;
+    }
+
+    static WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 0), &wsaData)) return 1;
+
+    if (!writeSwarm(options)) return 1;
+
+    Proxy proxy;
+    const bool shaped = options.delayMs > 0 || options.bandwidth > 0;
+    if (shaped && !proxy.start(options)) return 1;
+
+    std::vector<PeerRun> runs(options.peers);
+    const Clock::time_point start = Clock::now();
+    for (int i = 0; i < options.peers; i++) {
+        runs[i].id = peerId(i);
+        if (!launch(options, runs[i])) {
+            std::cerr << "Could not start " << options.peer << std::endl;
+            for (int j = 0; j < i; j++) {
+                killPeer(runs[j]);
+                reap(runs[j], true);
+            }
+            proxy.stop();
+            return 1;
+        }
+        if (!waitUntilUp(options, i)) std::cerr << "peer " << runs[i].id << " did not come up, starting the rest anyway" << std::endl;
+    }
+    runs[0].completeSeconds = 0;
+
+    // a peer is done once its file has been renamed into place
+    const Clock::time_point deadline = start + std::chrono::seconds(options.timeout);
+    size_t running = runs.size();
+    while (running > 0 && Clock::now() < deadline) {
+        const double now = std::chrono::duration<double>(Clock::now() - start).count();
+        for (int i = 1; i < options.peers; i++) {
+            if (runs[i].completeSeconds < 0 && std::filesystem::exists(finishedFile(options, i))) {
+                runs[i].completeSeconds = now;
+                std::cout << "peer " << runs[i].id << " complete after " << std::fixed << std::setprecision(2) << now << "s" << std::endl;
+            }
+        }
+        for (auto& run : runs) {
+            if (!run.exited && reap(run, false)) running--;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    for (auto& run : runs) {
+        if (run.exited) continue;
+        std::cerr << "peer " << run.id << " still running after " << options.timeout << "s, killing it" << std::endl;
+        killPeer(run);
+        reap(run, true);
+    }
+    proxy.stop();
+
+    double lastComplete = 0;
+    for (int i = 0; i < options.peers; i++) {
+        runs[i].matches = i == 0 || sameContents(finishedFile(options, 0), finishedFile(options, i));
+        if (runs[i].completeSeconds < 0) lastComplete = -1;
+        else if (lastComplete >= 0) lastComplete = std::max(lastComplete, runs[i].completeSeconds);
+    }
+    writeCsv(options, runs, lastComplete);
+    WSACleanup();
+
+    if (lastComplete >= 0) {
+        std::cout << "swarm complete after " << std::fixed << std::setprecision(2) << lastComplete << "s, "
+                  << double(options.fileSize) * (options.peers - 1) / std::max(lastComplete, 1e-3) / 1e6
+                  << " MB/s aggregate, results in " << options.csv << std::endl;
+    }
+    return lastComplete >= 0 ? 0 : 2;
+}
@@ -0,0 +1,27 @@
+#include "Trace.h"
+#include <cstdio>
+
+namespace trace {
+
+std::atomic<int> level{Info};
+
+bool parseLevel(const std::string& name, int& out) {
+    if (name == "error") out = Error;
+    else if (name == "info") out = Info;
+    else if (name == "debug") out = Debug;
+    else if (name == "wire") out = Wire;
+    else return false;
+    return true;
+}
+
+void setLevel(int l) {
+    level.store(l, std::memory_order_relaxed);
+}
+
+// a single fwrite takes the stream's lock once, so lines from different threads don't mix
+void write(int l, std::string line) {
+    line += '\n';
+    std::fwrite(line.data(), 1, line.size(), l == Error ? stderr : stdout);
+}
+
+}
@@ -0,0 +1,51 @@
+#pragma once
+#include <string>
+#include <sstream>
+#include <atomic>
+
+// leveled diagnostics for the console, the protocol log (logger.h) is separate
+//     P2P_INFO("Peer " << ID << " connected to " << other);
+// the message is only formatted when its level is on, so it may be costly to build
+// levels above P2P_TRACE_LEVEL are compiled out, set it with -DP2P_TRACE_LEVEL=1 for
+// a quiet build, the rest are chosen at runtime with TraceLevel in Common.cfg or Swarms.cfg
+namespace trace {
+
+constexpr int Error = 0;    // something failed, always to stderr
+constexpr int Info = 1;     // startup, connections, completion
+constexpr int Debug = 2;    // choking, requests and progress for every piece
+constexpr int Wire = 3;     // every message received
+
+extern std::atomic<int> level;
+
+inline bool enabled(int l) {
+    return l <= level.load(std::memory_order_relaxed);
+}
+
+// error, info, debug or wire, false if the name is unknown
+bool parseLevel(const std::string& name, int& out);
+void setLevel(int l);
+// one line, written whole without flushing stdout
+void write(int l, std::string line);
+
+}
+
+#ifndef P2P_TRACE_LEVEL
+#define P2P_TRACE_LEVEL 3
+#endif
+
+// true if a message at this level would be written, constant false above P2P_TRACE_LEVEL
+#define P2P_TRACE_ON(l) ((l) <= P2P_TRACE_LEVEL && trace::enabled(l))
+
+#define P2P_TRACE(l, message)                       \
+    do {                                            \
+        if (P2P_TRACE_ON(l)) {                      \
+            std::ostringstream trace_stream_;       \
+            trace_stream_ << message;               \
+            trace::write(l, trace_stream_.str());   \
+        }                                           \
+    } while (0)
+
+#define P2P_ERROR(message) P2P_TRACE(trace::Error, message)
+#define P2P_INFO(message) P2P_TRACE(trace::Info, message)
+#define P2P_DEBUG(message) P2P_TRACE(trace::Debug, message)
+#define P2P_WIRE(message) P2P_TRACE(trace::Wire, message)
@@ -0,0 +1,47 @@
+#include "UploadBudget.h"
+#include <algorithm>
+
+UploadBudget::UploadBudget(uint64_t bytesPerSecond)
+    : rate_(bytesPerSecond), tokens_(static_cast<double>(bytesPerSecond)), lastRefill_(Clock::now()) {}
+
+bool UploadBudget::acquire(size_t bytes) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!cancelled_) {
+        if (rate_ == 0) return true;
+
+        const auto now = Clock::now();
+        refillLocked(now);
+        // anything left in the bucket lets the send go, the debt is repaid before the next one
+        if (tokens_ > 0) {
+            tokens_ -= static_cast<double>(bytes);
+            return true;
+        }
+        const auto wait = std::chrono::duration<double>(-tokens_ / static_cast<double>(rate_));
+        cv_.wait_for(lock, std::chrono::duration_cast<Clock::duration>(wait) + std::chrono::milliseconds(1));
+    }
+    return false;
+}
+
+void UploadBudget::setRate(uint64_t bytesPerSecond) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        refillLocked(Clock::now());
+        rate_ = bytesPerSecond;
+        tokens_ = std::min(tokens_, static_cast<double>(rate_));
+    }
+    cv_.notify_all();
+}
+
+void UploadBudget::cancel() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        cancelled_ = true;
+    }
+    cv_.notify_all();
+}
+
+void UploadBudget::refillLocked(Clock::time_point now) {
+    const double elapsed = std::chrono::duration<double>(now - lastRefill_).count();
+    lastRefill_ = now;
+    tokens_ = std::min(static_cast<double>(rate_), tokens_ + elapsed * static_cast<double>(rate_));
+}
@@ -0,0 +1,33 @@
+#pragma once
+#include <mutex>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstddef>
+
+// process-wide upload rate limit shared by every swarm
+// a token bucket refilled at the configured rate, with one second of burst
+class UploadBudget {
+public:
+    // 0 means unlimited
+    explicit UploadBudget(uint64_t bytesPerSecond = 0);
+
+    // blocks until the bytes may be sent, returns false once cancelled
+    // a request larger than the bucket is let through and paid back over time
+    bool acquire(size_t bytes);
+    void setRate(uint64_t bytesPerSecond);
+    // wakes every waiter for shutdown
+    void cancel();
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    void refillLocked(Clock::time_point now);
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    uint64_t rate_;
+    double tokens_;
+    Clock::time_point lastRefill_;
+    bool cancelled_ = false;
+};
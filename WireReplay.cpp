@@ -0,0 +1,156 @@
+#include "PeerProcess.h"
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <cstring>
+
+// feeds a recorded wire trace through one peer's message handling and choke rounds
+// without any sockets, and reports how long each kind of message took to handle
+//     WireReplay <trace file> [swarm directory]
+// the swarm directory holds the Common.cfg and PeerInfo.cfg the trace was recorded with,
+// received pieces are written into it so point it at a scratch copy
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+const char* typeName(uint8_t type) {
+    static const char* names[] = {"CHOKE", "UNCHOKE", "INTERESTED", "NOT_INTERESTED", "HAVE",
+                                  "BITFIELD", "REQUEST", "PIECE", "CANCEL", "PING", "PONG", "UPLOAD_ONLY",
+                                  "LOCAL_FILE", "LOCAL_MAPPED", "PIECE_REF", "REJECT"};
+    if (type < 16) return names[type];
+    if (type == WireTrace::kConnect) return "connect";
+    if (type == WireTrace::kDisconnect) return "disconnect";
+    return "unknown";
+}
+
+struct Timing {
+    uint64_t count = 0;
+    uint64_t ns = 0;
+
+    void add(Clock::time_point began) {
+        count++;
+        ns += std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - began).count();
+    }
+};
+
+void report(const std::string& name, const Timing& timing) {
+    if (timing.count == 0) return;
+    std::cout << std::left << std::setw(18) << name << std::right
+              << std::setw(10) << timing.count
+              << std::setw(14) << std::fixed << std::setprecision(3) << timing.ns / 1e6
+              << std::setw(12) << timing.ns / timing.count << std::endl;
+}
+
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2 || argc > 3) {
+        std::cerr << "WireReplay <trace file> [swarm directory]" << std::endl;
+        return 1;
+    }
+
+    WireTrace::Reader reader;
+    if (!reader.open(argv[1])) {
+        std::cerr << "Not a wire trace: " << argv[1] << std::endl;
+        return 1;
+    }
+
+    PeerProcess swarm(reader.selfId, argc == 3 ? argv[2] : ".");
+    if (!swarm.load()) return 1;
+
+    SharedResources shared;
+    shared.bufferPool = std::make_shared<BufferPool>(swarm.bufferClasses());
+    DiskIOOptions options;
+    options.backend = swarm.common.diskBackend;
+    options.directIO = swarm.common.directIO;
+    options.bufferSize = swarm.common.pieceSize;
+    shared.diskIO = DiskIO::create(options);
+    shared.executor = std::make_shared<Executor>(swarm.common.executorThreads);
+    swarm.startOffline(shared);
+
+    if (swarm.bitfield.getSize() != reader.numPieces) {
+        std::cerr << "Trace has " << reader.numPieces << " pieces, the swarm has " << swarm.bitfield.getSize() << std::endl;
+        swarm.stop();
+        return 1;
+    }
+
+    // choke rounds run on the trace's clock
+    const uint64_t preferredEvery = uint64_t(swarm.common.unchokingInterval) * 1000000000ull;
+    const uint64_t optimisticEvery = uint64_t(swarm.common.optimisticUnchokingInterval) * 1000000000ull;
+    uint64_t nextPreferred = preferredEvery;
+    uint64_t nextOptimistic = optimisticEvery;
+
+    Timing byType[256];
+    Timing preferredRounds, optimisticRounds;
+    uint64_t sent = 0;
+    uint64_t traceNs = 0;
+
+    WireTrace::Record record;
+    std::vector<uint8_t> recorded;
+    const Clock::time_point replayStart = Clock::now();
+    while (reader.next(record, recorded)) {
+        traceNs = record.ns;
+        while (preferredEvery && nextPreferred <= record.ns) {
+            auto began = Clock::now();
+            swarm.replayChokeRound(false);
+            preferredRounds.add(began);
+            nextPreferred += preferredEvery;
+        }
+        while (optimisticEvery && nextOptimistic <= record.ns) {
+            auto began = Clock::now();
+            swarm.replayChokeRound(true);
+            optimisticRounds.add(began);
+            nextOptimistic += optimisticEvery;
+        }
+
+        // what we sent is the outcome being replayed, not an input
+        if (record.flags & WireTrace::kOutgoing) {
+            sent++;
+            continue;
+        }
+
+        if (record.type == WireTrace::kConnect) {
+            auto began = Clock::now();
+            swarm.replayConnect(record.peer);
+            byType[record.type].add(began);
+            continue;
+        }
+        if (record.type == WireTrace::kDisconnect) {
+            auto began = Clock::now();
+            swarm.replayDisconnect(record.peer);
+            byType[record.type].add(began);
+            continue;
+        }
+
+        // rebuild the payload: the bitfield as recorded, otherwise the index and zeros
+        const size_t size = record.length > 1 ? record.length - 1 : 0;
+        PooledBuffer payload = shared.bufferPool->acquire(size);
+        if (!recorded.empty()) {
+            std::memcpy(payload.data(), recorded.data(), std::min(size, recorded.size()));
+        }
+        else {
+            std::memset(payload.data(), 0, size);
+            if (size >= 4) {
+                uint32_t index = htonl(record.index);
+                std::memcpy(payload.data(), &index, 4);
+            }
+        }
+
+        auto began = Clock::now();
+        swarm.replayMessage(record.peer, record.type, payload);
+        byType[record.type].add(began);
+    }
+    const double replayMs = std::chrono::duration<double, std::milli>(Clock::now() - replayStart).count();
+    swarm.stop();
+
+    std::cout << std::endl << "replayed " << std::fixed << std::setprecision(3) << traceNs / 1e9
+              << "s of trace from peer " << reader.selfId << " in " << replayMs << "ms, "
+              << sent << " frames sent in the trace" << std::endl;
+    std::cout << std::left << std::setw(18) << "message" << std::right << std::setw(10) << "count"
+              << std::setw(14) << "total ms" << std::setw(12) << "ns/op" << std::endl;
+    for (int type = 0; type < 256; type++) report(typeName(type), byType[type]);
+    report("preferred round", preferredRounds);
+    report("optimistic round", optimisticRounds);
+    return 0;
+}
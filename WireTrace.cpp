@@ -0,0 +1,144 @@
+#include "WireTrace.h"
+#include <atomic>
+#include <cstring>
+#include <iostream>
+#include <unordered_map>
+
+namespace {
+
+constexpr char kMagic[8] = {'P', '2', 'P', 'W', 'I', 'R', 'E', '1'};
+constexpr size_t kRecordBytes = 24;
+constexpr size_t kFlushBytes = 64 * 1024;
+
+// socket -> (trace, peer) for MessageSender, the count keeps untraced runs off the mutex
+std::mutex registryMutex;
+std::unordered_map<SOCKET, std::pair<WireTrace*, int>> registry;
+std::atomic<int> attached{0};
+
+uint32_t readBigEndian(const uint8_t* p) {
+    return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+}
+
+bool hasIndex(uint8_t type) {
+    return type == 4 || type == 6 || type == 7 || type == 8 || type == 14 || type == 15;
+}
+
+}
+
+WireTrace::~WireTrace() {
+    flush();
+}
+
+bool WireTrace::open(const std::filesystem::path& path, int selfId, uint32_t numPieces) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    out_.open(path, std::ios::binary | std::ios::trunc);
+    if (!out_.is_open()) {
+        std::cerr << "Peer " << selfId << " could not open wire trace " << path << std::endl;
+        return false;
+    }
+    int32_t self = selfId;
+    out_.write(kMagic, sizeof(kMagic));
+    out_.write(reinterpret_cast<const char*>(&self), 4);
+    out_.write(reinterpret_cast<const char*>(&numPieces), 4);
+    buffer_.reserve(kFlushBytes + kRecordBytes);
+    start_ = Clock::now();
+    return true;
+}
+
+void WireTrace::record(int peerId, bool outgoing, uint8_t type, uint32_t length, const uint8_t* payload, size_t payloadLen) {
+    const uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start_).count();
+    const uint32_t index = hasIndex(type) && payloadLen >= 4 ? readBigEndian(payload) : 0;
+    const bool keepPayload = type == 5 && payloadLen > 0;
+    const int32_t peer = peerId;
+    const uint8_t flags = (outgoing ? kOutgoing : 0) | (keepPayload ? kHasPayload : 0);
+    const uint16_t reserved = 0;
+
+    char bytes[kRecordBytes];
+    std::memcpy(bytes, &ns, 8);
+    std::memcpy(bytes + 8, &peer, 4);
+    std::memcpy(bytes + 12, &length, 4);
+    bytes[16] = static_cast<char>(type);
+    bytes[17] = static_cast<char>(flags);
+    std::memcpy(bytes + 18, &reserved, 2);
+    std::memcpy(bytes + 20, &index, 4);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!out_.is_open()) return;
+    buffer_.insert(buffer_.end(), bytes, bytes + kRecordBytes);
+    if (keepPayload) {
+        const uint32_t size = static_cast<uint32_t>(payloadLen);
+        buffer_.insert(buffer_.end(), reinterpret_cast<const char*>(&size), reinterpret_cast<const char*>(&size) + 4);
+        buffer_.insert(buffer_.end(), reinterpret_cast<const char*>(payload), reinterpret_cast<const char*>(payload) + payloadLen);
+    }
+    if (buffer_.size() >= kFlushBytes) flushLocked();
+}
+
+void WireTrace::flush() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    flushLocked();
+}
+
+void WireTrace::flushLocked() {
+    if (!out_.is_open() || buffer_.empty()) return;
+    out_.write(buffer_.data(), static_cast<std::streamsize>(buffer_.size()));
+    out_.flush();
+    buffer_.clear();
+}
+
+void WireTrace::attach(SOCKET sock, WireTrace* trace, int peerId) {
+    std::lock_guard<std::mutex> lock(registryMutex);
+    if (registry.emplace(sock, std::make_pair(trace, peerId)).second) attached++;
+}
+
+void WireTrace::detach(SOCKET sock) {
+    std::lock_guard<std::mutex> lock(registryMutex);
+    if (registry.erase(sock)) attached--;
+}
+
+void WireTrace::onSend(SOCKET sock, const char* frame, size_t len) {
+    if (attached.load(std::memory_order_relaxed) == 0) return;
+    // the handshake is not a frame
+    if (len < 5 || (len == 32 && std::memcmp(frame, "P2PFILESHARINGPROJ", 18) == 0)) return;
+
+    WireTrace* trace;
+    int peerId;
+    {
+        std::lock_guard<std::mutex> lock(registryMutex);
+        auto it = registry.find(sock);
+        if (it == registry.end()) return;
+        trace = it->second.first;
+        peerId = it->second.second;
+    }
+    const auto* bytes = reinterpret_cast<const uint8_t*>(frame);
+    trace->record(peerId, true, bytes[4], readBigEndian(bytes), bytes + 5, len - 5);
+}
+
+bool WireTrace::Reader::open(const std::filesystem::path& path) {
+    in_.open(path, std::ios::binary);
+    char magic[8];
+    int32_t self;
+    if (!in_.read(magic, 8) || std::memcmp(magic, kMagic, 8) != 0) return false;
+    if (!in_.read(reinterpret_cast<char*>(&self), 4) || !in_.read(reinterpret_cast<char*>(&numPieces), 4)) return false;
+    selfId = self;
+    return true;
+}
+
+bool WireTrace::Reader::next(Record& record, std::vector<uint8_t>& payload) {
+    char bytes[kRecordBytes];
+    if (!in_.read(bytes, kRecordBytes)) return false;
+    std::memcpy(&record.ns, bytes, 8);
+    std::memcpy(&record.peer, bytes + 8, 4);
+    std::memcpy(&record.length, bytes + 12, 4);
+    record.type = static_cast<uint8_t>(bytes[16]);
+    record.flags = static_cast<uint8_t>(bytes[17]);
+    std::memcpy(&record.index, bytes + 20, 4);
+
+    payload.clear();
+    if (record.flags & kHasPayload) {
+        uint32_t size;
+        if (!in_.read(reinterpret_cast<char*>(&size), 4)) return false;
+        payload.resize(size);
+        if (!in_.read(reinterpret_cast<char*>(payload.data()), size)) return false;
+    }
+    return true;
+}
@@ -0,0 +1,68 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <mutex>
+#include <chrono>
+#include <fstream>
+#include <filesystem>
+#include <cstdint>
+#include <winsock2.h>
+
+// compact binary record of every frame a peer sends and receives
+// file: "P2PWIRE1", self peer id (int32), piece count (uint32), then records
+// all fields are in host byte order, a trace is read back on the machine that wrote it
+class WireTrace {
+public:
+    // pseudo message types for the start and end of a connection
+    static constexpr uint8_t kConnect = 0xF0;
+    static constexpr uint8_t kDisconnect = 0xF1;
+
+    static constexpr uint8_t kOutgoing = 1;
+    static constexpr uint8_t kHasPayload = 2;  // the frame payload follows the record
+
+    struct Record {
+        uint64_t ns = 0;        // since the trace was opened
+        int32_t peer = 0;       // the other end of the connection
+        uint32_t length = 0;    // the frame's length field, type byte included
+        uint8_t type = 0;
+        uint8_t flags = 0;
+        uint32_t index = 0;     // piece index for HAVE, REQUEST, PIECE, CANCEL, PIECE_REF and REJECT
+    };
+
+    WireTrace() = default;
+    ~WireTrace();
+
+    bool open(const std::filesystem::path& path, int selfId, uint32_t numPieces);
+
+    // payload is kept only for BITFIELD, everything else is summarised by its index
+    void record(int peerId, bool outgoing, uint8_t type, uint32_t length, const uint8_t* payload, size_t payloadLen);
+    void flush();
+
+    // MessageSender records frames sent on attached sockets
+    static void attach(SOCKET sock, WireTrace* trace, int peerId);
+    static void detach(SOCKET sock);
+    // called with the start of every outgoing frame, or the handshake
+    static void onSend(SOCKET sock, const char* frame, size_t len);
+
+    class Reader {
+    public:
+        bool open(const std::filesystem::path& path);
+        bool next(Record& record, std::vector<uint8_t>& payload);
+
+        int selfId = 0;
+        uint32_t numPieces = 0;
+
+    private:
+        std::ifstream in_;
+    };
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    void flushLocked();
+
+    std::mutex mutex_;
+    std::ofstream out_;
+    std::vector<char> buffer_;
+    Clock::time_point start_;
+};
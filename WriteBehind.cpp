@@ -0,0 +1,211 @@
+#include "WriteBehind.h"
+#include "Profile.h"
+#include <algorithm>
+
+namespace {
+
+// caps a coalesced run well under IOV_MAX
+constexpr size_t kMaxRunPieces = 64;
+
+// waits on the calling thread for one async disk callback
+class Latch {
+public:
+    DiskIO::WriteCallback callback() {
+        return [this](bool ok) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            ok_ = ok;
+            done_ = true;
+            cv_.notify_all();
+        };
+    }
+    bool wait() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this]() { return done_; });
+        return ok_;
+    }
+
+private:
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool done_ = false;
+    bool ok_ = false;
+};
+
+}
+
+bool DurabilityPolicy::parseMode(const std::string& name, Mode& out) {
+    if (name == "none") out = None;
+    else if (name == "batch") out = EveryBatch;
+    else if (name == "group") out = GroupCommit;
+    else return false;
+    return true;
+}
+
+WriteBehindQueue::WriteBehindQueue(PieceStore& files, size_t maxBytes, unsigned workers,
+                                   DurabilityPolicy policy, DurableCallback onDurable)
+    : files_(files), maxBytes_(maxBytes), policy_(policy), onDurable_(std::move(onDurable)) {
+    for (unsigned i = 0; i < std::max(1u, workers); i++) {
+        workers_.emplace_back(&WriteBehindQueue::workerLoop, this);
+    }
+}
+
+WriteBehindQueue::~WriteBehindQueue() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    work_.notify_all();
+    space_.notify_all();
+    for (auto& worker : workers_) worker.join();
+}
+
+void WriteBehindQueue::push(uint32_t index, PooledBuffer owner, ByteView data) {
+    const size_t size = data.size;
+    {
+        // a full queue holds the network reader here, which in turn backs off the sender
+        std::unique_lock<std::mutex> lock(mutex_);
+        space_.wait(lock, [this, size]() {
+            return stopping_ || queuedBytes_ == 0 || queuedBytes_ + size <= maxBytes_;
+        });
+        queue_.push_back(Entry{index, std::move(owner), data});
+        queuedBytes_ += size;
+    }
+    work_.notify_one();
+}
+
+void WriteBehindQueue::pushWritten(const std::vector<uint32_t>& indices) {
+    if (indices.empty()) return;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        written_.insert(written_.end(), indices.begin(), indices.end());
+    }
+    work_.notify_one();
+}
+
+void WriteBehindQueue::flush() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    flushing_++;
+    work_.notify_all();
+    idle_.wait(lock, [this]() { return queue_.empty() && written_.empty() && unsynced_.empty() && busy_ == 0; });
+    flushing_--;
+}
+
+void WriteBehindQueue::workerLoop() {
+    profile::nameThread("write behind");
+    while (true) {
+        std::vector<Entry> batch;
+        std::vector<uint32_t> written;
+        std::vector<uint32_t> commit;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            while (true) {
+                if (!queue_.empty() || !written_.empty()) {
+                    // take everything that piled up while the last batch was on disk
+                    batch.swap(queue_);
+                    written.swap(written_);
+                    break;
+                }
+                if (!unsynced_.empty() && (stopping_ || flushing_ > 0 || Clock::now() >= syncDeadline_)) {
+                    commit.swap(unsynced_);
+                    break;
+                }
+                if (stopping_) return;
+                if (unsynced_.empty()) work_.wait(lock);
+                else work_.wait_until(lock, syncDeadline_);
+            }
+            busy_++;
+        }
+
+        size_t bytes = 0;
+        for (const auto& entry : batch) bytes += entry.data.size;
+
+        if (!batch.empty() || !written.empty()) {
+            std::vector<std::pair<uint32_t, bool>> results;
+            if (!batch.empty()) results = writeBatch(batch);
+            batch.clear();
+
+            std::vector<uint32_t> succeeded = std::move(written);
+            for (const auto& [index, ok] : results) {
+                if (!ok) onDurable_(index, false);
+                else succeeded.push_back(index);
+            }
+
+            if (policy_.mode == DurabilityPolicy::None) {
+                for (uint32_t index : succeeded) onDurable_(index, true);
+            }
+            else if (policy_.mode == DurabilityPolicy::EveryBatch) {
+                syncAndReport(succeeded);
+            }
+            else {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (unsynced_.empty()) syncDeadline_ = Clock::now() + policy_.groupDelay;
+                unsynced_.insert(unsynced_.end(), succeeded.begin(), succeeded.end());
+                if (unsynced_.size() >= policy_.groupPieces) commit.swap(unsynced_);
+            }
+        }
+
+        // the pieces' memory is released once written, the group commit only needs indices
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            queuedBytes_ -= bytes;
+        }
+        space_.notify_all();
+
+        if (!commit.empty()) syncAndReport(commit);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            busy_--;
+            if (queue_.empty() && written_.empty() && unsynced_.empty() && busy_ == 0) idle_.notify_all();
+        }
+        // another worker may be waiting on the group deadline we just moved
+        work_.notify_one();
+    }
+}
+
+std::vector<std::pair<uint32_t, bool>> WriteBehindQueue::writeBatch(std::vector<Entry>& batch) {
+    P2P_SPAN("writeBatch");
+    std::sort(batch.begin(), batch.end(), [](const Entry& a, const Entry& b) { return a.index < b.index; });
+    batch.erase(std::unique(batch.begin(), batch.end(),
+                            [](const Entry& a, const Entry& b) { return a.index == b.index; }),
+                batch.end());
+
+    // split into runs of consecutive piece indices
+    std::vector<std::pair<size_t, size_t>> runs;
+    for (size_t i = 0; i < batch.size(); i++) {
+        if (runs.empty() || batch[i].index != batch[i - 1].index + 1 ||
+            i - runs.back().first >= kMaxRunPieces) {
+            runs.emplace_back(i, i + 1);
+        }
+        else {
+            runs.back().second = i + 1;
+        }
+    }
+
+    std::vector<std::unique_ptr<Latch>> latches;
+    for (const auto& [begin, end] : runs) {
+        std::vector<IoSlice> slices;
+        for (size_t i = begin; i < end; i++) {
+            slices.push_back(IoSlice{batch[i].data.data, static_cast<uint32_t>(batch[i].data.size)});
+        }
+        latches.push_back(std::make_unique<Latch>());
+        files_.writeRunAsync(batch[begin].index, slices, latches.back()->callback());
+    }
+
+    std::vector<std::pair<uint32_t, bool>> written;
+    for (size_t r = 0; r < runs.size(); r++) {
+        const bool ok = latches[r]->wait();
+        for (size_t i = runs[r].first; i < runs[r].second; i++) {
+            written.emplace_back(batch[i].index, ok);
+        }
+    }
+    return written;
+}
+
+void WriteBehindQueue::syncAndReport(const std::vector<uint32_t>& indices) {
+    if (indices.empty()) return;
+    Latch synced;
+    files_.syncAsync(synced.callback());
+    const bool durable = synced.wait();
+    for (uint32_t index : indices) onDurable_(index, durable);
+}
@@ -0,0 +1,83 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include "PieceStore.h"
+#include "BufferPool.h"
+
+// when written pieces are flushed to stable storage before being reported
+struct DurabilityPolicy {
+    enum Mode {
+        None,           // report as soon as the write completes
+        EveryBatch,     // fdatasync after every coalesced batch
+        GroupCommit,    // one fdatasync for many pieces, bounded by count and delay
+    };
+    Mode mode = GroupCommit;
+    size_t groupPieces = 64;
+    std::chrono::milliseconds groupDelay{200};
+
+    // none, batch or group
+    static bool parseMode(const std::string& name, Mode& out);
+};
+
+// bounded queue of received pieces written out by dedicated I/O workers
+// adjacent pieces are coalesced into one sequential write, and a piece is only
+// reported once it is durable under the configured policy
+class WriteBehindQueue {
+public:
+    using DurableCallback = std::function<void(uint32_t index, bool ok)>;
+
+    WriteBehindQueue(PieceStore& files, size_t maxBytes, unsigned workers,
+                     DurabilityPolicy policy, DurableCallback onDurable);
+    ~WriteBehindQueue();
+
+    WriteBehindQueue(const WriteBehindQueue&) = delete;
+    WriteBehindQueue& operator=(const WriteBehindQueue&) = delete;
+
+    // blocks the caller while the queue is over its byte budget
+    // owner keeps data alive until the piece has been written
+    void push(uint32_t index, PooledBuffer owner, ByteView data);
+    // pieces the store already wrote some other way, a decoded stripe, synced and reported like pushed ones
+    void pushWritten(const std::vector<uint32_t>& indices);
+
+    // wait until everything pushed so far has been synced and reported
+    void flush();
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Entry {
+        uint32_t index;
+        PooledBuffer owner;
+        ByteView data;
+    };
+
+    void workerLoop();
+    std::vector<std::pair<uint32_t, bool>> writeBatch(std::vector<Entry>& batch);
+    void syncAndReport(const std::vector<uint32_t>& indices);
+
+    PieceStore& files_;
+    size_t maxBytes_;
+    DurabilityPolicy policy_;
+    DurableCallback onDurable_;
+
+    std::mutex mutex_;
+    std::condition_variable work_;
+    std::condition_variable space_;
+    std::condition_variable idle_;
+    std::vector<Entry> queue_;
+    std::vector<uint32_t> written_; // from pushWritten, only the sync and report are left
+    size_t queuedBytes_ = 0;        // queued plus being written
+    std::vector<uint32_t> unsynced_; // written, waiting for the group commit
+    Clock::time_point syncDeadline_;
+    unsigned busy_ = 0;
+    unsigned flushing_ = 0;
+    bool stopping_ = false;
+    std::vector<std::thread> workers_;
+};
@@ -138,10 +138,10 @@ void Logger::logCompletedDownload()
     std::string message = getTimestamp() + ": Peer " + std::to_string(peerID) + " has downloaded the complete file.";
 }
 
-void Logger::init(int newPeerID) {
+void Logger::init(int newPeerID, const std::filesystem::path& baseDir) {
     peerID = newPeerID;
     // if the directory doesn't exist, we create it
-    std::string dir = std::filesystem::current_path().string() + "/project";
+    std::string dir = baseDir.string() + "/project";
     std::filesystem::create_directories(dir);
 
     // if the file doesn't exist, create it
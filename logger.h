@@ -27,7 +27,7 @@ class Logger
     explicit Logger(int peerID);
     ~Logger();
 
-    void init(int newPeerID);
+    void init(int newPeerID, const std::filesystem::path& baseDir = std::filesystem::current_path());
     void logMakeConnection(int otherPeerID);
     void logConnectedFrom(int otherPeerID);
 
@@ -1,4 +1,4 @@
-#include "PeerProcess.h"
+#include "PeerDaemon.h"
 #include "FileHandling.h"
 #include <iostream>
 
@@ -9,7 +9,12 @@ int main(int argc, char* argv[]) {
     }
 
     int myPeerId = std::stoi(argv[2]);
-    PeerProcess mainPeer(myPeerId);
-    mainPeer.start();
-    while(true);
+    PeerDaemon daemon(myPeerId);
+    if (!daemon.load())
+        return 1;
+    daemon.start();
+    // sleep until every peer has every file, then close down and join everything
+    daemon.waitForSwarms();
+    daemon.stop();
+    return 0;
 }
@@ -1,54 +1,114 @@
 #include "messageSender.h"
+#include "WireTrace.h"
+#include "OutboundQueue.h"
+#include "Trace.h"
+#include "Profile.h"
+#ifndef _WIN32
+#include <sys/uio.h>
+#endif
 
-void MessageSender::sendRaw(const std::vector<char>& data)
+void MessageSender::sendRaw(const char* data, size_t dataSize)
 {
-    size_t totalSent = 0;
-    size_t dataSize = data.size();
+    P2P_SPAN("sendRaw");
+    if (queue)
+    {
+        queue->pushControl(data, dataSize);
+        return;
+    }
+    // a replayed connection has no socket behind it
+    if (socket == INVALID_SOCKET) return;
+    WireTrace::onSend(socket, data, dataSize);
+    if (!sendFrame(socket, data, dataSize, nullptr, 0))
+        P2P_ERROR("Peer " << peerID << " sendRaw error");
+}
 
-    while (totalSent < dataSize)
+// header and body go out in one call so nagle never holds the tail of a piece back
+bool sendFrame(SOCKET sock, const char* head, size_t headLen, const char* body, size_t bodyLen)
+{
+    P2P_SPAN("sendFrame");
+    const char* parts[2] = {head, body};
+    size_t lens[2] = {headLen, bodyLen};
+    size_t part = 0;
+
+    while (part < 2)
     {
-        ssize_t bytesSent = send(socket, data.data() + totalSent, dataSize - totalSent, 0);
-        if (bytesSent == SOCKET_ERROR)
+#ifdef _WIN32
+        WSABUF bufs[2];
+        DWORD count = 0;
+        for (size_t i = part; i < 2; i++)
+        {
+            bufs[count].buf = const_cast<char*>(parts[i]);
+            bufs[count].len = static_cast<ULONG>(lens[i]);
+            count++;
+        }
+        DWORD sent = 0;
+        if (WSASend(sock, bufs, count, &sent, 0, nullptr, nullptr) == SOCKET_ERROR)
+            return false;
+        size_t bytesSent = sent;
+#else
+        iovec vecs[2];
+        int count = 0;
+        for (size_t i = part; i < 2; i++)
+        {
+            vecs[count].iov_base = const_cast<char*>(parts[i]);
+            vecs[count].iov_len = lens[i];
+            count++;
+        }
+        msghdr msg{};
+        msg.msg_iov = vecs;
+        msg.msg_iovlen = count;
+        ssize_t r = sendmsg(sock, &msg, 0);
+        if (r < 0)
+        {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        size_t bytesSent = static_cast<size_t>(r);
+#endif
+        // step past whatever a short send got through
+        while (part < 2 && bytesSent >= lens[part])
+        {
+            bytesSent -= lens[part];
+            part++;
+        }
+        if (part < 2)
         {
-            // some sort of issue while sending
-	    std::cerr << "Peer " << peerID << " sendRaw error" << std::endl;
-            return;
+            parts[part] += bytesSent;
+            lens[part] -= bytesSent;
         }
-        // casting to just avoid warning
-        // but i think this shouldn't need a cast(?)
-        totalSent += bytesSent;
     }
+    return true;
 }
 
 // small helper to keep sendHandshake() c l e a n
-std::vector<char> MessageSender::intToBytes(int value)
+void MessageSender::intToBytes(int value, char* out)
 {
     // https://stackoverflow.com/questions/30386769/when-and-how-to-use-c-htonl-function
     // basically converts the peerID to big endian
     uint32_t networkOrder = htonl(value);
-    std::vector<char> bytes(4);
-    std::memcpy(bytes.data(), &networkOrder, 4);
-    return bytes;
+    std::memcpy(out, &networkOrder, 4);
 }
 
 MessageSender::MessageSender(int peerID, int socket) : peerID(peerID), socket(socket) {}
 
-void MessageSender::sendHandshake()
+MessageSender::MessageSender(int peerID, std::shared_ptr<OutboundQueue> queue) : peerID(peerID), queue(std::move(queue)) {}
+
+void MessageSender::sendHandshake(uint32_t swarmId)
 {
-    std::vector<char> handshake(32);
+    char handshake[32];
 
     // handshake header
     const char* header = "P2PFILESHARINGPROJ";
-    std::memcpy(handshake.data(), header, 18);
+    std::memcpy(handshake, header, 18);
 
-    // zero bits
-    std::memset(handshake.data() + 18, 0, 10);
+    // zero bits, the first four carry the swarm id
+    std::memset(handshake + 18, 0, 10);
+    intToBytes(static_cast<int>(swarmId), handshake + 18);
 
     // peer ID
-    std::vector<char> peerIDBytes = intToBytes(peerID);
-    std::memcpy(handshake.data() + 18 + 10, peerIDBytes.data(), 4);
+    intToBytes(peerID, handshake + 18 + 10);
 
-    sendRaw(handshake);
+    sendRaw(handshake, sizeof(handshake));
 }
 
 std::vector<char> MessageSender::buildMessage(uint8_t type, const std::vector<char>& payload)
@@ -65,31 +125,59 @@ std::vector<char> MessageSender::buildMessage(uint8_t type, const std::vector<ch
     return message;
 }
 
+// messages with no payload are built on the stack
+void MessageSender::sendControl(uint8_t type)
+{
+    char frame[5];
+    intToBytes(1, frame);
+    frame[4] = static_cast<char>(type);
+    sendRaw(frame, sizeof(frame));
+}
+
+// messages whose payload is a single piece index
+void MessageSender::sendIndexed(uint8_t type, int index)
+{
+    char frame[9];
+    intToBytes(5, frame);
+    frame[4] = static_cast<char>(type);
+    intToBytes(index, frame + 5);
+    sendRaw(frame, sizeof(frame));
+}
+
+// PING and PONG carry an opaque 64 bit stamp, high half first
+void MessageSender::sendStamped(uint8_t type, uint64_t stamp)
+{
+    char frame[13];
+    intToBytes(9, frame);
+    frame[4] = static_cast<char>(type);
+    intToBytes(static_cast<int>(stamp >> 32), frame + 5);
+    intToBytes(static_cast<int>(stamp & 0xffffffffu), frame + 9);
+    sendRaw(frame, sizeof(frame));
+}
 
 void MessageSender::sendChoke()
 {
-    sendRaw(buildMessage(0));
+    sendControl(0);
 }
 
 void MessageSender::sendUnchoke()
 {
-    sendRaw(buildMessage(1));
+    sendControl(1);
 }
 
 void MessageSender::sendInterested()
 {
-    sendRaw(buildMessage(2));
+    sendControl(2);
 }
 
 void MessageSender::sendNotInterested()
 {
-    sendRaw(buildMessage(3));
+    sendControl(3);
 }
 
 void MessageSender::sendHave(int pieceIndex)
 {
-    std::vector<char> payload = intToBytes(pieceIndex);
-    sendRaw(buildMessage(4, payload));
+    sendIndexed(4, pieceIndex);
 }
 
 void MessageSender::sendBitfield(const std::vector<bool> &bitfield)
@@ -104,18 +192,75 @@ void MessageSender::sendBitfield(const std::vector<bool> &bitfield)
             payload[i / 8] |= (1 << (7 - (i % 8)));
         }
     }
-    sendRaw(buildMessage(5, payload));
+    std::vector<char> message = buildMessage(5, payload);
+    sendRaw(message.data(), message.size());
 }
 
 void MessageSender::sendRequest(int pieceIndex)
 {
-    std::vector<char> payload = intToBytes(pieceIndex);
-    sendRaw(buildMessage(6, payload));
+    sendIndexed(6, pieceIndex);
+}
+
+// the piece arrived from someone else, drop our request for it
+void MessageSender::sendCancel(int pieceIndex)
+{
+    sendIndexed(8, pieceIndex);
 }
 
-void MessageSender::sendPiece(int pieceIndex, const std::vector<char> &pieceData)
+void MessageSender::sendPing(uint64_t stamp)
 {
-    std::vector<char> payload = intToBytes(pieceIndex);
-    payload.insert(payload.end(), pieceData.begin(), pieceData.end());
-    sendRaw(buildMessage(7, payload));
-}
\ No newline at end of file
+    sendStamped(9, stamp);
+}
+
+void MessageSender::sendPong(uint64_t stamp)
+{
+    sendStamped(10, stamp);
+}
+
+void MessageSender::sendUploadOnly(bool uploadOnly)
+{
+    char frame[6];
+    intToBytes(2, frame);
+    frame[4] = 11;
+    frame[5] = uploadOnly ? 1 : 0;
+    sendRaw(frame, sizeof(frame));
+}
+
+void MessageSender::sendLocalFile(const std::string& path)
+{
+    std::vector<char> message = buildMessage(12, std::vector<char>(path.begin(), path.end()));
+    sendRaw(message.data(), message.size());
+}
+
+void MessageSender::sendLocalMapped()
+{
+    sendControl(13);
+}
+
+void MessageSender::sendPieceRef(int pieceIndex)
+{
+    sendIndexed(14, pieceIndex);
+}
+
+void MessageSender::sendReject(int pieceIndex)
+{
+    sendIndexed(15, pieceIndex);
+}
+
+void MessageSender::sendPiece(int pieceIndex, const uint8_t* pieceData, size_t len)
+{
+    char header[9];
+    intToBytes(static_cast<int>(1 + 4 + len), header);
+    header[4] = 7;
+    intToBytes(pieceIndex, header + 5);
+    if (queue) queue->pushPiece(header, sizeof(header), pieceData, len);
+}
+
+void MessageSender::sendPiece(int pieceIndex, PooledBuffer owner, ByteView data)
+{
+    char header[9];
+    intToBytes(static_cast<int>(1 + 4 + data.size), header);
+    header[4] = 7;
+    intToBytes(pieceIndex, header + 5);
+    if (queue) queue->pushPiece(header, sizeof(header), std::move(owner), data);
+}
@@ -5,23 +5,41 @@
 #include <vector>
 #include <cerrno>
 #include <cstring>
+#include <string>
 #include <winsock2.h>
 #include <cstdint>
+#include <memory>
+#include "BufferPool.h"
 
+class OutboundQueue;
+
+// writes a frame header and its body with one gather send per try, false on a socket error
+bool sendFrame(SOCKET sock, const char* head, size_t headLen, const char* body, size_t bodyLen);
+
+// builds frames and hands them to the connection's outbound queue,
+// a sender made from a bare socket writes straight to it (the handshake)
+// a sender without either drops everything, as for a replayed connection
 class MessageSender
 {
     private:
     int peerID;
-    int socket;
+    int socket = INVALID_SOCKET;
+    std::shared_ptr<OutboundQueue> queue;
 
-    void sendRaw(const std::vector<char>& data);
-    std::vector<char> intToBytes(int value);
+    // control frames
+    void sendRaw(const char* data, size_t len);
+    void sendControl(uint8_t type);
+    void sendIndexed(uint8_t type, int index);
+    void sendStamped(uint8_t type, uint64_t stamp);
+    static void intToBytes(int value, char* out);
 
     public:
     MessageSender(int peerID, int socket);
+    MessageSender(int peerID, std::shared_ptr<OutboundQueue> queue);
     std::vector<char> buildMessage(uint8_t type, const std::vector<char>& payload = {});
 
-    void sendHandshake();
+    // the swarm id goes in the first four of the zero bytes, 0 names no swarm
+    void sendHandshake(uint32_t swarmId = 0);
 
     void sendChoke();
     void sendUnchoke();
@@ -30,5 +48,22 @@ class MessageSender
     void sendHave(int pieceIndex);
     void sendBitfield(const std::vector<bool>& bitfield);
     void sendRequest(int pieceIndex);
-    void sendPiece(int pieceIndex, const std::vector<char>& pieceData);
+    // the bytes are copied, they need not outlive the call
+    void sendPiece(int pieceIndex, const uint8_t* pieceData, size_t len);
+    // owner keeps the bytes alive until they are written, no copy
+    void sendPiece(int pieceIndex, PooledBuffer owner, ByteView data);
+    void sendCancel(int pieceIndex);
+    // stamp is echoed back in the PONG, the difference is the round trip
+    void sendPing(uint64_t stamp);
+    void sendPong(uint64_t stamp);
+    // we want nothing more from them, see PiecePriorities, false takes it back
+    void sendUploadOnly(bool uploadOnly);
+    // same-host connections only, see LocalTransport.h: where our file is, so they can map it
+    void sendLocalFile(const std::string& path);
+    // we mapped their file, they may answer our requests with PIECE_REF
+    void sendLocalMapped();
+    // the piece is in the file we told them about, they copy it from there
+    void sendPieceRef(int pieceIndex);
+    // we no longer hold a piece we advertised, they stop asking us for it
+    void sendReject(int pieceIndex);
 };
\ No newline at end of file
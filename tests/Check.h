@@ -0,0 +1,25 @@
+#pragma once
+#include <iostream>
+
+// plain checks for the unit tests, no framework: a failed check is reported and the test
+// carries on, and main returns testResult() so ctest sees the failure
+namespace check {
+
+inline int& failures() {
+    static int count = 0;
+    return count;
+}
+
+}
+
+#define CHECK(condition)                                                                       \
+    do {                                                                                       \
+        if (!(condition)) {                                                                    \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" #condition ") failed" << std::endl; \
+            check::failures()++;                                                               \
+        }                                                                                      \
+    } while (0)
+
+inline int testResult() {
+    return check::failures() == 0 ? 0 : 1;
+}
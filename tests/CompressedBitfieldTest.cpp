@@ -0,0 +1,136 @@
+#include "CompressedBitfield.h"
+#include "Check.h"
+#include <algorithm>
+#include <random>
+
+namespace {
+
+constexpr size_t kChunk = CompressedBitfield::kChunkBits;
+
+// every bit, the count and the forEach order against a plain vector<bool>
+bool matches(const CompressedBitfield& compressed, const std::vector<bool>& model) {
+    size_t held = 0;
+    for (size_t i = 0; i < model.size(); i++) {
+        if (compressed.hasPiece(i) != model[i]) return false;
+        if (model[i]) held++;
+    }
+    if (compressed.count() != held || compressed.isComplete() != (held == model.size())) return false;
+
+    std::vector<size_t> visited;
+    compressed.forEach([&visited](size_t index) { visited.push_back(index); });
+    if (visited.size() != held) return false;
+    for (size_t i = 0; i < visited.size(); i++) {
+        if (!model[visited[i]] || (i > 0 && visited[i] <= visited[i - 1])) return false;
+    }
+    return true;
+}
+
+// fills a chunk and empties it again, so it passes array -> bitmap -> inverted and back,
+// with a short last chunk along the way
+void conversionsAgainstModel() {
+    const size_t pieces = 2 * kChunk + 1000;
+    CompressedBitfield compressed(pieces);
+    std::vector<bool> model(pieces, false);
+    CHECK(matches(compressed, model));
+
+    std::mt19937 rng(42);
+    std::vector<size_t> order(pieces);
+    for (size_t i = 0; i < pieces; i++) order[i] = i;
+    std::shuffle(order.begin(), order.end(), rng);
+
+    // checked at a few fill levels, each one lands in a different form
+    const size_t checkpoints[] = {10, 3000, pieces / 2, pieces - 3000, pieces - 1, pieces};
+    size_t next = 0;
+    for (size_t n = 0; n < pieces; n++) {
+        CHECK(compressed.setPiece(order[n]));
+        CHECK(!compressed.setPiece(order[n]));
+        model[order[n]] = true;
+        if (n + 1 == checkpoints[next]) {
+            CHECK(matches(compressed, model));
+            next++;
+        }
+    }
+    CHECK(compressed.isComplete());
+
+    std::shuffle(order.begin(), order.end(), rng);
+    next = 0;
+    for (size_t n = 0; n < pieces; n++) {
+        CHECK(compressed.clearPiece(order[n]));
+        CHECK(!compressed.clearPiece(order[n]));
+        model[order[n]] = false;
+        if (n + 1 == checkpoints[next]) {
+            CHECK(matches(compressed, model));
+            next++;
+        }
+    }
+    CHECK(compressed.count() == 0);
+}
+
+// an empty or complete chunk is a few bytes, a half full one is a bitmap
+void sizes() {
+    const size_t pieces = 4 * kChunk;
+    CompressedBitfield empty(pieces);
+    CompressedBitfield full(pieces, true);
+    CompressedBitfield half(pieces);
+    for (size_t i = 0; i < pieces; i += 2) half.setPiece(i);
+
+    CHECK(full.isComplete() && full.count() == pieces);
+    CHECK(empty.memoryUsage() < 1024 && full.memoryUsage() < 1024);
+    CHECK(half.memoryUsage() >= pieces / 8);
+    CHECK(half.memoryUsage() < pieces / 8 + 1024);
+
+    // one piece missing from a complete chunk stays an inverted list
+    CHECK(full.clearPiece(kChunk + 5));
+    CHECK(!full.isComplete() && !full.hasPiece(kChunk + 5) && full.hasPiece(kChunk + 4));
+    CHECK(full.memoryUsage() < 1024);
+}
+
+// the BITFIELD wire format: big-endian bits, spare bits and a short message ignored
+void fromWire() {
+    const size_t pieces = 20;
+    std::vector<uint8_t> bytes{0x80, 0x01, 0xff};
+    CompressedBitfield compressed = CompressedBitfield::fromBytes(bytes.data(), bytes.size(), pieces);
+    std::vector<bool> model(pieces, false);
+    model[0] = true;
+    model[15] = true;
+    for (size_t i = 16; i < 20; i++) model[i] = true;
+    CHECK(matches(compressed, model));
+
+    CompressedBitfield shortMessage = CompressedBitfield::fromBytes(bytes.data(), 1, pieces);
+    CHECK(shortMessage.count() == 1 && shortMessage.hasPiece(0));
+
+    // the round trip through BitfieldManager's encoding
+    BitfieldManager ours(3 * kChunk / 2, false);
+    for (size_t i = 0; i < ours.getSize(); i += 7) ours.setPiece(i);
+    std::vector<uint8_t> wire = ours.toBytes();
+    CompressedBitfield theirs = CompressedBitfield::fromBytes(wire.data(), wire.size(), ours.getSize());
+    CHECK(matches(theirs, ours.getBits()));
+}
+
+// pieces they have that we lack
+void notIn() {
+    const size_t pieces = kChunk + 10;
+    BitfieldManager ours(pieces, false);
+    CompressedBitfield theirs(pieces);
+    for (size_t i = 0; i < pieces; i += 3) theirs.setPiece(i);
+    for (size_t i = 0; i < pieces; i += 6) ours.setPiece(i);
+
+    size_t expected = 0;
+    for (size_t i = 0; i < pieces; i += 3) {
+        if (i % 6 != 0) expected++;
+    }
+    CHECK(theirs.countNotIn(ours) == expected);
+    bool onlyMissing = true;
+    theirs.forEachNotIn(ours, [&](size_t index) { onlyMissing = onlyMissing && index % 3 == 0 && index % 6 != 0; });
+    CHECK(onlyMissing);
+}
+
+}
+
+int main() {
+    conversionsAgainstModel();
+    sizes();
+    fromWire();
+    notIn();
+    return testResult();
+}
@@ -0,0 +1,66 @@
+#include "DiskIO.h"
+#include "Check.h"
+#include <fstream>
+#include <future>
+#include <numeric>
+
+namespace {
+
+bool waitWrite(const std::function<void(DiskIO::WriteCallback)>& submit) {
+    std::promise<bool> done;
+    submit([&done](bool ok) { done.set_value(ok); });
+    return done.get_future().get();
+}
+
+std::vector<uint8_t> readBack(DiskIO& io, int fileId, uint64_t offset, uint32_t len) {
+    std::promise<std::vector<uint8_t>> done;
+    io.read(fileId, offset, len, [&done](bool ok, const uint8_t* data, size_t size) {
+        done.set_value(ok ? std::vector<uint8_t>(data, data + size) : std::vector<uint8_t>());
+    });
+    return done.get_future().get();
+}
+
+// a write, a gathered write over the next two blocks, a sync, then every byte read back
+void roundTrip(const std::string& backend) {
+    DiskIOOptions options;
+    options.backend = backend;
+    options.bufferSize = 4096;
+    auto io = DiskIO::create(options);
+    std::cout << backend << " asked for, " << io->name() << " running" << std::endl;
+
+    const auto dir = std::filesystem::temp_directory_path() / "p2p_diskio_test";
+    std::filesystem::create_directories(dir);
+    const auto path = dir / ("blocks_" + backend);
+    // the backends open files, FileHandling is what creates them
+    std::ofstream(path, std::ios::binary | std::ios::trunc).close();
+    int fileId = io->openFile(path, true);
+    CHECK(fileId >= 0);
+
+    std::vector<uint8_t> bytes(3 * 4096);
+    std::iota(bytes.begin(), bytes.end(), uint8_t(7));
+    CHECK(waitWrite([&](DiskIO::WriteCallback cb) { io->write(fileId, 0, bytes.data(), 4096, cb); }));
+    std::vector<IoSlice> slices{{bytes.data() + 4096, 4096}, {bytes.data() + 8192, 4096}};
+    CHECK(waitWrite([&](DiskIO::WriteCallback cb) { io->writev(fileId, 4096, slices, cb); }));
+    CHECK(waitWrite([&](DiskIO::WriteCallback cb) { io->sync(fileId, cb); }));
+
+    CHECK(readBack(*io, fileId, 0, 3 * 4096) == bytes);
+    std::vector<uint8_t> middle(bytes.begin() + 4000, bytes.begin() + 5000);
+    CHECK(readBack(*io, fileId, 4000, 1000) == middle);
+
+    // the id follows the file through a rename
+    std::error_code ec;
+    CHECK(io->renameFile(fileId, path.string() + ".renamed", ec));
+    CHECK(readBack(*io, fileId, 0, 4096) == std::vector<uint8_t>(bytes.begin(), bytes.begin() + 4096));
+
+    io->drain();
+    io->closeFile(fileId);
+    std::filesystem::remove_all(dir, ec);
+}
+
+}
+
+int main() {
+    roundTrip("threads");
+    roundTrip("auto");
+    return testResult();
+}
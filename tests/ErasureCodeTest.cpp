@@ -0,0 +1,102 @@
+#include "ErasureCode.h"
+#include "Check.h"
+#include <algorithm>
+#include <random>
+
+namespace {
+
+using Block = std::vector<uint8_t>;
+
+// encodes k random blocks, loses the given source rows, and rebuilds them from any k survivors
+bool roundTrip(unsigned k, unsigned m, size_t len, const std::vector<unsigned>& lost, std::mt19937& rng) {
+    ReedSolomon code(k, m);
+    std::vector<Block> blocks(k + m, Block(len));
+    for (unsigned i = 0; i < k; i++) {
+        for (auto& byte : blocks[i]) byte = static_cast<uint8_t>(rng());
+    }
+    std::vector<const uint8_t*> source;
+    std::vector<uint8_t*> parity;
+    for (unsigned i = 0; i < k; i++) source.push_back(blocks[i].data());
+    for (unsigned j = 0; j < m; j++) parity.push_back(blocks[k + j].data());
+    code.encode(source, parity, len);
+
+    // the survivors, in a shuffled order, cut to k rows
+    std::vector<unsigned> rows;
+    for (unsigned r = 0; r < k + m; r++) {
+        if (std::find(lost.begin(), lost.end(), r) == lost.end()) rows.push_back(r);
+    }
+    std::shuffle(rows.begin(), rows.end(), rng);
+    rows.resize(k);
+    std::vector<const uint8_t*> held;
+    for (unsigned r : rows) held.push_back(blocks[r].data());
+
+    std::vector<Block> rebuilt(lost.size(), Block(len));
+    std::vector<uint8_t*> out;
+    for (auto& block : rebuilt) out.push_back(block.data());
+    if (!code.decode(rows, held, lost, out, len)) return false;
+    for (size_t i = 0; i < lost.size(); i++) {
+        if (rebuilt[i] != blocks[lost[i]]) return false;
+    }
+    return true;
+}
+
+// every way of losing up to m source blocks of a small code, and random losses in larger ones,
+// with lengths that leave a tail after the vector kernels' 16 and 32 byte steps
+void roundTrips() {
+    std::mt19937 rng(7);
+    for (unsigned a = 0; a < 4; a++) {
+        CHECK(roundTrip(4, 2, 1000, {a}, rng));
+        for (unsigned b = a + 1; b < 4; b++) CHECK(roundTrip(4, 2, 1000, {a, b}, rng));
+    }
+    CHECK(roundTrip(1, 1, 33, {0}, rng));
+    CHECK(roundTrip(3, 5, 17, {0, 1, 2}, rng));
+
+    for (auto [k, m] : {std::pair<unsigned, unsigned>{10, 4}, {16, 4}, {32, 8}, {200, 56}}) {
+        for (int trial = 0; trial < 5; trial++) {
+            std::vector<unsigned> sources(k);
+            for (unsigned i = 0; i < k; i++) sources[i] = i;
+            std::shuffle(sources.begin(), sources.end(), rng);
+            sources.resize(1 + rng() % m);
+            CHECK(roundTrip(k, m, 4096 + 7, sources, rng));
+        }
+    }
+}
+
+// decode wants k distinct rows, all of them in range
+void badRows() {
+    ReedSolomon code(3, 2);
+    Block a(8), b(8), c(8), out(8);
+    std::vector<const uint8_t*> held{a.data(), b.data(), c.data()};
+    std::vector<uint8_t*> outs{out.data()};
+    CHECK(!code.decode({0, 0, 3}, held, {1}, outs, 8));
+    CHECK(!code.decode({0, 3, 5}, held, {1}, outs, 8));
+    CHECK(!code.decode({0, 3}, {a.data(), b.data()}, {1}, outs, 8));
+}
+
+// parity is numbered after every source piece, and the last stripe may be short
+void layout() {
+    ErasureLayout layout;
+    layout.sourcePieces = 10;
+    layout.stripeSource = 4;
+    layout.stripeParity = 2;
+    CHECK(layout.enabled());
+    CHECK(layout.stripes() == 3);
+    CHECK(layout.totalPieces() == 16);
+    CHECK(layout.sourceCount(2) == 2);
+    CHECK((layout.members(1) == std::vector<uint32_t>{4, 5, 6, 7, 12, 13}));
+    CHECK((layout.members(2) == std::vector<uint32_t>{8, 9, 14, 15}));
+    CHECK(layout.stripeOf(9) == 2 && layout.stripeOf(12) == 1 && layout.isParity(10) && !layout.isParity(9));
+
+    layout.stripeParity = 0;
+    CHECK(!layout.enabled() && layout.stripes() == 0 && layout.totalPieces() == 10);
+}
+
+}
+
+int main() {
+    std::cout << "kernel " << ReedSolomon::kernelName() << std::endl;
+    roundTrips();
+    badRows();
+    layout();
+    return testResult();
+}
@@ -0,0 +1,110 @@
+#include "RequestTracker.h"
+#include "Check.h"
+#include <algorithm>
+#include <thread>
+
+namespace {
+
+using namespace std::chrono_literals;
+
+RequestPolicy shortPolicy() {
+    RequestPolicy policy;
+    policy.window = 4;
+    policy.minTimeout = 50ms;
+    policy.maxTimeout = 1000ms;
+    policy.snubTimeout = 400ms;
+    return policy;
+}
+
+bool expiredHas(const RequestTracker::Tick& tick, int piece, int peerId) {
+    return std::find(tick.expired.begin(), tick.expired.end(), std::make_pair(piece, peerId)) != tick.expired.end();
+}
+
+// a peer we have no rate for gets four times the floor, and an overdue request is dropped once
+void deadlineWithoutRate() {
+    RequestTracker tracker(shortPolicy());
+    CHECK(tracker.add(1, 7, 16384));
+    CHECK(tracker.outstanding(7) == 1);
+
+    std::this_thread::sleep_for(100ms);
+    CHECK(tracker.expire().expired.empty());
+    CHECK(tracker.isRequestedFrom(1, 7));
+
+    std::this_thread::sleep_for(200ms);
+    RequestTracker::Tick tick = tracker.expire();
+    CHECK(tick.expired.size() == 1 && expiredHas(tick, 1, 7));
+    CHECK(!tracker.isRequested(1));
+    CHECK(tracker.outstanding(7) == 0);
+    CHECK(tracker.expire().expired.empty());
+}
+
+// only endgame asks a second peer for a piece, and never the same one twice
+void duplicates() {
+    RequestTracker tracker(shortPolicy());
+    CHECK(tracker.add(2, 7, 100));
+    CHECK(!tracker.add(2, 8, 100));
+    CHECK(tracker.add(2, 8, 100, true));
+    CHECK(!tracker.add(2, 8, 100, true));
+    CHECK(tracker.piecesRequested() == 1);
+
+    // whoever delivers, the others are returned for a CANCEL
+    std::vector<int> others = tracker.received(2, 8, 100);
+    CHECK(others == std::vector<int>{7});
+    CHECK(!tracker.isRequested(2));
+    CHECK(tracker.outstanding(7) == 0 && tracker.outstanding(8) == 0);
+}
+
+// a choke or REJECT gives pieces back, only those nobody else was asked for are free again
+void releaseAndRefuse() {
+    RequestTracker tracker(shortPolicy());
+    tracker.add(3, 7, 100);
+    tracker.add(4, 7, 100);
+    tracker.add(4, 8, 100, true);
+    std::vector<int> released = tracker.releasePeer(7);
+    CHECK(released == std::vector<int>{3});
+    CHECK(tracker.isRequestedFrom(4, 8));
+
+    tracker.add(5, 7, 100);
+    tracker.add(5, 8, 100, true);
+    CHECK(!tracker.refused(5, 7));
+    CHECK(tracker.refused(5, 8));
+    CHECK(!tracker.isRequested(5));
+    CHECK(tracker.outstanding(8) == 1);
+}
+
+// a peer that owes us something and sends nothing for the snub timeout gets a window of one,
+// flagged once, until it delivers again
+void snubbing() {
+    RequestTracker tracker(shortPolicy());
+    tracker.add(6, 7, 100);
+    tracker.add(7, 9, 100);
+    CHECK(tracker.window(7) == 4);
+
+    std::this_thread::sleep_for(450ms);
+    RequestTracker::Tick tick = tracker.expire();
+    CHECK(std::find(tick.snubbed.begin(), tick.snubbed.end(), 7) != tick.snubbed.end());
+    CHECK(tracker.isSnubbed(7));
+    CHECK(tracker.window(7) == 1);
+    CHECK(tracker.expire().snubbed.empty());
+
+    // a piece from them lifts it
+    tracker.add(8, 7, 100);
+    tracker.received(8, 7, 100);
+    CHECK(!tracker.isSnubbed(7));
+    CHECK(tracker.window(7) == 4);
+
+    // a new window applies to every peer that is not snubbed, known or not
+    tracker.setWindow(2);
+    CHECK(tracker.window(10) == 2);
+    CHECK(!tracker.isSnubbed(10));
+}
+
+}
+
+int main() {
+    deadlineWithoutRate();
+    duplicates();
+    releaseAndRefuse();
+    snubbing();
+    return testResult();
+}
@@ -0,0 +1,60 @@
+#include "Sha256.h"
+#include "Check.h"
+#include <algorithm>
+#include <vector>
+
+namespace {
+
+std::string hexOf(const std::string& text) {
+    return Sha256::toHex(Sha256::hash(reinterpret_cast<const uint8_t*>(text.data()), text.size()));
+}
+
+// the FIPS 180-4 examples, and lengths either side of where the padding spills into another block
+void knownAnswers() {
+    CHECK(hexOf("") == "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+    CHECK(hexOf("abc") == "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+    CHECK(hexOf("abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq") ==
+          "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1");
+    CHECK(hexOf("abcdefghbcdefghicdefghijdefghijkefghijklfghijklmghijklmnhijklmnoijklmnopjklmnopqklmnopqrlmnopqrsmnopqrstnopqrstu") ==
+          "cf5b16a778af8380036ce59e7b0492370b249b11e8f07a51afac45037afee9d1");
+    CHECK(hexOf(std::string(55, 'a')) == "9f4390f8d30c2dd92ec9f095b65e2b9ae9b0a925a5258e241c9f1e910f734318");
+    CHECK(hexOf(std::string(56, 'a')) == "b35439a4ac6f0948b6d6f9e3c6af0f5f590ce20f1bde7090ef7970686ec6738a");
+    CHECK(hexOf(std::string(64, 'a')) == "ffe054fe7ae0cb6dc65c3af9b61d5209f439851db43d0ba5997337df154668eb");
+    CHECK(hexOf(std::string(1000000, 'a')) == "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0");
+}
+
+// fed in pieces of any size, the digest is the same as in one call
+void incremental() {
+    std::vector<uint8_t> data(1000);
+    for (size_t i = 0; i < data.size(); i++) data[i] = static_cast<uint8_t>(i * 31 + 7);
+    const Sha256Digest whole = Sha256::hash(data.data(), data.size());
+
+    for (size_t step : {1, 3, 63, 64, 65, 200}) {
+        Sha256 sha;
+        for (size_t offset = 0; offset < data.size(); offset += step) {
+            sha.update(data.data() + offset, std::min(step, data.size() - offset));
+        }
+        CHECK(sha.finish() == whole);
+    }
+}
+
+// the PieceHashes file format
+void hex() {
+    const std::string text = "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad";
+    Sha256Digest digest;
+    CHECK(Sha256::fromHex(text, digest));
+    CHECK(Sha256::toHex(digest) == text);
+    CHECK(Sha256::fromHex("BA7816BF8F01CFEA414140DE5DAE2223B00361A396177A9CB410FF61F20015AD", digest) &&
+          Sha256::toHex(digest) == text);
+    CHECK(!Sha256::fromHex(text.substr(1), digest));
+    CHECK(!Sha256::fromHex(text.substr(0, 63) + "g", digest));
+}
+
+}
+
+int main() {
+    knownAnswers();
+    incremental();
+    hex();
+    return testResult();
+}
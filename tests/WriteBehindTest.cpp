@@ -0,0 +1,156 @@
+#include "WriteBehind.h"
+#include "Check.h"
+#include <condition_variable>
+#include <map>
+
+namespace {
+
+constexpr uint32_t kPieceSize = 16;
+
+// records the runs the queue writes and the syncs it asks for, writes wait at a gate until it opens
+class RecordingStore : public PieceStore {
+public:
+    RecordingStore() : PieceStore(uint64_t(200) * kPieceSize, kPieceSize, false) {}
+
+    const char* name() const override {
+        return "recording";
+    }
+    bool init() override {
+        return true;
+    }
+    std::optional<std::vector<uint8_t>> readPiece(uint32_t) const override {
+        return std::nullopt;
+    }
+    bool finalize() override {
+        return true;
+    }
+
+    void writeRunAsync(uint32_t firstIndex, const std::vector<IoSlice>& pieces, DiskIO::WriteCallback cb) override {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            writing = true;
+            changed.notify_all();
+            changed.wait(lock, [this]() { return open; });
+            runs.emplace_back(firstIndex, pieces.size());
+        }
+        cb(firstIndex != failing);
+    }
+    void syncAsync(DiskIO::WriteCallback cb) override {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            syncs++;
+        }
+        cb(true);
+    }
+
+    void waitUntilWriting() {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [this]() { return writing; });
+    }
+    void openGate() {
+        std::lock_guard<std::mutex> lock(mutex);
+        open = true;
+        changed.notify_all();
+    }
+
+    std::mutex mutex;
+    std::condition_variable changed;
+    bool writing = false;
+    bool open = false;
+    uint32_t failing = UINT32_MAX;
+    std::vector<std::pair<uint32_t, size_t>> runs;   // first index, pieces
+    int syncs = 0;
+
+protected:
+    bool storePiece(uint32_t, const uint8_t*, size_t) override {
+        return true;
+    }
+};
+
+// index -> ok for every report, and how many reports there were
+struct Reports {
+    std::mutex mutex;
+    std::map<uint32_t, bool> results;
+    int count = 0;
+
+    WriteBehindQueue::DurableCallback callback() {
+        return [this](uint32_t index, bool ok) {
+            std::lock_guard<std::mutex> lock(mutex);
+            results[index] = ok;
+            count++;
+        };
+    }
+};
+
+const uint8_t kBytes[kPieceSize] = {};
+
+// what piles up while a write is on disk goes out as sorted runs of consecutive pieces, duplicates once
+void coalescesWhileBusy() {
+    RecordingStore store;
+    Reports reports;
+    DurabilityPolicy policy;
+    policy.mode = DurabilityPolicy::EveryBatch;
+    WriteBehindQueue queue(store, 1 << 20, 1, policy, reports.callback());
+
+    queue.push(100, PooledBuffer(), ByteView(kBytes, kPieceSize));
+    store.waitUntilWriting();
+    for (uint32_t index : {3u, 1u, 2u, 0u, 2u, 7u, 6u}) queue.push(index, PooledBuffer(), ByteView(kBytes, kPieceSize));
+    store.openGate();
+    queue.flush();
+
+    std::vector<std::pair<uint32_t, size_t>> expected{{100, 1}, {0, 4}, {6, 2}};
+    CHECK(store.runs == expected);
+    // one sync per batch
+    CHECK(store.syncs == 2);
+    CHECK(reports.count == 7);
+    for (uint32_t index : {0u, 1u, 2u, 3u, 6u, 7u, 100u}) CHECK(reports.results.count(index) && reports.results[index]);
+}
+
+// a group commit syncs once for the whole group, a failed run is reported at once and never synced
+void groupCommitAndFailure() {
+    RecordingStore store;
+    store.open = true;
+    store.failing = 50;
+    Reports reports;
+    DurabilityPolicy policy;
+    policy.mode = DurabilityPolicy::GroupCommit;
+    policy.groupPieces = 1000;
+    policy.groupDelay = std::chrono::milliseconds(10000);
+    WriteBehindQueue queue(store, 1 << 20, 1, policy, reports.callback());
+
+    for (uint32_t index = 10; index < 20; index++) queue.push(index, PooledBuffer(), ByteView(kBytes, kPieceSize));
+    queue.push(50, PooledBuffer(), ByteView(kBytes, kPieceSize));
+    // pieces written some other way join the same commit
+    queue.pushWritten({60, 61});
+    queue.flush();
+
+    CHECK(store.syncs == 1);
+    CHECK(reports.count == 13);
+    CHECK(reports.results.count(50) && !reports.results[50]);
+    for (uint32_t index = 10; index < 20; index++) CHECK(reports.results[index]);
+    CHECK(reports.results[60] && reports.results[61]);
+}
+
+// with no durability policy nothing is synced
+void noSync() {
+    RecordingStore store;
+    store.open = true;
+    Reports reports;
+    DurabilityPolicy policy;
+    policy.mode = DurabilityPolicy::None;
+    WriteBehindQueue queue(store, 1 << 20, 2, policy, reports.callback());
+
+    for (uint32_t index = 0; index < 32; index++) queue.push(index, PooledBuffer(), ByteView(kBytes, kPieceSize));
+    queue.flush();
+    CHECK(store.syncs == 0);
+    CHECK(reports.count == 32);
+}
+
+}
+
+int main() {
+    coalescesWhileBusy();
+    groupCommitAndFailure();
+    noSync();
+    return testResult();
+}